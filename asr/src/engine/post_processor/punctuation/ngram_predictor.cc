@@ -13,12 +13,35 @@
 
 DEFINE_string(punctuation_model, "", "ngram punctuation model.");
 DEFINE_int32(punctuation_model_order, 4, "order of punctuation model.");
+DEFINE_string(punctuation_load_method, "populate_or_read",
+              "how to load the punctuation model: lazy, populate_or_lazy, "
+              "populate_or_read, read or parallel_read, see util::LoadMethod "
+              "of kenlm. lazy keeps the resident memory of a binary model "
+              "down to the pages it queries.");
 
 namespace mobvoi {
 
+namespace {
+
+util::LoadMethod ParseLoadMethod(const string& name) {
+  if (name == "lazy") return util::LAZY;
+  if (name == "populate_or_lazy") return util::POPULATE_OR_LAZY;
+  if (name == "read") return util::READ;
+  if (name == "parallel_read") return util::PARALLEL_READ;
+  if (name != "populate_or_read") {
+    LOG(WARNING) << "Unknown punctuation model load method " << name
+                 << ", use populate_or_read.";
+  }
+  return util::POPULATE_OR_READ;
+}
+
+}  // namespace
+
 // Singleton ngram model.
 class NgramModel {
  public:
+  NgramModel(lm::base::Model* model, lm::ngram::ModelType model_type)
+      : model_(model), model_type_(model_type) {}
   ~NgramModel() {}
 
   static string punctuation_model_;
@@ -26,14 +49,16 @@ class NgramModel {
     punctuation_model_ = punctuation_model;
   }
 
-  lm::ngram::Model* model() {
+  const lm::base::Model* model() const {
     return model_.get();
   }
+  lm::ngram::ModelType model_type() const { return model_type_; }
 
  private:
   NgramModel();
   friend struct DefaultSingletonTraits<NgramModel>;
-  unique_ptr<lm::ngram::Model> model_;
+  unique_ptr<lm::base::Model> model_;
+  lm::ngram::ModelType model_type_;
 
   DISALLOW_COPY_AND_ASSIGN(NgramModel);
 };
@@ -41,42 +66,143 @@ class NgramModel {
 string NgramModel::punctuation_model_ = "";
 
 NgramModel::NgramModel() {
-  lm::ngram::Config config;
   CHECK(!punctuation_model_.empty()) << "No model is found!";
-  model_.reset(new lm::ngram::Model(punctuation_model_.c_str(), config));
+  model_.reset(NgramPredictor::LoadModel(punctuation_model_, &model_type_));
+  LOG(INFO) << "Loaded punctuation model " << punctuation_model_
+            << " of type " << model_type_;
 }
 
 NgramPredictor::NgramPredictor(const string& punctuation_model,
                                int punctuation_model_order)
     : ngram_order_(punctuation_model_order) {
-  NgramModel::InitParams("");
+  NgramModel::InitParams(punctuation_model.empty() ? FLAGS_punctuation_model
+                                                   : punctuation_model);
   model_ = Singleton<NgramModel>::get();
-  period_ = model_->model()->GetVocabulary().Index("。");
-  question_mark_ = model_->model()->GetVocabulary().Index("?");
+  Init();
+}
+
+NgramPredictor::NgramPredictor(lm::base::Model* model,
+                               lm::ngram::ModelType model_type,
+                               int punctuation_model_order)
+    : own_model_(new NgramModel(model, model_type)),
+      ngram_order_(punctuation_model_order) {
+  model_ = own_model_.get();
+  Init();
 }
 
 NgramPredictor::~NgramPredictor() {}
 
-const string NgramPredictor::Predict(const std::string& sentence) const {
-  bool sentence_context = false;
+lm::base::Model* NgramPredictor::LoadModel(const string& path,
+                                           lm::ngram::ModelType* model_type) {
+  lm::ngram::Config config;
+  config.load_method = ParseLoadMethod(FLAGS_punctuation_load_method);
+  // Any kenlm binary type, or ARPA, which is loaded as a probing model.
+  // LoadVirtual() only sets |model_type| for binaries.
+  *model_type = lm::ngram::PROBING;
+  return lm::ngram::LoadVirtual(path.c_str(), config, *model_type);
+}
+
+void NgramPredictor::Init() {
+  period_ = WordIndex("。");
+  question_mark_ = WordIndex("?");
+  switch (model_->model_type()) {
+    case lm::ngram::PROBING:
+      BindQueryFunctions<lm::ngram::ProbingModel>();
+      break;
+    case lm::ngram::REST_PROBING:
+      BindQueryFunctions<lm::ngram::RestProbingModel>();
+      break;
+    case lm::ngram::TRIE:
+      BindQueryFunctions<lm::ngram::TrieModel>();
+      break;
+    case lm::ngram::QUANT_TRIE:
+      BindQueryFunctions<lm::ngram::QuantTrieModel>();
+      break;
+    case lm::ngram::ARRAY_TRIE:
+      BindQueryFunctions<lm::ngram::ArrayTrieModel>();
+      break;
+    case lm::ngram::QUANT_ARRAY_TRIE:
+      BindQueryFunctions<lm::ngram::QuantArrayTrieModel>();
+      break;
+    default:
+      LOG(FATAL) << "Unknown punctuation model type "
+                 << model_->model_type();
+  }
+}
+
+template <class Model>
+void NgramPredictor::BindQueryFunctions() {
+  append_ = &NgramPredictor::AppendWordTo<Model>;
+  period_is_more_likely_ = &NgramPredictor::PeriodIsMoreLikely<Model>;
+  null_context_state_ =
+      static_cast<const Model*>(model_->model())->NullContextState();
+}
 
-  lm::ngram::State state = sentence_context ? model_->model()->BeginSentenceState()
-                                            : model_->model()->NullContextState();
+template <class Model>
+void NgramPredictor::AppendWordTo(lm::WordIndex word,
+                                  PunctuationStream* stream) const {
+  const Model& model = *static_cast<const Model*>(model_->model());
   lm::ngram::State out;
+  model.FullScore(stream->states_.back(), word, out);
+  stream->states_.push_back(out);
+}
+
+template <class Model>
+bool NgramPredictor::PeriodIsMoreLikely(const lm::ngram::State& state) const {
+  const Model& model = *static_cast<const Model*>(model_->model());
+  lm::ngram::State out;
+  return model.FullScore(state, period_, out).prob >
+         model.FullScore(state, question_mark_, out).prob;
+}
+
+lm::WordIndex NgramPredictor::WordIndex(const string& word) const {
+  return model_->model()->BaseVocabulary().Index(word);
+}
+
+void NgramPredictor::StartSentence(PunctuationStream* stream) const {
+  // Sentences are scored without the begin of sentence context.
+  stream->states_.assign(1, null_context_state_);
+}
+
+void NgramPredictor::AppendWord(lm::WordIndex word,
+                                PunctuationStream* stream) const {
+  if (stream->states_.empty()) StartSentence(stream);
+  (this->*append_)(word, stream);
+}
+
+const string NgramPredictor::PredictStream(
+    const PunctuationStream& stream) const {
+  const lm::ngram::State& state = stream.states_.empty()
+                                      ? null_context_state_
+                                      : stream.states_.back();
+  return (this->*period_is_more_likely_)(state) ? kPeriodMark
+                                                : kQuestionMark;
+}
+
+const string NgramPredictor::Predict(const std::string& sentence) const {
   vector<string> words;
   mobvoi::SplitStringToVector(sentence, " ", true, &words);
 
+  // Only the last |ngram_order_| - 1 words are the context of the mark.
   size_t count = words.size();
-  size_t t = count - ngram_order_ + 1;
-  if (t < 0) t = 0;
+  size_t t = count + 1 > static_cast<size_t>(ngram_order_)
+                 ? count + 1 - ngram_order_
+                 : 0;
+  PunctuationStream stream;
+  StartSentence(&stream);
   for (; t < count; ++t) {
-    lm::WordIndex vocab = model_->model()->GetVocabulary().Index(words[t]);
-    model_->model()->FullScore(state, vocab, out);
-    state = out;
+    AppendWord(WordIndex(words[t]), &stream);
+  }
+  return PredictStream(stream);
+}
+
+void NgramPredictor::PredictBatch(const vector<string>& sentences,
+                                  vector<string>* marks) const {
+  marks->clear();
+  marks->reserve(sentences.size());
+  for (const auto& sentence : sentences) {
+    marks->push_back(Predict(sentence));
   }
-  double period_score = model_->model()->FullScore(state, period_, out).prob;
-  double question_score = model_->model()->FullScore(state, question_mark_, out).prob;
-  return period_score  > question_score ? kPeriodMark : kQuestionMark;
 }
 
 }  // namespace mobvoi
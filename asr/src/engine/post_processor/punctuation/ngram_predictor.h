@@ -4,6 +4,8 @@
 #ifndef ENGINE_PUNCTUATION_NGRAM_PREDICTOR_H_
 #define ENGINE_PUNCTUATION_NGRAM_PREDICTOR_H_
 
+#include <vector>
+
 #include "engine/post_processor/punctuation/predictor.h"
 #include "mobvoi/base/compat.h"
 #include "third_party/kenlm/lm/config.hh"
@@ -14,15 +16,78 @@ namespace mobvoi {
 
 class NgramModel;
 
+// Words of a sentence appended as they are recognized, e.g. from the partial
+// results, with the kenlm state after each of them.
+class PunctuationStream {
+ public:
+  PunctuationStream() {}
+
+  // Number of words appended.
+  size_t size() const { return states_.empty() ? 0 : states_.size() - 1; }
+  // Keep the first |size| words, e.g. when a partial result revises the
+  // last words.
+  void Truncate(size_t size) {
+    if (size < this->size()) states_.resize(size + 1);
+  }
+
+ private:
+  friend class NgramPredictor;
+  vector<lm::ngram::State> states_;
+};
+
 class NgramPredictor : public PunctuationPredictor {
  public:
   NgramPredictor(const string& punctuation_model, int punctuation_model_order);
+  // Predict with |model| of |model_type| rather than the shared model, e.g.
+  // to compare the model types. Take the ownership of |model|.
+  NgramPredictor(lm::base::Model* model, lm::ngram::ModelType model_type,
+                 int punctuation_model_order);
   virtual ~NgramPredictor();
 
+  // Load a punctuation model of any kenlm type, with
+  // --punctuation_load_method.
+  static lm::base::Model* LoadModel(const string& path,
+                                    lm::ngram::ModelType* model_type);
+
+  // Index of a token for AppendWord().
+  lm::WordIndex WordIndex(const string& word) const;
+
+  // Streaming prediction: start a sentence, append the words as they are
+  // recognized, and predict the mark after the words so far at any time.
+  // Appending a word and predicting are O(1), from the cached states.
+  void StartSentence(PunctuationStream* stream) const;
+  void AppendWord(lm::WordIndex word, PunctuationStream* stream) const;
+  const string PredictStream(const PunctuationStream& stream) const;
+
+  // Marks of many space separated sentences, e.g. to re-punctuate texts
+  // offline.
+  void PredictBatch(const vector<string>& sentences,
+                    vector<string>* marks) const;
+
  private:
+  // Query functions bound to the concrete kenlm type of the model, so that
+  // scoring does not go through the virtual kenlm interface.
+  typedef void (NgramPredictor::*AppendFunction)(
+      lm::WordIndex word, PunctuationStream* stream) const;
+  typedef bool (NgramPredictor::*PeriodFunction)(
+      const lm::ngram::State& state) const;
+
   virtual const string Predict(const string& sentence) const;
 
+  void Init();
+  template <class Model>
+  void BindQueryFunctions();
+  template <class Model>
+  void AppendWordTo(lm::WordIndex word, PunctuationStream* stream) const;
+  // Whether the period is more likely than the question mark after |state|.
+  template <class Model>
+  bool PeriodIsMoreLikely(const lm::ngram::State& state) const;
+
   NgramModel* model_;
+  unique_ptr<NgramModel> own_model_;
+  AppendFunction append_;
+  PeriodFunction period_is_more_likely_;
+  lm::ngram::State null_context_state_;
   lm::WordIndex period_;
   lm::WordIndex question_mark_;
   int ngram_order_;
@@ -0,0 +1,167 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/post_processor/punctuation/ngram_predictor.h"
+
+#include <cstdio>
+
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+const char kArpaFile[] = "/tmp/ngram_predictor_test.arpa";
+const char kBinaryFile[] = "/tmp/ngram_predictor_test.bin";
+const int kOrder = 3;
+
+// A question mark follows "吗", unless it is far from it.
+const char kArpa[] =
+    "\\data\\\n"
+    "ngram 1=11\n"
+    "ngram 2=8\n"
+    "ngram 3=3\n"
+    "\n\\1-grams:\n"
+    "-1.0\t<unk>\n"
+    "-99\t<s>\t-0.3\n"
+    "-1.0\t</s>\n"
+    "-1.0\t你\t-0.2\n"
+    "-1.0\t好\t-0.3\n"
+    "-1.2\t吗\t-0.5\n"
+    "-1.3\t今天\t-0.2\n"
+    "-1.3\t天气\t-0.2\n"
+    "-1.1\t很\t-0.2\n"
+    "-0.8\t。\n"
+    "-1.5\t?\n"
+    "\n\\2-grams:\n"
+    "-0.3\t你 好\t-0.2\n"
+    "-0.5\t好 吗\t-0.2\n"
+    "-0.1\t吗 ?\n"
+    "-1.5\t吗 。\n"
+    "-0.4\t今天 天气\t-0.1\n"
+    "-0.5\t天气 很\t-0.1\n"
+    "-0.6\t很 好\t-0.3\n"
+    "-0.5\t好 。\n"
+    "\n\\3-grams:\n"
+    "-0.2\t你 好 吗\n"
+    "-0.05\t好 吗 ?\n"
+    "-0.3\t很 好 。\n"
+    "\n\\end\\\n";
+
+// Sentences shorter than the context of the model as well as longer ones.
+const vector<string> kSentences = {
+    "", "吗", "天气", "好 吗", "你 好", "你 好 吗", "生词 吗",
+    "今天 天气 很 好", "今天 天气 很 好 吗", "今天 天气 很 好 你 好 吗",
+    "你 好 吗 今天 天气 很 好"};
+
+class NgramPredictorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(File::WriteStringToFile(kArpa, kArpaFile));
+    predictor_.reset(new NgramPredictor(
+        new lm::ngram::ProbingModel(kArpaFile), lm::ngram::PROBING, kOrder));
+  }
+
+  void TearDown() override {
+    remove(kArpaFile);
+    remove(kBinaryFile);
+  }
+
+  const string Predict(const string& sentence) const {
+    return static_cast<const PunctuationPredictor&>(*predictor_)
+        .Predict(sentence);
+  }
+
+  unique_ptr<NgramPredictor> predictor_;
+};
+
+template <class Model>
+void WriteBinary(const char* path) {
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  config.write_mmap = path;
+  config.write_method = lm::ngram::Config::WRITE_AFTER;
+  Model model(kArpaFile, config);
+}
+
+// An NgramPredictor of the model loaded by NgramPredictor::LoadModel().
+NgramPredictor* LoadPredictor(const char* path,
+                              lm::ngram::ModelType* model_type) {
+  lm::base::Model* model = NgramPredictor::LoadModel(path, model_type);
+  return new NgramPredictor(model, *model_type, kOrder);
+}
+
+}  // namespace
+
+TEST_F(NgramPredictorTest, LoadArpaOrBinary) {
+  // Start from a type the ARPA is not loaded as.
+  lm::ngram::ModelType arpa_type = lm::ngram::QUANT_ARRAY_TRIE;
+  unique_ptr<NgramPredictor> arpa(LoadPredictor(kArpaFile, &arpa_type));
+  EXPECT_EQ(lm::ngram::PROBING, arpa_type);
+
+  WriteBinary<lm::ngram::TrieModel>(kBinaryFile);
+  lm::ngram::ModelType binary_type = lm::ngram::PROBING;
+  unique_ptr<NgramPredictor> binary(LoadPredictor(kBinaryFile, &binary_type));
+  EXPECT_EQ(lm::ngram::TRIE, binary_type);
+
+  const PunctuationPredictor& arpa_predictor = *arpa;
+  const PunctuationPredictor& binary_predictor = *binary;
+  for (const auto& sentence : kSentences) {
+    EXPECT_EQ(Predict(sentence), arpa_predictor.Predict(sentence))
+        << sentence;
+    EXPECT_EQ(Predict(sentence), binary_predictor.Predict(sentence))
+        << sentence;
+  }
+}
+
+TEST_F(NgramPredictorTest, ShortSentenceContext) {
+  // Shorter than the model order, and still scored with its words.
+  EXPECT_EQ(kQuestionMark, Predict("吗"));
+  EXPECT_EQ(kQuestionMark, Predict("好 吗"));
+  EXPECT_EQ(kPeriodMark, Predict("天气"));
+  EXPECT_EQ(kPeriodMark, Predict(""));
+  EXPECT_EQ(kQuestionMark, Predict("今天 天气 很 好 你 好 吗"));
+  EXPECT_EQ(kPeriodMark, Predict("你 好 吗 今天 天气 很 好"));
+}
+
+TEST_F(NgramPredictorTest, StreamSameAsPredict) {
+  for (const auto& sentence : kSentences) {
+    vector<string> words;
+    SplitStringToVector(sentence, " ", true, &words);
+    PunctuationStream stream;
+    predictor_->StartSentence(&stream);
+    EXPECT_EQ(Predict(""), predictor_->PredictStream(stream));
+    for (size_t i = 0; i < words.size(); ++i) {
+      predictor_->AppendWord(predictor_->WordIndex(words[i]), &stream);
+      vector<string> prefix(words.begin(), words.begin() + i + 1);
+      EXPECT_EQ(Predict(JoinVectorToString(prefix, " ")),
+                predictor_->PredictStream(stream))
+          << sentence << " at " << i;
+    }
+    EXPECT_EQ(words.size(), stream.size());
+    EXPECT_EQ(Predict(sentence), predictor_->PredictStream(stream))
+        << sentence;
+
+    // A partial result revising the last word.
+    if (!words.empty()) {
+      stream.Truncate(words.size() - 1);
+      words.pop_back();
+      EXPECT_EQ(Predict(JoinVectorToString(words, " ")),
+                predictor_->PredictStream(stream))
+          << sentence;
+    }
+  }
+}
+
+TEST_F(NgramPredictorTest, BatchSameAsPredict) {
+  vector<string> marks;
+  predictor_->PredictBatch(kSentences, &marks);
+  ASSERT_EQ(kSentences.size(), marks.size());
+  for (size_t i = 0; i < kSentences.size(); ++i) {
+    EXPECT_EQ(Predict(kSentences[i]), marks[i]) << kSentences[i];
+  }
+}
+
+}  // namespace mobvoi
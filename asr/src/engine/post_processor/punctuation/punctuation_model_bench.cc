@@ -0,0 +1,194 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Benchmark the punctuation model of NgramPredictor per kenlm model type:
+// the size of the binary, the resident memory after loading it with
+// --punctuation_load_method, and the latency of predicting the mark of a
+// sentence, whole and word by word as partial results arrive. Models of
+// every type are built from --arpa, the shipped punctuation ARPA, or
+// kenlm/lm/test.arpa by default.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "engine/post_processor/punctuation/ngram_predictor.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/kenlm/lm/enumerate_vocab.hh"
+#include "third_party/kenlm/lm/model.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/usage.hh"
+
+DEFINE_string(arpa, "third_party/kenlm/lm/test.arpa",
+              "ARPA file the benchmarked models are built from.");
+DEFINE_string(temp_prefix, "/tmp/punctuation_model_bench_",
+              "prefix of the built model files.");
+DEFINE_string(model_types,
+              "PROBING,REST_PROBING,TRIE,QUANT_TRIE,ARRAY_TRIE,"
+              "QUANT_ARRAY_TRIE",
+              "comma separated kenlm model types to benchmark.");
+DEFINE_string(sentences, "",
+              "text file of sentences, one per line, words separated by "
+              "spaces. Generated from the vocabulary if empty.");
+DEFINE_int32(num_sentences, 10000, "number of generated sentences.");
+DEFINE_int32(max_sentence_length, 20,
+             "maximum words of a generated sentence.");
+DEFINE_int32(repeats, 3, "passes over the sentences per measurement.");
+DEFINE_int32(seed, 1234, "random seed");
+
+DECLARE_int32(punctuation_model_order);
+
+namespace mobvoi {
+namespace {
+
+class VocabCollector : public lm::EnumerateVocab {
+ public:
+  void Add(lm::WordIndex index, const StringPiece& str) override {
+    words.push_back(str.as_string());
+  }
+  vector<string> words;
+};
+
+template <class Model>
+string BuildModel(const string& name) {
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  string path = FLAGS_temp_prefix + name + ".bin";
+  config.write_mmap = path.c_str();
+  config.write_method = lm::ngram::Config::WRITE_AFTER;
+  Model model(FLAGS_arpa.c_str(), config);
+  return path;
+}
+
+// Build a binary of |type| from the ARPA, and return its path.
+string BuildModel(const string& type) {
+  if (type == "PROBING")
+    return BuildModel<lm::ngram::ProbingModel>("probing");
+  if (type == "REST_PROBING")
+    return BuildModel<lm::ngram::RestProbingModel>("rest_probing");
+  if (type == "TRIE")
+    return BuildModel<lm::ngram::TrieModel>("trie");
+  if (type == "QUANT_TRIE")
+    return BuildModel<lm::ngram::QuantTrieModel>("quant_trie");
+  if (type == "ARRAY_TRIE")
+    return BuildModel<lm::ngram::ArrayTrieModel>("array_trie");
+  if (type == "QUANT_ARRAY_TRIE")
+    return BuildModel<lm::ngram::QuantArrayTrieModel>("quant_array_trie");
+  LOG(FATAL) << "Unknown model type " << type;
+  return "";
+}
+
+vector<string> LoadSentences() {
+  vector<string> sentences;
+  if (!FLAGS_sentences.empty()) {
+    std::ifstream in(FLAGS_sentences);
+    string line;
+    while (std::getline(in, line)) sentences.push_back(line);
+    return sentences;
+  }
+  VocabCollector vocab;
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  config.enumerate_vocab = &vocab;
+  lm::ngram::ProbingModel model(FLAGS_arpa.c_str(), config);
+  std::mt19937 rng(FLAGS_seed);
+  std::uniform_int_distribution<size_t> word(0, vocab.words.size() - 1);
+  std::uniform_int_distribution<int> length(1, FLAGS_max_sentence_length);
+  for (int i = 0; i < FLAGS_num_sentences; ++i) {
+    vector<string> words(length(rng));
+    for (auto& w : words) w = vocab.words[word(rng)];
+    sentences.push_back(JoinVectorToString(words, " "));
+  }
+  return sentences;
+}
+
+double ElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(const string& type, const vector<string>& sentences,
+         const vector<vector<string>>& sentence_words) {
+  string path = BuildModel(type);
+  uint64 file_size = 0;
+  {
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    file_size = util::SizeOrThrow(fd.get());
+  }
+
+  // Resident memory is measured with the model of a single type loaded.
+  uint64 rss_before = util::RSSCurrent();
+  auto start = std::chrono::steady_clock::now();
+  lm::ngram::ModelType model_type = lm::ngram::PROBING;
+  lm::base::Model* model = NgramPredictor::LoadModel(path, &model_type);
+  double load_ms = ElapsedNs(start) / 1e6;
+  NgramPredictor predictor(model, model_type,
+                           FLAGS_punctuation_model_order);
+  uint64 rss_loaded = util::RSSCurrent();
+
+  const PunctuationPredictor& sentence_predictor = predictor;
+  int64 periods = 0;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeats; ++r) {
+    for (const auto& sentence : sentences) {
+      periods += sentence_predictor.Predict(sentence) == kPeriodMark;
+    }
+  }
+  double sentence_ns = ElapsedNs(start) / (FLAGS_repeats * sentences.size());
+
+  // A partial result per word, the mark predicted after every one.
+  PunctuationStream stream;
+  int64 words = 0;
+  start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeats; ++r) {
+    for (const auto& sentence : sentence_words) {
+      predictor.StartSentence(&stream);
+      for (const auto& word : sentence) {
+        predictor.AppendWord(predictor.WordIndex(word), &stream);
+        periods += predictor.PredictStream(stream) == kPeriodMark;
+      }
+      words += sentence.size();
+    }
+  }
+  double stream_ns = ElapsedNs(start) / std::max<int64>(words, 1);
+  uint64 rss_queried = util::RSSCurrent();
+
+  std::cout << "type=" << type
+            << "\tfile_kb=" << (file_size >> 10)
+            << "\tload_ms=" << load_ms
+            << "\trss_loaded_kb="
+            << (static_cast<int64>(rss_loaded - rss_before) >> 10)
+            << "\trss_queried_kb="
+            << (static_cast<int64>(rss_queried - rss_before) >> 10)
+            << "\tns/sentence=" << sentence_ns
+            << "\tns/partial_word=" << stream_ns
+            << "\tperiods=" << periods
+            << std::endl;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Benchmark the punctuation model per kenlm model type\n"
+      "Usage:  punctuation_model_bench [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  vector<string> sentences = mobvoi::LoadSentences();
+  vector<vector<string>> sentence_words(sentences.size());
+  for (size_t i = 0; i < sentences.size(); ++i) {
+    mobvoi::SplitStringToVector(sentences[i], " ", true, &sentence_words[i]);
+  }
+  vector<string> types;
+  mobvoi::SplitStringToVector(FLAGS_model_types, ",", true, &types);
+  for (const auto& type : types) {
+    mobvoi::Run(type, sentences, sentence_words);
+  }
+  return 0;
+}
@@ -0,0 +1,143 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Benchmark the look ahead automaton of app contexts, AhoCorasickTree, on
+// synthetic contact lists: the time to build it, to get it from the
+// automaton cache shared by sessions, and to query it with a stream of
+// decoded words, as LMRescorer::LookAheadScore() does.
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "engine/rescorer/context_automaton_cache.h"
+#include "engine/rescorer/rescoring_utils.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/string_util.h"
+
+DEFINE_string(num_entries, "10,100,1000,5000",
+              "comma separated numbers of app context entries to benchmark");
+DEFINE_int32(max_entry_length, 4, "maximum number of words of an entry");
+DEFINE_int32(vocab_size, 60000, "number of distinct words");
+DEFINE_int32(num_builds, 20, "builds per app context");
+DEFINE_int32(num_queries, 1000000, "queries per app context");
+DEFINE_double(entry_word_rate, 0.3,
+              "rate of the queried words continuing an entry");
+DEFINE_int32(seed, 1234, "random seed");
+
+namespace mobvoi {
+namespace {
+
+typedef vector<vector<LabelType>> Entries;
+
+Entries GenerateEntries(int num_entries, std::mt19937* rng) {
+  std::uniform_int_distribution<LabelType> label(1, FLAGS_vocab_size);
+  std::uniform_int_distribution<int> length(1, FLAGS_max_entry_length);
+  Entries entries(num_entries);
+  for (auto& entry : entries) {
+    entry.resize(length(*rng));
+    for (auto& word : entry) word = label(*rng);
+  }
+  return entries;
+}
+
+// Words of entries interleaved with random words.
+vector<LabelType> GenerateQueries(const Entries& entries, std::mt19937* rng) {
+  std::uniform_int_distribution<LabelType> label(1, FLAGS_vocab_size);
+  std::uniform_int_distribution<int> entry_index(0, entries.size() - 1);
+  std::bernoulli_distribution entry_word(FLAGS_entry_word_rate);
+  vector<LabelType> queries;
+  queries.reserve(FLAGS_num_queries);
+  while (static_cast<int>(queries.size()) < FLAGS_num_queries) {
+    if (entry_word(*rng)) {
+      for (LabelType word : entries[entry_index(*rng)]) {
+        queries.push_back(word);
+      }
+    } else {
+      queries.push_back(label(*rng));
+    }
+  }
+  queries.resize(FLAGS_num_queries);
+  return queries;
+}
+
+AhoCorasickTree* Build(const Entries& entries) {
+  AhoCorasickTree* tree = new AhoCorasickTree();
+  for (const auto& entry : entries) tree->Insert(entry);
+  tree->Build();
+  return tree;
+}
+
+double ElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void Run(int num_entries, std::mt19937* rng) {
+  Entries entries = GenerateEntries(num_entries, rng);
+  vector<LabelType> queries = GenerateQueries(entries, rng);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FLAGS_num_builds; ++i) {
+    unique_ptr<AhoCorasickTree> tree(Build(entries));
+  }
+  double build_ns = ElapsedNs(start) / FLAGS_num_builds;
+
+  // The key of the cache is the app context, entries separated by sentence
+  // boundaries.
+  vector<int32> key;
+  for (const auto& entry : entries) {
+    key.push_back(dcd::kSentenceBoundary);
+    key.insert(key.end(), entry.begin(), entry.end());
+  }
+  ContextAutomatonCache<AhoCorasickTree> cache(1 << 30);
+  auto build = [&entries](size_t* bytes) {
+    AhoCorasickTree* tree = Build(entries);
+    *bytes = tree->MemoryUsage();
+    return tree;
+  };
+  shared_ptr<const AhoCorasickTree> tree = cache.GetOrBuild(key, build);
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FLAGS_num_builds; ++i) {
+    tree = cache.GetOrBuild(key, build);
+  }
+  double cached_ns = ElapsedNs(start) / FLAGS_num_builds;
+
+  uint16_t state = 0;
+  int64 heights = 0;
+  start = std::chrono::steady_clock::now();
+  for (LabelType word : queries) {
+    heights += tree->Query(&state, word);
+  }
+  double query_ns = ElapsedNs(start) / queries.size();
+
+  std::cout << "entries=" << num_entries
+            << "\tstates=" << tree->num_states()
+            << "\tbytes=" << tree->MemoryUsage()
+            << "\tns/build=" << build_ns
+            << "\tns/cached_build=" << cached_ns
+            << "\tns/query=" << query_ns
+            << "\tmean_height=" << static_cast<double>(heights) /
+                                       queries.size()
+            << std::endl;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Benchmark the look ahead automaton of app contexts\n"
+      "Usage:  aho_corasick_tree_bench [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  std::mt19937 rng(FLAGS_seed);
+  vector<string> num_entries;
+  mobvoi::SplitStringToVector(FLAGS_num_entries, ",", true, &num_entries);
+  for (const auto& num : num_entries) {
+    mobvoi::Run(std::stoi(num), &rng);
+  }
+  return 0;
+}
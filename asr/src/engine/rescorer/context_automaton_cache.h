@@ -0,0 +1,126 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_CONTEXT_AUTOMATON_CACHE_H_
+#define ENGINE_RESCORER_CONTEXT_AUTOMATON_CACHE_H_
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mobvoi/base/compat.h"
+#include "third_party/kenlm/util/murmur_hash.hh"
+
+namespace mobvoi {
+
+struct ContextAutomatonCacheStats {
+  int64 hits = 0;
+  int64 builds = 0;
+  int64 evictions = 0;
+  int32 entries = 0;
+  size_t bytes = 0;
+  size_t memory_budget = 0;
+};
+
+// Process-wide cache of the immutable automata built from the contexts of
+// sessions, e.g. the AhoCorasickTree of an app context, so that sessions with
+// the same contact or app list share one automaton instead of building their
+// own. It is keyed by the content the automaton is built from, hashed with
+// MurmurHash and compared in full, so different contexts never share an
+// automaton.
+//
+// The least recently used automata are evicted when the cached ones exceed
+// the memory budget. Sessions hold a reference to their automaton, so an
+// evicted automaton is freed once no session uses it. It is thread-safe.
+template <class Automaton>
+class ContextAutomatonCache {
+ public:
+  typedef vector<int32> Key;
+  // Build the automaton of a key and set the memory it takes.
+  typedef std::function<Automaton*(size_t* bytes)> BuildFunction;
+
+  explicit ContextAutomatonCache(size_t memory_budget) {
+    stats_.memory_budget = memory_budget;
+  }
+
+  // Return the cached automaton of |key|, or build it with |build| if none.
+  // Concurrent misses of a key may build it more than once, but only the
+  // first one built is cached.
+  shared_ptr<const Automaton> GetOrBuild(const Key& key,
+                                         const BuildFunction& build) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(key);
+      if (it != entries_.end()) {
+        ++stats_.hits;
+        lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+        return it->second.automaton;
+      }
+    }
+
+    // Build out of the lock, it takes a while for large contexts.
+    size_t bytes = 0;
+    shared_ptr<const Automaton> automaton(build(&bytes));
+    vector<shared_ptr<const Automaton>> evicted;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.builds;
+    auto inserted = entries_.emplace(key, Entry());
+    Entry& entry = inserted.first->second;
+    if (!inserted.second) {
+      // Built by another session meanwhile.
+      lru_.splice(lru_.begin(), lru_, entry.lru_position);
+      return entry.automaton;
+    }
+    entry.automaton = automaton;
+    entry.bytes = bytes + key.size() * sizeof(int32);
+    lru_.push_front(&inserted.first->first);
+    entry.lru_position = lru_.begin();
+    ++stats_.entries;
+    stats_.bytes += entry.bytes;
+    while (stats_.bytes > stats_.memory_budget && lru_.size() > 1) {
+      auto victim = entries_.find(*lru_.back());
+      lru_.pop_back();
+      // Released out of the lock.
+      evicted.push_back(victim->second.automaton);
+      ++stats_.evictions;
+      --stats_.entries;
+      stats_.bytes -= victim->second.bytes;
+      entries_.erase(victim);
+    }
+    return automaton;
+  }
+
+  ContextAutomatonCacheStats GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return util::MurmurHash64A(key.data(), key.size() * sizeof(int32));
+    }
+  };
+
+  struct Entry {
+    shared_ptr<const Automaton> automaton;
+    size_t bytes = 0;
+    // Position in |lru_|.
+    typename std::list<const Key*>::iterator lru_position;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<Key, Entry, KeyHash> entries_;
+  // Keys of |entries_|, the most recently used first.
+  std::list<const Key*> lru_;
+  ContextAutomatonCacheStats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(ContextAutomatonCache);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_CONTEXT_AUTOMATON_CACHE_H_
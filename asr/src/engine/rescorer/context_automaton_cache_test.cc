@@ -0,0 +1,71 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/context_automaton_cache.h"
+
+#include "engine/rescorer/rescoring_utils.h"
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+typedef ContextAutomatonCache<AhoCorasickTree> TreeCache;
+
+const size_t kTreeBytes = 1000;
+
+// Build a tree of the single entry |key|, counting the builds.
+TreeCache::BuildFunction MakeBuild(const vector<int32>& key, int* builds) {
+  return [key, builds](size_t* bytes) {
+    ++*builds;
+    AhoCorasickTree* tree = new AhoCorasickTree();
+    tree->Insert(key);
+    tree->Build();
+    *bytes = kTreeBytes;
+    return tree;
+  };
+}
+
+}  // namespace
+
+TEST(ContextAutomatonCacheTest, ShareSameContent) {
+  TreeCache cache(10 * kTreeBytes);
+  int builds = 0;
+  vector<int32> a = {1, 2, 3};
+  vector<int32> b = {3, 2, 1};
+  auto tree_a = cache.GetOrBuild(a, MakeBuild(a, &builds));
+  // A copy of the same context, e.g. from another session.
+  auto tree_a2 = cache.GetOrBuild(vector<int32>(a), MakeBuild(a, &builds));
+  // Same sum of labels, but a different context.
+  auto tree_b = cache.GetOrBuild(b, MakeBuild(b, &builds));
+  EXPECT_EQ(tree_a, tree_a2);
+  EXPECT_NE(tree_a, tree_b);
+  EXPECT_EQ(2, builds);
+
+  ContextAutomatonCacheStats stats = cache.GetStats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(2, stats.builds);
+  EXPECT_EQ(2, stats.entries);
+}
+
+TEST(ContextAutomatonCacheTest, EvictLeastRecentlyUsed) {
+  // Room for two trees with their keys.
+  TreeCache cache(2 * kTreeBytes + 100);
+  int builds = 0;
+  vector<int32> a = {1};
+  vector<int32> b = {2};
+  vector<int32> c = {3};
+  auto tree_a = cache.GetOrBuild(a, MakeBuild(a, &builds));
+  cache.GetOrBuild(b, MakeBuild(b, &builds));
+  cache.GetOrBuild(a, MakeBuild(a, &builds));
+  cache.GetOrBuild(c, MakeBuild(c, &builds));
+  EXPECT_EQ(1, cache.GetStats().evictions);
+  EXPECT_EQ(3, builds);
+
+  // "b" was evicted, "a" was not.
+  EXPECT_EQ(tree_a, cache.GetOrBuild(a, MakeBuild(a, &builds)));
+  EXPECT_EQ(3, builds);
+  cache.GetOrBuild(b, MakeBuild(b, &builds));
+  EXPECT_EQ(4, builds);
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,141 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Interpolate the rescorer models enabled by default into one kenlm binary,
+// which RescorerModelManager queries instead of them with
+// --rescorer_use_fused_model, see FusedKenLMConfig.
+//
+// kenlm interpolates models in its intermediate format, so each model must
+// have been built by lmplz with --intermediate as well. The base model gets
+// 1 - the sum of the other weights, like in LMRescorer.
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file/proto_util.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/kenlm/lm/common/model_buffer.hh"
+#include "third_party/kenlm/lm/interpolate/pipeline.hh"
+#include "third_party/kenlm/lm/model.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/fixed_array.hh"
+#include "third_party/kenlm/util/usage.hh"
+
+DEFINE_string(rescorer_config, "", "LMRescorerConfig binary proto file.");
+DEFINE_string(models, "secondpass,bugfix,newword",
+              "comma separated names of the models to fuse, the first one is "
+              "the base model.");
+DEFINE_string(intermediate_models, "",
+              "comma separated name=file_prefix of the models in kenlm "
+              "intermediate format, built by lmplz --intermediate.");
+DEFINE_string(output_model, "", "fused kenlm binary file.");
+DEFINE_string(output_config, "",
+              "LMRescorerConfig binary proto file, the input config with the "
+              "fused model.");
+DEFINE_string(temp_prefix, "/tmp/fused_model_", "temporary file prefix.");
+DEFINE_string(sort_memory, "1G", "memory of interpolation sorting.");
+DEFINE_string(sort_block, "64M", "block size of interpolation sorting.");
+
+namespace {
+
+map<string, string> ParseIntermediateModels() {
+  map<string, string> prefixes;
+  vector<string> items;
+  mobvoi::SplitStringToVector(FLAGS_intermediate_models, ",", true, &items);
+  for (const auto& item : items) {
+    size_t pos = item.find('=');
+    CHECK(pos != string::npos) << "Invalid intermediate model " << item;
+    prefixes[item.substr(0, pos)] = item.substr(pos + 1);
+  }
+  return prefixes;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Interpolate the default rescorer models into a fused model\n"
+      "Usage:  fused_model_builder_main [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  mobvoi::LMRescorerConfig config;
+  CHECK(mobvoi::ReadProtoFromFile(FLAGS_rescorer_config, &config))
+      << FLAGS_rescorer_config;
+  map<string, const mobvoi::KenLMConfig*> name2config;
+  for (const auto& kenlm_config : config.kenlm_config()) {
+    name2config[kenlm_config.name()] = &kenlm_config;
+  }
+  map<string, string> prefixes = ParseIntermediateModels();
+
+  vector<string> names;
+  mobvoi::SplitStringToVector(FLAGS_models, ",", true, &names);
+  CHECK(!names.empty());
+  mobvoi::FusedKenLMConfig* fused = config.mutable_fused_model();
+  fused->Clear();
+  lm::interpolate::Config pipe_config;
+  util::FixedArray<lm::ModelBuffer> models(names.size());
+  float extra_weight = 0;
+  size_t order = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    auto it = name2config.find(names[i]);
+    CHECK(it != name2config.end()) << names[i] << " is not configured.";
+    const mobvoi::KenLMConfig& kenlm_config = *it->second;
+    CHECK(!kenlm_config.load_on_demand()) << names[i] << " is on demand.";
+    auto prefix = prefixes.find(names[i]);
+    CHECK(prefix != prefixes.end())
+        << "No intermediate model of " << names[i];
+    models.push_back(prefix->second);
+    order = std::max(order, models.back().Order());
+
+    auto component = fused->add_component();
+    component->set_name(names[i]);
+    component->set_model_path(kenlm_config.model_path());
+    component->set_weight(kenlm_config.weight());
+    if (i > 0)
+      extra_weight += kenlm_config.weight();
+  }
+  CHECK_LE(extra_weight, 1.0f);
+  pipe_config.lambdas.push_back(1.0f - extra_weight);
+  for (int i = 1; i < fused->component_size(); ++i) {
+    pipe_config.lambdas.push_back(fused->component(i).weight());
+  }
+  pipe_config.sort.temp_prefix = FLAGS_temp_prefix;
+  pipe_config.sort.total_memory = util::ParseSize(FLAGS_sort_memory);
+  pipe_config.sort.buffer_size = util::ParseSize(FLAGS_sort_block);
+
+  const string arpa_path = FLAGS_temp_prefix + "fused.arpa";
+  {
+    util::scoped_fd arpa(util::CreateOrThrow(arpa_path.c_str()));
+    LOG(INFO) << "Interpolate " << FLAGS_models << " into " << arpa_path;
+    lm::interpolate::Pipeline(models, pipe_config, arpa.get());
+  }
+
+  LOG(INFO) << "Build " << FLAGS_output_model;
+  {
+    lm::ngram::Config build_config;
+    build_config.write_mmap = FLAGS_output_model.c_str();
+    build_config.write_method = lm::ngram::Config::WRITE_AFTER;
+    lm::ngram::ProbingModel model(arpa_path.c_str(), build_config);
+  }
+  std::remove(arpa_path.c_str());
+
+  // Load the fused model like the base model.
+  mobvoi::KenLMConfig* fused_model = fused->mutable_model();
+  fused_model->CopyFrom(*name2config[names[0]]);
+  fused_model->set_name("fused");
+  fused_model->set_model_path(FLAGS_output_model);
+  fused_model->set_ngram_order(order);
+  fused_model->set_weight(1.0f);
+  // The vocabulary is the union of the components.
+  fused_model->clear_relabel_file_path();
+  CHECK(mobvoi::WriteProtoToFile(FLAGS_output_config, config))
+      << FLAGS_output_config;
+  return 0;
+}
@@ -5,12 +5,16 @@
 
 #include <cmath>
 #include <limits>
+#include <list>
+#include <mutex>
+#include <set>
 
 #include "engine/rescorer/rescorer_model_manager.h"
 #include "engine/rescorer/rescoring_utils.h"
 #include "mobvoi/base/file.h"
 #include "mobvoi/base/hash.h"
 #include "mobvoi/base/log.h"
+#include "mobvoi/base/singleton.h"
 #include "third_party/openfst/include/fst/types.h"
 
 namespace {
@@ -24,12 +28,128 @@ const float kNegLn10 = -2.302585f;
 
 // Weight for OOVs.
 const float kOOVRet = -1.5f;
+
+// Models of higher orders are queried with this order.
+const int kMaxRescoringOrder = KENLM_MAX_ORDER;
 }  // namespace
 
 namespace mobvoi {
+namespace {
+
+// Model sets interned by ModelSetRegistry, beyond which the least recently
+// used ones are forgotten.
+const size_t kMaxModelSets = 4096;
+
+// Interns the generations of a set of enabled models into a small id, which
+// is used as the supplementary key of the lm score cache. Ids are not reused
+// before the int32 range wraps, so a cached score can not be mistaken for one
+// of another model set. Only the recently used sets are kept: a forgotten set
+// gets a new id when it is enabled again, which only misses the scores cached
+// under the old one.
+class ModelSetRegistry {
+ public:
+  ModelSetRegistry() : next_key_(0) {}
+
+  int32 GetKey(const vector<uint32>& generations) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = keys_.find(generations);
+    if (it != keys_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+    if (keys_.size() >= kMaxModelSets) {
+      keys_.erase(lru_.back().first);
+      lru_.pop_back();
+    }
+    int32 key = next_key_;
+    next_key_ = next_key_ == std::numeric_limits<int32>::max()
+                    ? 0 : next_key_ + 1;
+    lru_.emplace_front(generations, key);
+    keys_.emplace(generations, lru_.begin());
+    return key;
+  }
+
+ private:
+  typedef std::list<pair<vector<uint32>, int32>> ModelSetList;
+
+  std::mutex mutex_;
+  int32 next_key_;
+  // Most recently used first.
+  ModelSetList lru_;
+  map<vector<uint32>, ModelSetList::iterator> keys_;
+
+  DISALLOW_COPY_AND_ASSIGN(ModelSetRegistry);
+};
+
+// Copy the first words of |history| as the key of the rescoring cache.
+template <size_t N>
+void TruncateHistory(const RescoringHistoryT<N>& history,
+                     RescoringHistory* key_history) {
+  for (int i = 0; i < key_history->order() && i < static_cast<int>(N); ++i) {
+    key_history->words[i] = history.words[i];
+  }
+}
+
+// kenlm states hold KENLM_MAX_ORDER - 1 words, which may be more than the
+// cache State, so they are copied by field up to their length. Only states of
+// models whose binaries are up to kHistoryOrder are cached, which fit.
+void SaveCachedState(const lm::ngram::State& state, State* cached) {
+  for (int i = 0; i < state.length; ++i) {
+    cached->words[i] = state.words[i];
+    cached->backoff[i] = state.backoff[i];
+  }
+  cached->length = state.length;
+}
+
+void LoadCachedState(const State& cached, lm::ngram::State* state) {
+  for (int i = 0; i < cached.length; ++i) {
+    state->words[i] = cached.words[i];
+    state->backoff[i] = cached.backoff[i];
+  }
+  state->length = cached.length;
+}
+
+// log10 probability of a word scored by the overlay in the binary context
+// |context|: the backoffs of the contexts longer than the n-gram of the
+// overlay are taken from the binary where the overlay has none.
+float AddBinaryBackoffs(const OverlayScore& overlay,
+                        const lm::ngram::State& context) {
+  float log10_prob = overlay.log10_prob;
+  for (int i = overlay.order - 1; i < context.length; ++i) {
+    if (!(overlay.backoff_contexts & (1u << i)))
+      log10_prob += context.backoff[i];
+  }
+  return log10_prob;
+}
+
+}  // namespace
+
+void RescorerModelTable::BuildIndexes() {
+  name2id.clear();
+  path2id.clear();
+  map<string, int32> groups;
+  for (size_t i = 0; i < models.size(); ++i) {
+    VLOG(1) << __FUNCTION__ << "model index: " << i
+            << ", name: " << models[i].name
+            << ", path: " << models[i].model_path;
+    name2id.emplace(models[i].name, i);
+    path2id.emplace(models[i].model_path, i);
+    groups.emplace(models[i].group, 0);
+  }
+  num_groups = 0;
+  for (auto& group : groups) {
+    group.second = num_groups++;
+  }
+  group_ids.clear();
+  for (const auto& item : models) {
+    group_ids.push_back(groups[item.group]);
+  }
+}
 
 KenLMRescorer::KenLMRescorer()
-    : rescorer_key_(0), cache_delegate_(nullptr), initialized_(false) {}
+    : fused_model_used_(false),
+      rescorer_key_(0),
+      initialized_(false) {}
 
 KenLMRescorer::~KenLMRescorer() {}
 
@@ -52,83 +172,107 @@ void KenLMRescorer::InitInternal(RescorerModelManager* rescorer_model_manager) {
   LoadHomophone(rescorer_model_manager->homophone_path());
 
   // Setup model items.
-  models_ = rescorer_model_manager->GetInitModelItems();
-  BuildModelIndexes();
+  table_ = rescorer_model_manager->GetInitModelTable();
+  enabled_models_.assign(table_->num_groups, -1);
+  on_demand_models_.assign(table_->num_groups, nullptr);
 
   EnableDefaultModels();
 }
 
-void KenLMRescorer::BuildModelIndexes() {
-  for (size_t i = 0; i < models_.size(); ++i) {
-    VLOG(1) << __FUNCTION__ << "model index: " << i
-            << ", name: " << models_[i].name
-            << ", path: " << models_[i].model_path;
-    model_name2id_.emplace(models_[i].name, i);
-    model_path2id_.emplace(models_[i].model_path, i);
-  }
-}
-
 void KenLMRescorer::SyncDynamicModels(
     const RescorerModelManager* rescorer_model_manager) {
-  const auto dynamic_models = rescorer_model_manager->GetDynamicModelItems();
-  for (auto model_it = dynamic_models.begin(); model_it != dynamic_models.end();
-       ++model_it) {
-    auto it = model_name2id_.find(model_it->first);
-    if (it == model_name2id_.end())
-      continue;
+  shared_ptr<const RescorerModelTable> table =
+      rescorer_model_manager->GetModelTable();
+  if (table == table_)
+    return;
 
-    models_[it->second] = *(model_it->second);
+  // Carry the enabled models over by name.
+  vector<int32> enabled_models(table->num_groups, -1);
+  vector<shared_ptr<const RescorerModelItem>> on_demand_models(
+      table->num_groups);
+  for (size_t group_id = 0; group_id < enabled_models_.size(); ++group_id) {
+    int32 model_index = enabled_models_[group_id];
+    if (model_index < 0)
+      continue;
+    auto it = table->name2id.find(table_->models[model_index].name);
+    if (it == table->name2id.end())
+      continue;
+    int32 new_group_id = table->group_ids[it->second];
+    enabled_models[new_group_id] = it->second;
+    on_demand_models[new_group_id] = on_demand_models_[group_id];
   }
+  table_ = table;
+  enabled_models_.swap(enabled_models);
+  on_demand_models_.swap(on_demand_models);
+  BuildEnabledQueries();
+  UpdateRescorerKey();
+}
 
-  if (cache_delegate_)
-    cache_delegate_->OnCacheClear();
+const RescorerModelItem& KenLMRescorer::EnabledItem(int32 group_id) const {
+  if (on_demand_models_[group_id])
+    return *on_demand_models_[group_id];
+  return table_->models[enabled_models_[group_id]];
+}
+
+void KenLMRescorer::UpdateRescorerKey() {
+  vector<uint32> generations;
+  generations.reserve(enabled_models_.size());
+  for (size_t group_id = 0; group_id < enabled_models_.size(); ++group_id) {
+    if (enabled_models_[group_id] >= 0)
+      generations.push_back(EnabledItem(group_id).generation);
+  }
+  // The fused model scores differently from the models it is built from.
+  if (fused_model_used_)
+    generations.push_back(table_->fused->generation);
+  rescorer_key_ = Singleton<ModelSetRegistry>::get()->GetKey(generations);
 }
 
 void KenLMRescorer::EnableModel(int model_index) {
-  float weight_sum = models_[model_index].weight;
-  for (auto& each : enabled_models_) {
-    if (each.first == kRescorerBaseModelGroup)
+  const vector<RescorerModelItem>& models = table_->models;
+  float weight_sum = models[model_index].weight;
+  for (int32 enabled_index : enabled_models_) {
+    if (enabled_index < 0 ||
+        models[enabled_index].group == kRescorerBaseModelGroup)
       continue;
-    weight_sum += models_[each.second].weight;
+    weight_sum += models[enabled_index].weight;
   }
 
-  auto current_model_in_same_group =
-      enabled_models_.find(models_[model_index].group);
-  if (current_model_in_same_group != enabled_models_.end()) {
+  const int32 group_id = table_->group_ids[model_index];
+  int32& current_model_in_same_group = enabled_models_[group_id];
+  if (current_model_in_same_group >= 0) {
     // Already enabled one in same group, disable it first.
-    weight_sum -= models_[current_model_in_same_group->second].weight;
-    if (weight_sum > 1) {
-      LOG(ERROR)
-          << "Illegal state: enabled models have sum weights > 1, ignore.";
-      return;
-    }
+    weight_sum -= models[current_model_in_same_group].weight;
+  }
+  if (weight_sum > 1) {
+    LOG(ERROR)
+        << "Illegal state: enabled models have sum weights > 1, ignore.";
+    return;
+  }
 
-    rescorer_key_ &= ~(0x01 << current_model_in_same_group->second);
-    current_model_in_same_group->second = model_index;
+  current_model_in_same_group = model_index;
+  if (models[model_index].on_demand) {
+    // Blocks on the first enable of the model until it is loaded.
+    on_demand_models_[group_id] =
+        table_->residency->Acquire(models[model_index].name);
   } else {
-    if (weight_sum > 1) {
-      LOG(ERROR)
-          << "Illegal state: enabled models have sum weights > 1, ignore.";
-      return;
-    }
-
-    enabled_models_.emplace(models_[model_index].group, model_index);
+    on_demand_models_[group_id].reset();
   }
-  rescorer_key_ |= (0x01 << model_index);
+  BuildEnabledQueries();
+  UpdateRescorerKey();
 }
 
 void KenLMRescorer::EnableModel(const string& model_name) {
   VLOG(1) << "Enable model: " << model_name;
-  auto it = model_name2id_.find(model_name);
-  if (it == model_name2id_.end())
+  auto it = table_->name2id.find(model_name);
+  if (it == table_->name2id.end())
     return;
   EnableModel(it->second);
 }
 
 void KenLMRescorer::EnableModelByPath(const string& model_path) {
   VLOG(1) << "Enable model: " << model_path;
-  auto it = model_path2id_.find(model_path);
-  if (it == model_path2id_.end())
+  auto it = table_->path2id.find(model_path);
+  if (it == table_->path2id.end())
     return;
   EnableModel(it->second);
 }
@@ -140,21 +284,39 @@ void KenLMRescorer::EnableDefaultModels() {
 
   // "second_pass" group model must be enabled and have default weight value
   // unchanged.
-  auto it = enabled_models_.find(kRescorerBaseModelGroup);
-  CHECK(it != enabled_models_.end());
-  CHECK(std::fabs(1 - models_[it->second].weight) <
+  const RescorerModelItem* base_model = nullptr;
+  for (int32 model_index : enabled_models_) {
+    if (model_index >= 0 &&
+        table_->models[model_index].group == kRescorerBaseModelGroup)
+      base_model = &table_->models[model_index];
+  }
+  CHECK(base_model != nullptr);
+  CHECK(std::fabs(1 - base_model->weight) <
         std::numeric_limits<float>::epsilon());
 }
 
 vector<pair<string, string>> KenLMRescorer::GetEnabledModelState() const {
   vector<pair<string, string>> states;
-  for (auto it = enabled_models_.begin(); it != enabled_models_.end(); ++it) {
-    states.emplace_back(models_[it->second].name,
-                        models_[it->second].model_path);
+  for (int32 model_index : enabled_models_) {
+    if (model_index < 0)
+      continue;
+    states.emplace_back(table_->models[model_index].name,
+                        table_->models[model_index].model_path);
   }
   return states;
 }
 
+vector<RescorerModelStats> KenLMRescorer::GetModelStats() const {
+  std::set<string> names;
+  for (const auto& item : table_->models) names.insert(item.name);
+  if (table_->fused) names.insert(table_->fused->name);
+  vector<RescorerModelStats> stats;
+  for (auto& model : RescorerStats::Snapshot().models) {
+    if (names.count(model.name) > 0) stats.push_back(std::move(model));
+  }
+  return stats;
+}
+
 void KenLMRescorer::GetLogProb(
     const RescoringHistory& history,
     int word,
@@ -162,130 +324,241 @@ void KenLMRescorer::GetLogProb(
     float* base_result,
     vector<pair<float, float>>* extra_results) const {
   CHECK(extra_results->empty()) << "Invalid result param.";
-  for (auto it = enabled_models_.begin(); it != enabled_models_.end(); ++it) {
-    float score = 0.0;
-    int32 model_index = it->second;
-    if (!models_[model_index].is_valid) {
-      continue;
-    }
-    auto model = models_[model_index].model.get();
-    switch (models_[model_index].model_type) {
-      case lm::ngram::PROBING:
-        score = Query<lm::ngram::ProbingModel>(
-            *dynamic_cast<lm::ngram::ProbingModel*>(model),
-            model_index, history, word, cache);
-        break;
-      case lm::ngram::REST_PROBING:
-        score = Query<lm::ngram::RestProbingModel>(
-            *dynamic_cast<lm::ngram::RestProbingModel*>(model),
-            model_index, history, word, cache);
-        break;
-      case lm::ngram::TRIE:
-        score = Query<lm::ngram::TrieModel>(
-            *dynamic_cast<lm::ngram::TrieModel*>(model),
-            model_index, history, word, cache);
-        break;
-      case lm::ngram::QUANT_TRIE:
-        score = Query<lm::ngram::QuantTrieModel>(
-            *dynamic_cast<lm::ngram::QuantTrieModel*>(model),
-            model_index, history, word, cache);
-        break;
-      case lm::ngram::ARRAY_TRIE:
-        score = Query<lm::ngram::ArrayTrieModel>(
-            *dynamic_cast<lm::ngram::ArrayTrieModel*>(model),
-            model_index, history, word, cache);
-        break;
-      case lm::ngram::QUANT_ARRAY_TRIE:
-        score = Query<lm::ngram::QuantArrayTrieModel>(
-            *dynamic_cast<lm::ngram::QuantArrayTrieModel*>(model),
-            model_index, history, word, cache);
-        break;
-      default:  // ARPA format
-        score = Query<lm::ngram::ProbingModel>(
-            *dynamic_cast<lm::ngram::ProbingModel*>(model),
-            model_index, history, word, cache);
-        break;
-    }
+  for (const auto& enabled : enabled_queries_) {
+    float score = (this->*enabled.query)(enabled, history, word, cache);
     VLOG(3) << "GetLogProb|word: " << word << ", score: "
-            << score << ", model: " << model_index;
+            << score << ", model: " << enabled.model_index;
 
-    if (it->first == kRescorerBaseModelGroup)
+    if (enabled.is_base)
       *base_result = score;
     else
-      extra_results->emplace_back(models_[model_index].weight, score);
+      extra_results->emplace_back(enabled.weight, score);
+  }
+}
+
+void KenLMRescorer::GetLogProb(
+    const LongRescoringHistory& history,
+    int word,
+    RescoringCache* cache,
+    float* base_result,
+    vector<pair<float, float>>* extra_results) const {
+  CHECK(extra_results->empty()) << "Invalid result param.";
+  for (const auto& enabled : enabled_queries_) {
+    float score = (this->*enabled.long_query)(enabled, history, word, cache);
+    VLOG(3) << "GetLogProb|word: " << word << ", score: "
+            << score << ", model: " << enabled.model_index;
+
+    if (enabled.is_base)
+      *base_result = score;
+    else
+      extra_results->emplace_back(enabled.weight, score);
+  }
+}
+
+template <class Model, int kOrder>
+KenLMRescorer::QueryFunctions KenLMRescorer::MakeQueryFunctions() {
+  QueryFunctions functions;
+  functions.query = &KenLMRescorer::QueryModel<Model, kOrder, 4>;
+  functions.long_query = &KenLMRescorer::QueryModel<Model, kOrder, 8>;
+  return functions;
+}
+
+template <class Model>
+KenLMRescorer::QueryFunctions KenLMRescorer::GetQueryFunctions(
+    int32 ngram_order) {
+  switch (ngram_order) {
+    case 1:
+      return MakeQueryFunctions<Model, 1>();
+    case 2:
+      return MakeQueryFunctions<Model, 2>();
+    case 3:
+      return MakeQueryFunctions<Model, 3>();
+    case 4:
+      return MakeQueryFunctions<Model, 4>();
+    case 5:
+      return MakeQueryFunctions<Model, 5>();
+    default:
+      // kenlm can not load models of higher orders than KENLM_MAX_ORDER, so
+      // the configured order only limits the context here.
+      return MakeQueryFunctions<Model, kMaxRescoringOrder>();
+  }
+}
+
+KenLMRescorer::QueryFunctions KenLMRescorer::GetQueryFunctions(
+    lm::ngram::ModelType model_type, int32 ngram_order) {
+  switch (model_type) {
+    case lm::ngram::PROBING:
+      return GetQueryFunctions<lm::ngram::ProbingModel>(ngram_order);
+    case lm::ngram::REST_PROBING:
+      return GetQueryFunctions<lm::ngram::RestProbingModel>(ngram_order);
+    case lm::ngram::TRIE:
+      return GetQueryFunctions<lm::ngram::TrieModel>(ngram_order);
+    case lm::ngram::QUANT_TRIE:
+      return GetQueryFunctions<lm::ngram::QuantTrieModel>(ngram_order);
+    case lm::ngram::ARRAY_TRIE:
+      return GetQueryFunctions<lm::ngram::ArrayTrieModel>(ngram_order);
+    case lm::ngram::QUANT_ARRAY_TRIE:
+      return GetQueryFunctions<lm::ngram::QuantArrayTrieModel>(ngram_order);
+    default:  // ARPA format
+      return GetQueryFunctions<lm::ngram::ProbingModel>(ngram_order);
   }
 }
 
-template<class Model>
-float KenLMRescorer::Query(const Model& model, int32 model_index,
-                           const RescoringHistory& history, int word,
+bool KenLMRescorer::CanUseFusedModel() const {
+  if (!table_->fused || !table_->fused->is_valid)
+    return false;
+  size_t num_enabled = 0;
+  for (size_t group_id = 0; group_id < enabled_models_.size(); ++group_id) {
+    if (enabled_models_[group_id] >= 0)
+      ++num_enabled;
+  }
+  if (num_enabled != table_->fused_components.size())
+    return false;
+  for (const auto& component : table_->fused_components) {
+    int32 group_id = table_->group_ids[component.first];
+    if (enabled_models_[group_id] != component.first)
+      return false;
+    const RescorerModelItem& item = EnabledItem(group_id);
+    // An updated model changes its generation.
+    if (!item.is_valid || item.generation != component.second)
+      return false;
+  }
+  return true;
+}
+
+void KenLMRescorer::BuildEnabledQueries() {
+  enabled_queries_.clear();
+  fused_model_used_ = CanUseFusedModel();
+  if (fused_model_used_) {
+    AddEnabledQuery(-1, *table_->fused);
+    return;
+  }
+  for (size_t group_id = 0; group_id < enabled_models_.size(); ++group_id) {
+    if (enabled_models_[group_id] < 0)
+      continue;
+    const RescorerModelItem& item = EnabledItem(group_id);
+    if (!item.is_valid)
+      continue;
+    AddEnabledQuery(enabled_models_[group_id], item);
+  }
+}
+
+void KenLMRescorer::AddEnabledQuery(int32 model_index,
+                                    const RescorerModelItem& item) {
+  EnabledModel enabled;
+  enabled.model_index = model_index;
+  enabled.is_base = (item.group == kRescorerBaseModelGroup);
+  enabled.weight = item.weight;
+  enabled.item = &item;
+  QueryFunctions functions =
+      GetQueryFunctions(item.model_type, item.ngram_order);
+  enabled.query = functions.query;
+  enabled.long_query = functions.long_query;
+  enabled_queries_.push_back(enabled);
+}
+
+template <class Model, int kOrder, size_t N>
+float KenLMRescorer::Query(const Model& model, const RescorerModelItem& item,
+                           const RescoringHistoryT<N>& history, int word,
                            RescoringCache* cache) const {
-  int current_word;
+  RESCORER_STATS_ADD_MODEL(item.stats_slot, kModelQueries);
+  // The overlay scores the word, unless the binary has a longer n-gram of it
+  // below.
+  OverlayScore overlay_score;
+  const bool overlay_hit = item.overlay != nullptr &&
+      item.overlay->Score(history, N, word, &overlay_score);
+
+  lm::WordIndex current_word;
   if (word == dcd::kEndOfSentence) {
     current_word = model.GetVocabulary().EndSentence();
   } else {
-    auto it = models_[model_index].relabel_pair->find(word);
-    if (it == models_[model_index].relabel_pair->end() || it->second == 0) {
+    current_word = (*item.relabel_table)[word];
+    if (current_word == kRelabelOOVIndex && !overlay_hit) {
+      RESCORER_STATS_ADD_MODEL(item.stats_slot, kModelOOV);
       return kOOVRet;
-    } else {
-      current_word = it->second;
     }
   }
 
+  // The cache is keyed by the first words of the history, and its states
+  // hold at most kHistoryOrder - 1 words. Both are exact up to kHistoryOrder,
+  // since the state of a model only depends on the last |kOrder| - 1 words.
+  // The states grow up to the order of the binary, which may be higher than
+  // the configured one.
+  if (kOrder > kHistoryOrder || model.Order() > kHistoryOrder)
+    cache = nullptr;
+
   lm::ngram::State out{};
   bool history_cached = false;
-  // Perhaps using |model_index| to distinguish models within a big cache
-  // is not a good idea now because of the mutablitiy of the model itself.
-  // We currenlty clear all caches to avoid dirty data.
-  // TODO(JIANG Yichen): Do we have any other option? e.g. Cache per model,
-  // so that we do not need to clear caches of all models. Also to hide
-  // concrete implementation, the |model_index| is decoupled from hash key
-  // computation.
-  RescoringHistoryCKey cachekey(history, model_index);
+  // The cache is partitioned by the model generation rather than the model
+  // index, so that entries of an updated model are never hit again and age
+  // out of the cache, while entries of other models stay valid.
+  const uint32 generation = item.generation;
+  RescoringHistory key_history;
   if (cache != nullptr) {
-    auto it = cache->Get(cachekey);
+    TruncateHistory(history, &key_history);
+    auto it = cache->Get(RescoringHistoryCKey(key_history, generation));
     if (it != cache->end()) {
-      memcpy(&out, &it->second, sizeof(out));
+      LoadCachedState(it->second, &out);
       history_cached = true;
+      RESCORER_STATS_ADD_MODEL(item.stats_slot, kStateCacheHits);
+    } else {
+      RESCORER_STATS_ADD_MODEL(item.stats_slot, kStateCacheMisses);
     }
   }
 
   if (!history_cached) {
     // cachekey NOT in cache in this branch.
-    unsigned int words[kHistoryOrder] = {};
-    int count = 0;
-    ExtractContext(models_[model_index], history, words, &count);
-    lm::ngram::State state =
-        count < (models_[model_index].ngram_order - 1) ?
+    lm::WordIndex words[kOrder];
+    bool sentence_begin = false;
+    int count = ExtractContext<kOrder>(*item.relabel_table, history, words,
+                                       &sentence_begin);
+    // A history cut short by its size has unknown words before it.
+    lm::ngram::State state = sentence_begin ?
         model.BeginSentenceState() : model.NullContextState();
-    int t = count - models_[model_index].ngram_order + 1;
-    if (t < 0) t = 0;
     out = state;
-    for (; t < count; ++t) {
-      lm::WordIndex vocab = words[count - t - 1];
-      if (static_cast<LabelType>(vocab) == dcd::kOOVLabel || vocab == 0)
+    for (int t = count - 1; t >= 0; --t) {
+      lm::WordIndex vocab = words[t];
+      if (vocab == kRelabelOOVIndex) {
+        if (overlay_hit) {
+          // The binary has no context to back off from.
+          RESCORER_STATS_ADD_MODEL(item.stats_slot, kOverlayHits);
+          return overlay_score.log10_prob * kNegLn10;
+        }
+        RESCORER_STATS_ADD_MODEL(item.stats_slot, kModelOOV);
         return kOOVRet;
+      }
       model.FullScore(state, vocab, out);
       state = out;
     }
     if (cache != nullptr) {
-      State cache_state{};
-      memcpy(&cache_state, &state, sizeof(state));
-      cache->PutNewKey(cachekey, cache_state);
+      State cache_state;
+      SaveCachedState(state, &cache_state);
+      cache->PutNewKey(RescoringHistoryCKey(key_history, generation),
+                       cache_state);
     }
   }
 
+  if (current_word == kRelabelOOVIndex) {
+    // Only the overlay knows the word.
+    RESCORER_STATS_ADD_MODEL(item.stats_slot, kOverlayHits);
+    return AddBinaryBackoffs(overlay_score, out) * kNegLn10;
+  }
   lm::ngram::State state;
-  auto score = model.FullScore(out, current_word, state).prob * kNegLn10;
+  const lm::FullScoreReturn ret = model.FullScore(out, current_word, state);
+  float score = ret.prob * kNegLn10;
+  if (overlay_hit && overlay_score.order >= ret.ngram_length) {
+    RESCORER_STATS_ADD_MODEL(item.stats_slot, kOverlayHits);
+    score = AddBinaryBackoffs(overlay_score, out) * kNegLn10;
+  }
   if (cache != nullptr) {
     RescoringHistory new_history;
-    RescoringUtil::UpdateHistory(history, word, &new_history);
-    State cache_state{};
-    memcpy(&cache_state, &state, sizeof(state));
+    RescoringUtil::UpdateHistory(key_history, word, &new_history);
+    State cache_state;
+    SaveCachedState(state, &cache_state);
 
     // Here we don't know whether newkey is in cache or not, so we use Put
     // instead of PutNewKey.
-    RescoringHistoryCKey newkey(new_history, model_index);
+    RescoringHistoryCKey newkey(new_history, generation);
     cache->Put(newkey, cache_state);
   }
   return score;
@@ -298,43 +571,28 @@ int32 KenLMRescorer::GetRescorerKey() const {
 
 void KenLMRescorer::SetRescoringCacheDelegate(
     RescoringCacheDelegate* delegate) {
-  cache_delegate_ = delegate;
+  // Caches are partitioned by model generation, so model updates never clear
+  // them through the delegate.
 }
 
-void KenLMRescorer::ExtractContext(const RescorerModelItem& model,
-                                   const RescoringHistory& history,
-                                   unsigned int* words,
-                                   int* count) const {
-  const auto& relabel_pair = model.relabel_pair;
-  int32 ngram_order = model.ngram_order;
-
-  int max_history = 2;
-  if (history[0] != dcd::kSentenceBoundary) {
-    auto it = relabel_pair->find(history[0]);
-    words[0] = (it == relabel_pair->end()) ? dcd::kOOVLabel : it->second;
-    *count = 1;
-  }
-  if (max_history >= ngram_order || history[0] == dcd::kSentenceBoundary ||
-      history[1] == dcd::kSentenceBoundary) {
-    return;
-  }
-  ++max_history;
-  auto it = relabel_pair->find(history[1]);
-  words[1] = (it == relabel_pair->end()) ? dcd::kOOVLabel : it->second;
-  if (max_history >= ngram_order || history[2] == dcd::kSentenceBoundary) {
-    *count = 2;
-    return;
-  }
-  ++max_history;
-  it = relabel_pair->find(history[2]);
-  words[2] = (it == relabel_pair->end()) ? dcd::kOOVLabel : it->second;
-  if (max_history >= ngram_order || history[3] == dcd::kSentenceBoundary) {
-    *count = 3;
-    return;
+template <int kOrder, size_t N>
+int KenLMRescorer::ExtractContext(const RelabelTable& relabel_table,
+                                  const RescoringHistoryT<N>& history,
+                                  lm::WordIndex* words,
+                                  bool* sentence_begin) {
+  // A |kOrder|-gram model uses |kOrder| - 1 words of context, up to the
+  // sentence boundary. The bound is a constant, so the loop is unrolled.
+  constexpr int kContext = kOrder - 1 < static_cast<int>(N) ?
+      kOrder - 1 : static_cast<int>(N);
+  *sentence_begin = false;
+  for (int i = 0; i < kContext; ++i) {
+    if (history[i] == dcd::kSentenceBoundary) {
+      *sentence_begin = true;
+      return i;
+    }
+    words[i] = relabel_table[history[i]];
   }
-  it = relabel_pair->find(history[3]);
-  words[3] = (it == relabel_pair->end()) ? dcd::kOOVLabel : it->second;
-  *count = 4;
+  return kContext;
 }
 
 REGISTER_LM_RESCORER(KenLMRescorer);
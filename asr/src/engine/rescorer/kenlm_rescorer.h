@@ -10,6 +10,10 @@
 #include <vector>
 
 #include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/overlay_ngram_model.h"
+#include "engine/rescorer/relabel_table.h"
+#include "engine/rescorer/rescorer_model_residency.h"
+#include "engine/rescorer/rescorer_stats.h"
 #include "third_party/kenlm/lm/model.hh"
 
 namespace mobvoi {
@@ -18,12 +22,62 @@ struct RescorerModelItem {
   bool is_valid = false;
   int32 ngram_order = 4;
   string model_path;
-  shared_ptr<unordered_map<LabelType, LabelType>> relabel_pair;
+  shared_ptr<const RelabelTable> relabel_table;
   shared_ptr<lm::base::Model> model;
   lm::ngram::ModelType model_type = lm::ngram::PROBING;
   float weight = 1.0f;
   string group;
   string name;
+  // Identifies the loaded state of the item. It is unique in the process and
+  // changes whenever the item is updated, so the rescoring caches are keyed by
+  // it instead of being cleared on model updates.
+  uint32 generation = 0;
+  // Loaded by RescorerModelTable::residency when enabled. The item in the
+  // table is never loaded.
+  bool on_demand = false;
+  // Slot of the model counters in RescorerStats.
+  int32 stats_slot = 0;
+  // N-grams added online, which are scored instead of |model|, or nullptr.
+  // See RescorerModelManager::AddOverlayNgrams().
+  shared_ptr<const OverlayNgramModel> overlay;
+};
+
+// Immutable snapshot of all rescorer models with their indexes. It is built
+// by RescorerModelManager and shared by all rescorer copies, so copying a
+// rescorer does not copy the models. A model update publishes a new snapshot
+// rather than modifying one in use. Models keep their index across the
+// snapshots of a manager.
+struct RescorerModelTable {
+  vector<RescorerModelItem> models;
+
+  // Name search index.
+  map<string, int> name2id;
+
+  // This is kept for compatibility. We used to identify a model by path,
+  // but we use model name now.
+  // TODO(JIANG Yichen): Check if we can change poi selector to use model name.
+  // The advantage is that the poi location mapping has no need to change even
+  // if the model path is updated. Then EnbaleModelByPath() can be removed.
+  map<string, int> path2id;
+
+  // Group of each model. Groups are numbered in name order, so iterating
+  // over group ids visits groups the way a map keyed by group name would.
+  vector<int32> group_ids;
+  int32 num_groups = 0;
+
+  // Loads the on demand models, or nullptr if there are none.
+  shared_ptr<RescorerModelResidency> residency;
+
+  // Model interpolated from the default enabled models, or nullptr, see
+  // FusedKenLMConfig and --rescorer_use_fused_model. It replaces them as long
+  // as the enabled models are exactly those, and none of them has been
+  // updated since init.
+  shared_ptr<const RescorerModelItem> fused;
+  // Index and init generation of the models |fused| is built from.
+  vector<pair<int32, uint32>> fused_components;
+
+  // Fill the indexes from |models|.
+  void BuildIndexes();
 };
 
 class KenLMRescorer: public LMRescorer {
@@ -41,25 +95,95 @@ class KenLMRescorer: public LMRescorer {
   void SyncDynamicModels(
       const RescorerModelManager* rescorer_model_manager) override;
   vector<pair<string, string>> GetEnabledModelState() const override;
+  // Counters of the models of this rescorer, see --rescorer_stats. Models of
+  // the same name in other managers are counted together.
+  vector<RescorerModelStats> GetModelStats() const;
 
  private:
-  void BuildModelIndexes();
   void EnableDefaultModels();
 
   void EnableModel(int model_index);
 
-  void ExtractContext(const RescorerModelItem& model,
-                      const RescoringHistory& history,
-                      unsigned int* words,
-                      int* count) const;
-
+  // Recompute |rescorer_key_| from the generations of the enabled models.
+  void UpdateRescorerKey();
+
+  // Whether |table_->fused| can be queried instead of the enabled models.
+  bool CanUseFusedModel() const;
+
+  struct EnabledModel;
+
+  // Query function bound to the concrete kenlm type of a model, so that the
+  // per query path does not need to switch on the model type.
+  // Each is instantiated for the model type and order, so the context
+  // extraction of the 4-gram path is not slowed down by higher orders.
+  typedef float (KenLMRescorer::*QueryFunction)(const EnabledModel& enabled,
+                                                const RescoringHistory& history,
+                                                int word,
+                                                RescoringCache* cache) const;
+  typedef float (KenLMRescorer::*LongQueryFunction)(
+      const EnabledModel& enabled,
+      const LongRescoringHistory& history,
+      int word,
+      RescoringCache* cache) const;
+
+  struct QueryFunctions {
+    QueryFunction query;
+    LongQueryFunction long_query;
+  };
+
+  // An enabled model with its query dispatch resolved.
+  struct EnabledModel {
+    int32 model_index;
+    bool is_base;
+    float weight;
+    // Either in |table_| or in |on_demand_models_|.
+    const RescorerModelItem* item;
+    QueryFunction query;
+    LongQueryFunction long_query;
+  };
+
+  // The item of the model enabled in |group_id|, which must have one.
+  const RescorerModelItem& EnabledItem(int32 group_id) const;
+
+  static QueryFunctions GetQueryFunctions(lm::ngram::ModelType model_type,
+                                          int32 ngram_order);
   template <class Model>
+  static QueryFunctions GetQueryFunctions(int32 ngram_order);
+  template <class Model, int kOrder>
+  static QueryFunctions MakeQueryFunctions();
+
+  // Rebuild |enabled_queries_| from |enabled_models_|, substituting the fused
+  // model when possible. Must be called whenever the enabled models or the
+  // model items change.
+  void BuildEnabledQueries();
+  void AddEnabledQuery(int32 model_index, const RescorerModelItem& item);
+
+  // Fill |words| with the context of a |kOrder|-gram model in |history|,
+  // most recent word first, and return the number of words. Set
+  // |sentence_begin| if the context stops at dcd::kSentenceBoundary rather
+  // than at the model order or the end of |history|.
+  template <int kOrder, size_t N>
+  static int ExtractContext(const RelabelTable& relabel_table,
+                            const RescoringHistoryT<N>& history,
+                            lm::WordIndex* words, bool* sentence_begin);
+
+  template <class Model, int kOrder, size_t N>
   float Query(const Model& model,
-              int32 model_index,
-              const RescoringHistory& history,
+              const RescorerModelItem& item,
+              const RescoringHistoryT<N>& history,
               int word,
               RescoringCache* cache) const;
 
+  template <class Model, int kOrder, size_t N>
+  float QueryModel(const EnabledModel& enabled,
+                   const RescoringHistoryT<N>& history,
+                   int word,
+                   RescoringCache* cache) const {
+    return Query<Model, kOrder, N>(
+        *static_cast<const Model*>(enabled.item->model.get()), *enabled.item,
+        history, word, cache);
+  }
+
   // LMRescorer methods:
   void InitInternal(const LMRescorerConfig& config,
                     const fst::SymbolTable* word_symbols) override;
@@ -74,38 +198,37 @@ class KenLMRescorer: public LMRescorer {
                   int word,
                   RescoringCache* cache,
                   float* base_result,
-                  vector<pair<float, float>>* extra_results) const override {
-    LOG(FATAL) << "only 4-gram kenlm is supported!";
-  }
+                  vector<pair<float, float>>* extra_results) const override;
 
   // Override operator:
   KenLMRescorer& operator=(const KenLMRescorer& rhs);
 
-  // All available models
-  vector<RescorerModelItem> models_;
-
-  // Name search index.
-  map<string, int> model_name2id_;
-
-  // This is kept for compatibility. We used to identify a model by path,
-  // but we use model name now.
-  // TODO(JIANG Yichen): Check if we can change poi selector to use model name.
-  // The advantage is that the poi location mapping has no need to change even
-  // if the model path is updated. Then EnbaleModelByPath() can be removed.
-  map<string, int> model_path2id_;
+  // All available models, shared with the other copies.
+  shared_ptr<const RescorerModelTable> table_;
 
   // Record currently enabled models. Only one model can be enabled in the same
-  // group. |enabled_models_| maintains a mapping from group name to enabled
-  // model.
-  map<string, int> enabled_models_;
-
-  // This is used for supplementary cache key. It is the bit mask of the
-  // enabled lm rescorder models in |enabled_models_|. Currently, we support
-  // 32 models in max (including the base rescorer).
+  // group. |enabled_models_| maps a group id of |table_| to the index of its
+  // enabled model, or -1 if none is enabled.
+  vector<int32> enabled_models_;
+
+  // Loaded items of the enabled on demand models, by group id like
+  // |enabled_models_|. Holding them keeps the models loaded even if the
+  // residency evicts them.
+  vector<shared_ptr<const RescorerModelItem>> on_demand_models_;
+
+  // Valid models in |enabled_models_| with pre-bound query functions, in the
+  // same group order. This is what GetLogProb() walks.
+  vector<EnabledModel> enabled_queries_;
+
+  // |enabled_queries_| holds only the fused model of |table_|.
+  bool fused_model_used_;
+
+  // This is used for supplementary cache key. It identifies the enabled lm
+  // rescorer models in |enabled_models_| together with their generations, so
+  // updating a model only invalidates the cached scores of the model sets
+  // containing it.
   int32 rescorer_key_;
 
-  RescoringCacheDelegate* cache_delegate_;
-
   // The lm models are shared among rescorer instances. Init() should be invoked
   // only once.
   bool initialized_;
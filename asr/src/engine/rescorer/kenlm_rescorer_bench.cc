@@ -0,0 +1,370 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Benchmark the second pass rescoring path: KenLMRescorer alone, and behind
+// LMRescorerWrapper with its score cache. Models of every kenlm type are
+// built from a small ARPA, kenlm/lm/test.arpa by default, so it runs without
+// production models. Queries are replayed from --history_file, or generated
+// like a decoder does: every word of a sentence is scored with a few
+// competing words, repeatedly over the frames it spans.
+//
+// It reports ns/query per model type, per number of enabled model groups,
+// and per cache size and reset interval, together with the cache hit rate.
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "engine/rescorer/lm_rescorer_wrapper.h"
+#include "engine/rescorer/rescoring_cache.h"
+#include "engine/rescorer/rescoring_key_hash.h"
+#include "engine/rescorer/rescoring_utils.h"
+#include "fst/symbol-table.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/kenlm/lm/enumerate_vocab.hh"
+#include "third_party/kenlm/lm/model.hh"
+
+DEFINE_string(arpa, "third_party/kenlm/lm/test.arpa",
+              "ARPA file the benchmarked models are built from.");
+DEFINE_string(temp_prefix, "/tmp/kenlm_rescorer_bench_",
+              "prefix of the built model files.");
+DEFINE_int32(ngram_order, 5, "order of the rescoring models.");
+DEFINE_string(history_file, "",
+              "text file of sentences to replay, one per line, words "
+              "separated by spaces. Generated if empty.");
+DEFINE_int32(num_sentences, 2000, "number of generated sentences.");
+DEFINE_int32(arcs_per_word, 8,
+             "number of words scored after each history of the sentences.");
+DEFINE_int32(frames_per_word, 4, "times each arc is scored.");
+DEFINE_double(zipf_s, 1.0, "exponent of the Zipf word distribution.");
+DEFINE_string(model_types,
+              "PROBING,REST_PROBING,TRIE,QUANT_TRIE,ARRAY_TRIE,"
+              "QUANT_ARRAY_TRIE",
+              "comma separated kenlm model types to benchmark.");
+DEFINE_string(num_groups, "1,2,3,4,6",
+              "comma separated numbers of enabled model groups.");
+DEFINE_string(cache_sizes, "0,1024,16384,65536",
+              "comma separated score cache sizes of the wrapper.");
+DEFINE_string(reset_intervals, "1000,10000,100000,0",
+              "comma separated numbers of queries between wrapper resets, "
+              "0 for never.");
+DEFINE_int32(repeats, 3, "passes over the queries per measurement.");
+DEFINE_int32(seed, 1234, "random seed");
+
+namespace mobvoi {
+namespace {
+
+typedef vector<pair<RescoringHistory, int>> Queries;
+
+class VocabCollector : public lm::EnumerateVocab {
+ public:
+  void Add(lm::WordIndex index, const StringPiece& str) override {
+    words.push_back(str.as_string());
+  }
+  vector<string> words;
+};
+
+// Build a binary of |model_type| from the ARPA, and return its path.
+template <class Model>
+string BuildModel(const string& name, lm::ngram::Config config) {
+  string path = FLAGS_temp_prefix + name + ".bin";
+  config.write_mmap = path.c_str();
+  config.write_method = lm::ngram::Config::WRITE_AFTER;
+  Model model(FLAGS_arpa.c_str(), config);
+  return path;
+}
+
+string BuildModel(lm::ngram::ModelType model_type) {
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  switch (model_type) {
+    case lm::ngram::PROBING:
+      return BuildModel<lm::ngram::ProbingModel>("probing", config);
+    case lm::ngram::REST_PROBING:
+      return BuildModel<lm::ngram::RestProbingModel>("rest_probing", config);
+    case lm::ngram::TRIE:
+      return BuildModel<lm::ngram::TrieModel>("trie", config);
+    case lm::ngram::QUANT_TRIE:
+      return BuildModel<lm::ngram::QuantTrieModel>("quant_trie", config);
+    case lm::ngram::ARRAY_TRIE:
+      return BuildModel<lm::ngram::ArrayTrieModel>("array_trie", config);
+    case lm::ngram::QUANT_ARRAY_TRIE:
+      return BuildModel<lm::ngram::QuantArrayTrieModel>("quant_array_trie",
+                                                        config);
+    default:
+      LOG(FATAL) << "Unknown model type " << model_type;
+  }
+  return "";
+}
+
+lm::ngram::ModelType ParseModelType(const string& name) {
+  const char* kNames[] = {"PROBING", "REST_PROBING", "TRIE", "QUANT_TRIE",
+                          "ARRAY_TRIE", "QUANT_ARRAY_TRIE"};
+  const lm::ngram::ModelType kTypes[] = {
+      lm::ngram::PROBING, lm::ngram::REST_PROBING, lm::ngram::TRIE,
+      lm::ngram::QUANT_TRIE, lm::ngram::ARRAY_TRIE,
+      lm::ngram::QUANT_ARRAY_TRIE};
+  for (size_t i = 0; i < sizeof(kNames) / sizeof(kNames[0]); ++i) {
+    if (name == kNames[i]) return kTypes[i];
+  }
+  LOG(FATAL) << "Unknown model type " << name;
+  return lm::ngram::PROBING;
+}
+
+// Symbol table of the words of the ARPA, numbered from 1.
+fst::SymbolTable* LoadSymbols() {
+  VocabCollector vocab;
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  config.enumerate_vocab = &vocab;
+  lm::ngram::ProbingModel model(FLAGS_arpa.c_str(), config);
+  fst::SymbolTable* symbols = new fst::SymbolTable();
+  symbols->AddSymbol("<eps>", 0);
+  for (const auto& word : vocab.words) {
+    if (word == "<s>" || word == "</s>") continue;
+    symbols->AddSymbol(word);
+  }
+  return symbols;
+}
+
+// Score every word of |sentence| after its history, with the competing
+// words, as the decoder expands its tokens over frames.
+void AddSentence(const vector<int>& sentence, std::mt19937* rng,
+                 std::discrete_distribution<int>* word_dist,
+                 Queries* queries) {
+  RescoringHistory history;
+  for (int word : sentence) {
+    Queries arcs;
+    arcs.emplace_back(history, word);
+    for (int i = 1; i < FLAGS_arcs_per_word; ++i) {
+      arcs.emplace_back(history, (*word_dist)(*rng));
+    }
+    for (int frame = 0; frame < FLAGS_frames_per_word; ++frame) {
+      queries->insert(queries->end(), arcs.begin(), arcs.end());
+    }
+    RescoringHistory next;
+    RescoringUtil::UpdateHistory(history, word, &next);
+    history = next;
+  }
+  queries->emplace_back(history, dcd::kEndOfSentence);
+}
+
+Queries MakeQueries(const fst::SymbolTable& symbols) {
+  std::mt19937 rng(FLAGS_seed);
+  const int num_words = symbols.AvailableKey() - 1;
+  vector<double> weights(num_words + 1, 0);
+  for (int i = 1; i <= num_words; ++i) {
+    weights[i] = 1.0 / std::pow(i, FLAGS_zipf_s);
+  }
+  std::discrete_distribution<int> word_dist(weights.begin(), weights.end());
+
+  Queries queries;
+  if (!FLAGS_history_file.empty()) {
+    std::ifstream file(FLAGS_history_file);
+    CHECK(file) << FLAGS_history_file;
+    string line;
+    while (std::getline(file, line)) {
+      vector<string> words;
+      SplitStringToVector(line, " ", true, &words);
+      vector<int> sentence;
+      for (const auto& word : words) {
+        int64 label = symbols.Find(word);
+        // Words out of the model vocabulary are scored as OOVs.
+        sentence.push_back(label > 0 ? label : num_words + 1);
+      }
+      AddSentence(sentence, &rng, &word_dist, &queries);
+    }
+    return queries;
+  }
+  std::uniform_int_distribution<int> length(3, 15);
+  for (int i = 0; i < FLAGS_num_sentences; ++i) {
+    vector<int> sentence(length(rng));
+    for (auto& word : sentence) word = word_dist(rng);
+    AddSentence(sentence, &rng, &word_dist, &queries);
+  }
+  return queries;
+}
+
+// One model per group, the first ones being the default enabled groups.
+unique_ptr<LMRescorer> CreateRescorer(const string& model_path,
+                                      int num_groups,
+                                      const fst::SymbolTable& symbols) {
+  const char* kDefaultGroups[] = {"secondpass", "bugfix", "newword"};
+  LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  vector<string> extra_groups;
+  for (int i = 0; i < std::max(num_groups, 1); ++i) {
+    string group = i < 3 ? kDefaultGroups[i] : "extra" + std::to_string(i);
+    KenLMConfig* kenlm_config = config.add_kenlm_config();
+    kenlm_config->set_name(group);
+    kenlm_config->set_group(group);
+    kenlm_config->set_model_path(model_path);
+    kenlm_config->set_ngram_order(FLAGS_ngram_order);
+    kenlm_config->set_weight(i == 0 ? 1.0 : 0.1);
+    if (i >= 3) extra_groups.push_back(group);
+  }
+  unique_ptr<LMRescorer> rescorer = LMRescorer::Create(config.model_type());
+  rescorer->Init(config, &symbols);
+  for (const auto& group : extra_groups) {
+    rescorer->EnableModel(group);
+  }
+  return rescorer;
+}
+
+double ElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+// ns/query of the rescorer without any cache.
+double RunRescorer(LMRescorer* rescorer, const Queries& queries) {
+  vector<LabelType> context;
+  float checksum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeats; ++r) {
+    for (const auto& query : queries) {
+      checksum +=
+          rescorer->GetLmScore(query.first, query.second, context, context);
+    }
+  }
+  double ns = ElapsedNs(start) / (FLAGS_repeats * queries.size());
+  // Keep the queries alive.
+  if (std::isnan(checksum)) std::cerr << checksum;
+  return ns;
+}
+
+struct WrapperResult {
+  double ns_per_query = 0;
+  double hit_rate = 0;
+};
+
+// Hit rate of the score cache of the wrapper. The queries are replayed on a
+// cache of the same type and size, out of the timed loop, so that the rate
+// does not depend on RescorerStats, which DISABLE_RESCORER_STATS compiles
+// out.
+double ReplayHitRate(int32 rescorer_key, int cache_size, int reset_interval,
+                     const Queries& queries) {
+  if (cache_size <= 0) return 0;
+  ClockCache<LMHistoryCKey, std::pair<float, int>, LMHistoryKeyHash> cache(
+      cache_size);
+  int64 hits = 0;
+  int64 lookups = 0;
+  int64 since_reset = 0;
+  for (int r = 0; r < FLAGS_repeats; ++r) {
+    for (const auto& query : queries) {
+      if (reset_interval > 0 && ++since_reset == reset_interval) {
+        cache.Reset();
+        since_reset = 0;
+      }
+      // As LMRescorerWrapper::GetLmScore() skips the cache for epsilons.
+      if (query.second == 0) continue;
+      LMHistoryCKey key(query.second, query.first, rescorer_key);
+      ++lookups;
+      if (cache.Get(key) != nullptr) {
+        ++hits;
+      } else {
+        cache.Put(key, std::make_pair(0.0f, 0));
+      }
+    }
+  }
+  return lookups > 0 ? static_cast<double>(hits) / lookups : 0;
+}
+
+WrapperResult RunWrapper(LMRescorer* rescorer, int cache_size,
+                         int reset_interval, const Queries& queries) {
+  LMRescorerWrapper wrapper(rescorer, cache_size);
+  float checksum = 0;
+  int64 since_reset = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < FLAGS_repeats; ++r) {
+    for (const auto& query : queries) {
+      if (reset_interval > 0 && ++since_reset == reset_interval) {
+        wrapper.Reset();
+        since_reset = 0;
+      }
+      checksum += wrapper.GetLmScore(query.first, query.second);
+    }
+  }
+  WrapperResult result;
+  result.ns_per_query = ElapsedNs(start) / (FLAGS_repeats * queries.size());
+  result.hit_rate = ReplayHitRate(rescorer->GetRescorerKey(), cache_size,
+                                  reset_interval, queries);
+  if (std::isnan(checksum)) std::cerr << checksum;
+  return result;
+}
+
+vector<int> ParseInts(const string& flag) {
+  vector<string> items;
+  SplitStringToVector(flag, ",", true, &items);
+  vector<int> values;
+  for (const auto& item : items) values.push_back(std::stoi(item));
+  return values;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Benchmark KenLMRescorer and LMRescorerWrapper\n"
+      "Usage:  kenlm_rescorer_bench [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  unique_ptr<fst::SymbolTable> symbols(mobvoi::LoadSymbols());
+  mobvoi::Queries queries = mobvoi::MakeQueries(*symbols);
+  std::cout << "queries=" << queries.size() << std::endl;
+
+  // Per model type, with the default groups enabled.
+  vector<string> model_types;
+  mobvoi::SplitStringToVector(FLAGS_model_types, ",", true, &model_types);
+  string probing_path;
+  vector<string> built_paths;
+  for (const auto& name : model_types) {
+    lm::ngram::ModelType model_type = mobvoi::ParseModelType(name);
+    string path = mobvoi::BuildModel(model_type);
+    built_paths.push_back(path);
+    if (model_type == lm::ngram::PROBING) probing_path = path;
+    auto rescorer = mobvoi::CreateRescorer(path, 1, *symbols);
+    std::cout << "model_type=" << name << "\tns/query="
+              << mobvoi::RunRescorer(rescorer.get(), queries) << std::endl;
+  }
+  if (probing_path.empty()) {
+    probing_path = mobvoi::BuildModel(lm::ngram::PROBING);
+    built_paths.push_back(probing_path);
+  }
+
+  // Per number of enabled groups, each queried separately.
+  for (int num_groups : mobvoi::ParseInts(FLAGS_num_groups)) {
+    auto rescorer = mobvoi::CreateRescorer(probing_path, num_groups, *symbols);
+    std::cout << "groups=" << num_groups << "\tns/query="
+              << mobvoi::RunRescorer(rescorer.get(), queries) << std::endl;
+  }
+
+  // Per cache size and reset interval, through the wrapper.
+  auto rescorer = mobvoi::CreateRescorer(probing_path, 3, *symbols);
+  for (int cache_size : mobvoi::ParseInts(FLAGS_cache_sizes)) {
+    for (int reset_interval : mobvoi::ParseInts(FLAGS_reset_intervals)) {
+      mobvoi::WrapperResult result = mobvoi::RunWrapper(
+          rescorer.get(), cache_size, reset_interval, queries);
+      std::cout << "cache_size=" << cache_size
+                << "\treset_interval=" << reset_interval
+                << "\tns/query=" << result.ns_per_query
+                << "\thit_rate=" << result.hit_rate << std::endl;
+    }
+  }
+
+  for (const auto& path : built_paths) {
+    std::remove(path.c_str());
+  }
+  return 0;
+}
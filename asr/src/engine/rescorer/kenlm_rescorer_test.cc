@@ -3,29 +3,75 @@
 
 #include "engine/rescorer/lm_rescorer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <tuple>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "engine/rescorer/lm_rescorer_wrapper.h"
 #include "engine/rescorer/rescorer_model_manager.h"
 #include "engine/rescorer/rescoring_utils.h"
 #include "mobvoi/base/at_exit.h"
 #include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
 #include "mobvoi/base/file/proto_util.h"
 #include "third_party/gmock/include/gmock/gmock.h"
 #include "third_party/gtest/gtest.h"
 
+DECLARE_int32(rescorer_init_load_threads);
+DECLARE_bool(rescorer_use_fused_model);
+
 namespace mobvoi {
 
-class KenLMRescorerTest : public ::testing::Test {
- protected:
-  unique_ptr<mobvoi::LMRescorer> rescorer_;
+namespace {
 
-  int CountSetBits(int32 n) {
-    int count = 0;
-    while (n) {
-      n = n & (n - 1);
-      count++;
+// Write an ARPA model of the n-grams of |sentence| up to |order|, each of
+// probability 10^-0.|n|. |sentence| may start with <s>.
+bool WriteSentenceArpa(const vector<string>& sentence, size_t order,
+                       const string& path) {
+  const size_t begin = !sentence.empty() && sentence[0] == "<s>" ? 1 : 0;
+  string arpa = "\\data\\\n";
+  for (size_t n = 1; n <= order; ++n) {
+    int count = sentence.size() - n + 1 + (n == 1 ? 3 - begin : 0);
+    arpa += "ngram " + std::to_string(n) + "=" + std::to_string(count) + "\n";
+  }
+  for (size_t n = 1; n <= order; ++n) {
+    arpa += "\n\\" + std::to_string(n) + "-grams:\n";
+    if (n == 1) {
+      arpa += "-1.0\t<unk>\t0\n-1.0\t<s>\t-0.5\n-1.0\t</s>\t0\n";
+    }
+    for (size_t i = n == 1 ? begin : 0; i + n <= sentence.size(); ++i) {
+      string ngram = sentence[i];
+      for (size_t j = 1; j < n; ++j) ngram += " " + sentence[i + j];
+      arpa += "-0." + std::to_string(n) + "\t" + ngram;
+      if (n < order) arpa += "\t-0.25";
+      arpa += "\n";
     }
-    return count;
   }
+  arpa += "\n\\end\\\n";
+  return File::WriteStringToFile(arpa, path);
+}
+
+// Symbol table of the words of |sentence|, labeled from 100 into |words|.
+fst::SymbolTable* MakeSentenceSymbols(const vector<string>& sentence,
+                                      vector<int>* words) {
+  fst::SymbolTable* word_symbols = new fst::SymbolTable();
+  for (size_t i = 0; i < sentence.size(); ++i) {
+    words->push_back(100 + i);
+    word_symbols->AddSymbol(sentence[i], words->back());
+  }
+  return word_symbols;
+}
+
+}  // namespace
+
+class KenLMRescorerTest : public ::testing::Test {
+ protected:
+  unique_ptr<mobvoi::LMRescorer> rescorer_;
 
   std::pair<std::string, std::string> FindModelInStates(
       const std::vector<std::pair<std::string, std::string>>& states,
@@ -82,6 +128,106 @@ TEST_F(KenLMRescorerTest, Basic) {
   EXPECT_FLOAT_EQ(score, 8.6621777f);
 }
 
+TEST_F(KenLMRescorerTest, LookAheadAutomaton) {
+  base::AtExitManager at_exit;
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  auto params = config.add_kenlm_config();
+  params->set_ngram_order(4);
+  params->set_model_path("engine/rescorer/testdata/lm.bin");
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", 28633);
+  rescorer_->Init(config, word_symbols.get());
+
+  // A context no other test uses, so that it is not cached yet.
+  vector<LabelType> app_context = {dcd::kSentenceBoundary, 91, 92, 93,
+                                   dcd::kSentenceBoundary};
+  auto* automaton_cache = LMRescorerWrapper::GetAutomatonCache();
+  LMRescorerWrapper wrapper(rescorer_.get(), 100);
+  const int64 builds = automaton_cache->GetStats().builds;
+  wrapper.SetContext(&app_context, nullptr);
+  EXPECT_EQ(builds + 1, automaton_cache->GetStats().builds);
+
+  uint16_t state = 0;
+  int height = 0;
+  // Entries are matched from their last word, as the context is reversed.
+  wrapper.LookAheadScore(&state, 93, &height);
+  EXPECT_NE(0, state);
+  wrapper.LookAheadScore(&state, 92, &height);
+  EXPECT_EQ(builds + 1, automaton_cache->GetStats().builds);
+
+  // Another session of the same context shares the automaton.
+  LMRescorerWrapper other(rescorer_.get(), 100);
+  other.SetContext(&app_context, nullptr);
+  EXPECT_EQ(builds + 1, automaton_cache->GetStats().builds);
+
+  // An empty context matches nothing, and is not cached.
+  vector<LabelType> empty_context;
+  wrapper.SetContext(&empty_context, nullptr);
+  state = 0;
+  wrapper.LookAheadScore(&state, 93, &height);
+  EXPECT_EQ(0, state);
+  EXPECT_EQ(builds + 1, automaton_cache->GetStats().builds);
+}
+
+TEST_F(KenLMRescorerTest, LevenAutoCacheKey) {
+  base::AtExitManager at_exit;
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  auto params = config.add_kenlm_config();
+  params->set_ngram_order(4);
+  params->set_model_path("engine/rescorer/testdata/lm.bin");
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", 28633);
+  rescorer_->Init(config, word_symbols.get());
+
+  // Contexts no other test uses, of the same sum of labels.
+  vector<LabelType> context_a = {dcd::kSentenceBoundary, 81, 84,
+                                 dcd::kSentenceBoundary, 85,
+                                 dcd::kSentenceBoundary};
+  vector<LabelType> context_b = {dcd::kSentenceBoundary, 82, 83,
+                                 dcd::kSentenceBoundary, 85,
+                                 dcd::kSentenceBoundary};
+  const vector<int> limits = {1, 1};
+  auto* leven_cache = LMRescorerWrapper::GetLevenAutoCache();
+  const ContextAutomatonCacheStats stats = leven_cache->GetStats();
+
+  // Expand the words of |context| from the start state of |wrapper|.
+  auto expand = [](const LMRescorerWrapper& wrapper,
+                   const vector<LabelType>& context) {
+    vector<vector<LabelType>> matches;
+    vector<LAState> states(1);
+    for (LabelType word : context) {
+      if (word == dcd::kSentenceBoundary) continue;
+      vector<LAState> next;
+      wrapper.LookLevenScore(states, word, 0, 0.0f, &next);
+      for (const auto& state : next) {
+        matches.push_back(wrapper.GetLevenMatch(state));
+      }
+      if (!next.empty()) states.swap(next);
+    }
+    return matches;
+  };
+
+  LMRescorerWrapper fresh(rescorer_.get(), 100);
+  fresh.SetContext(&context_a, limits);
+  LMRescorerWrapper other(rescorer_.get(), 100);
+  other.SetContext(&context_b, limits);
+  EXPECT_EQ(stats.builds + 2, leven_cache->GetStats().builds);
+
+  // A copy of the first context, e.g. of another session, hits the cache.
+  vector<LabelType> context_a2(context_a);
+  LMRescorerWrapper cached(rescorer_.get(), 100);
+  cached.SetContext(&context_a2, limits);
+  EXPECT_EQ(stats.builds + 2, leven_cache->GetStats().builds);
+  EXPECT_EQ(stats.hits + 1, leven_cache->GetStats().hits);
+  EXPECT_EQ(expand(fresh, context_a), expand(cached, context_a));
+  EXPECT_EQ(expand(fresh, context_b), expand(cached, context_b));
+  EXPECT_LT(stats.bytes, leven_cache->GetStats().bytes);
+}
+
 TEST_F(KenLMRescorerTest, EnableModel) {
   base::AtExitManager at_exit;
   int ngram_order = 4;
@@ -145,7 +291,6 @@ TEST_F(KenLMRescorerTest, EnableModel) {
   EXPECT_EQ(state.first, "newword");
   EXPECT_EQ(state.second, model_path);
   int32 key = rescorer_->GetRescorerKey();
-  EXPECT_EQ(CountSetBits(key), 3);
 
   // Enable models.
   rescorer_->EnableModel("not_existed");
@@ -162,22 +307,35 @@ TEST_F(KenLMRescorerTest, EnableModel) {
   enabled_models = rescorer_->GetEnabledModelState();
   EXPECT_EQ(static_cast<int>(enabled_models.size()), 4);
   int32 key1 = rescorer_->GetRescorerKey();
-  EXPECT_EQ(CountSetBits(key1), 4);
+  EXPECT_NE(key, key1);
 
   rescorer_->EnableModel("poi_ok2");
   enabled_models = rescorer_->GetEnabledModelState();
   EXPECT_EQ(static_cast<int>(enabled_models.size()), 4);
   int32 key2 = rescorer_->GetRescorerKey();
-  EXPECT_EQ(CountSetBits(key2), 4);
-  EXPECT_EQ(CountSetBits(key1 ^ key2), 2);
-  EXPECT_EQ(CountSetBits(key1 & key2), 3);
-  EXPECT_EQ(CountSetBits(key1 | key2), 5);
+  EXPECT_NE(key, key2);
+  EXPECT_NE(key1, key2);
   state = FindModelInStates(enabled_models, "poi_ok2");
   EXPECT_EQ(state.first, "poi_ok2");
   EXPECT_EQ(state.second, model_path);
   state = FindModelInStates(enabled_models, "poi_ok1");
   EXPECT_EQ(state.first, "not found");
   EXPECT_EQ(state.second, "not found");
+
+  // The same model set always gets the same key.
+  rescorer_->EnableModel("poi_ok1");
+  EXPECT_EQ(key1, rescorer_->GetRescorerKey());
+  unique_ptr<LMRescorer> copy(rescorer_->Copy());
+  EXPECT_EQ(key1, copy->GetRescorerKey());
+
+  // Copies share the models but not the enabled state.
+  copy->EnableModel("poi_ok2");
+  EXPECT_NE(key1, copy->GetRescorerKey());
+  EXPECT_EQ(key1, rescorer_->GetRescorerKey());
+  EXPECT_EQ(FindModelInStates(rescorer_->GetEnabledModelState(), "poi_ok2")
+                .first, "not found");
+  EXPECT_EQ(FindModelInStates(copy->GetEnabledModelState(), "poi_ok2").first,
+            "poi_ok2");
 }
 
 TEST_F(KenLMRescorerTest, DynamicModel) {
@@ -230,11 +388,15 @@ TEST_F(KenLMRescorerTest, DynamicModel) {
   auto state = FindModelInStates(enabled_models, "newword");
   EXPECT_EQ(state.second, "dynamic_model_path");
 
+  // Caches are partitioned by model generation, model updates only change
+  // the rescorer key instead of clearing the caches.
+  int32 key = rescorer_->GetRescorerKey();
   dynamic_config.Clear();
   dynamic_config.set_model_path("invalid_path_for_test");
   EXPECT_TRUE(model_manager->UpdateModel("newword", dynamic_config));
-  EXPECT_CALL(mock_delegate, OnCacheClear()).Times(2);
+  EXPECT_CALL(mock_delegate, OnCacheClear()).Times(0);
   rescorer_->SyncDynamicModels(model_manager.get());
+  EXPECT_NE(key, rescorer_->GetRescorerKey());
 
   enabled_models = rescorer_->GetEnabledModelState();
   state = FindModelInStates(enabled_models, "newword");
@@ -249,4 +411,760 @@ TEST_F(KenLMRescorerTest, DynamicModel) {
   EXPECT_EQ(state.second, model_path);
 }
 
+TEST_F(KenLMRescorerTest, OverlayModel) {
+  base::AtExitManager at_exit;
+  string model_base_dir = "engine/rescorer/testdata/";
+  string model_path = model_base_dir + "lm.bin";
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_homophone_path(model_base_dir + "homophone.bin");
+  config.set_epoch(2);
+  auto params = config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("secondpass");
+  params->set_group("secondpass");
+  params = config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("newword");
+  params->set_group("newword");
+  params->set_weight(0.2);
+
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", 28633);
+  word_symbols->AddSymbol("给", 22801);
+  // Not in the kenlm model.
+  word_symbols->AddSymbol("新词", 40000);
+  unique_ptr<RescorerModelManager> model_manager(
+      new RescorerModelManager(model_base_dir, true));
+  model_manager->Init(config, word_symbols.get());
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(model_manager.get());
+
+  LMRescorerWrapper wrapper(rescorer_.get(), 64);
+  RescoringHistory history(22801);
+  int matched = 0;
+  const float score = wrapper.GetLmScore(history, 40000, &matched);
+
+  // Only the models of dynamic groups, and only known words.
+  EXPECT_FALSE(model_manager->AddOverlayNgrams("secondpass", {"-1.0\t新词"}));
+  EXPECT_FALSE(model_manager->AddOverlayNgrams("newword", {"-1.0\t旧词"}));
+  EXPECT_FALSE(model_manager->AddOverlayNgrams("newword", {"-1.0"}));
+  ASSERT_TRUE(model_manager->AddOverlayNgrams(
+      "newword", {"-3.0\t新词", "-0.5\t给 新词"}));
+  rescorer_->SyncDynamicModels(model_manager.get());
+  const float overlay_score = wrapper.GetLmScore(history, 40000, &matched);
+  EXPECT_NE(score, overlay_score);
+
+  // The overlay is loaded again at init.
+  {
+    unique_ptr<RescorerModelManager> reloaded(
+        new RescorerModelManager(model_base_dir, true));
+    reloaded->Init(config, word_symbols.get());
+    unique_ptr<mobvoi::LMRescorer> rescorer =
+        mobvoi::LMRescorer::Create(config.model_type());
+    rescorer->Init(reloaded.get());
+    LMRescorerWrapper reloaded_wrapper(rescorer.get(), 64);
+    EXPECT_FLOAT_EQ(overlay_score,
+                    reloaded_wrapper.GetLmScore(history, 40000, &matched));
+  }
+
+  // The overlay survives a model update.
+  KenLMConfig dynamic_config;
+  EXPECT_TRUE(model_manager->UpdateModel("newword", dynamic_config));
+  rescorer_->SyncDynamicModels(model_manager.get());
+  EXPECT_FLOAT_EQ(overlay_score, wrapper.GetLmScore(history, 40000, &matched));
+
+  ASSERT_TRUE(model_manager->ClearOverlayNgrams("newword"));
+  rescorer_->SyncDynamicModels(model_manager.get());
+  EXPECT_FLOAT_EQ(score, wrapper.GetLmScore(history, 40000, &matched));
+  EXPECT_FALSE(File::Exists(model_base_dir + "newword/overlay.bin"));
+}
+
+TEST_F(KenLMRescorerTest, OverlayDefersToLongerNgram) {
+  base::AtExitManager at_exit;
+  const vector<string> sentence = {"打电话", "给", "曲"};
+  const string model_path = "/tmp/kenlm_rescorer_test_overlay.arpa";
+  const string edited_path = "/tmp/kenlm_rescorer_test_overlay_edited.arpa";
+  ASSERT_TRUE(WriteSentenceArpa(sentence, 2, model_path));
+  // The same model with the unigram of the overlay written into it.
+  string arpa;
+  ASSERT_TRUE(File::ReadFileToString(model_path, &arpa));
+  const string unigram = "-0.1\t给\t";
+  ASSERT_NE(string::npos, arpa.find(unigram));
+  arpa.replace(arpa.find(unigram), unigram.size(), "-3.0\t给\t");
+  ASSERT_TRUE(File::WriteStringToFile(arpa, edited_path));
+  vector<int> words;
+  unique_ptr<fst::SymbolTable> word_symbols(
+      MakeSentenceSymbols(sentence, &words));
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  for (const char* name : {"secondpass", "newword"}) {
+    auto params = config.add_kenlm_config();
+    params->set_model_path(model_path);
+    params->set_ngram_order(2);
+    params->set_name(name);
+    params->set_group(name);
+    params->set_weight(name == string("secondpass") ? 1.0 : 0.2);
+  }
+  LMRescorerConfig edited_config(config);
+  edited_config.mutable_kenlm_config(1)->set_model_path(edited_path);
+  unique_ptr<LMRescorer> edited =
+      mobvoi::LMRescorer::Create(config.model_type());
+  edited->Init(edited_config, word_symbols.get());
+
+  // The overlay is saved in the directory of its model.
+  const string model_base_dir = "/tmp/kenlm_rescorer_test_overlay/";
+  mkdir(model_base_dir.c_str(), 0755);
+  mkdir((model_base_dir + "newword").c_str(), 0755);
+  RescorerModelManager model_manager(model_base_dir, true);
+  model_manager.Init(config, word_symbols.get());
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(&model_manager);
+  ASSERT_TRUE(model_manager.AddOverlayNgrams("newword", {"-3.0\t给"}));
+  rescorer_->SyncDynamicModels(&model_manager);
+
+  // "打电话 给" is a bigram of the binary, so the unigram of the overlay does
+  // not override it. After "曲" the overlay unigram is backed off from the
+  // binary context, as if it were in the binary.
+  vector<LabelType> context;
+  for (int previous : words) {
+    mobvoi::RescoringHistory history(previous);
+    for (int word : words) {
+      EXPECT_FLOAT_EQ(edited->GetLmScore(history, word, context, context),
+                      rescorer_->GetLmScore(history, word, context, context))
+          << previous << " " << word;
+    }
+  }
+  ASSERT_TRUE(model_manager.ClearOverlayNgrams("newword"));
+  rmdir((model_base_dir + "newword").c_str());
+  rmdir(model_base_dir.c_str());
+  std::remove(model_path.c_str());
+  std::remove(edited_path.c_str());
+}
+
+TEST_F(KenLMRescorerTest, AsyncDynamicModel) {
+  base::AtExitManager at_exit;
+  int ngram_order = 4;
+  string model_base_dir = "engine/rescorer/testdata/";
+  string model_path = model_base_dir + "lm.bin";
+  string homophone_path = model_base_dir + "homophone.bin";
+
+  mobvoi::LMRescorerConfig static_config;
+  static_config.set_model_type("KenLMRescorer");
+  static_config.set_homophone_path(homophone_path);
+  static_config.set_epoch(2);
+  auto params = static_config.add_kenlm_config();
+  params->set_ngram_order(ngram_order);
+  params->set_model_path(model_path);
+  params->set_name("secondpass");
+  params->set_group("secondpass");
+  params = static_config.add_kenlm_config();
+  params->set_ngram_order(ngram_order);
+  params->set_model_path(model_path);
+  params->set_name("newword");
+  params->set_group("newword");
+  params->set_weight(0.2);
+  KenLMConfig dynamic_config;
+  WriteProtoToFile(model_base_dir + "newword/config.proto", dynamic_config);
+
+  rescorer_ = mobvoi::LMRescorer::Create(static_config.model_type());
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  unique_ptr<RescorerModelManager> model_manager(
+      new RescorerModelManager(model_base_dir, true));
+  model_manager->Init(static_config, word_symbols.get());
+  rescorer_->Init(model_manager.get());
+
+  EXPECT_FALSE(model_manager->UpdateModelAsync("secondpass", dynamic_config));
+  EXPECT_EQ(ModelLoadState::kIdle,
+            model_manager->GetModelLoadStatus("newword").state);
+
+  // A model failing to load is neither published nor persisted.
+  dynamic_config.set_model_path("invalid_path_for_test");
+  EXPECT_TRUE(model_manager->UpdateModelAsync("newword", dynamic_config));
+  model_manager->WaitModelLoads();
+  ModelLoadStatus status = model_manager->GetModelLoadStatus("newword");
+  EXPECT_EQ(ModelLoadState::kFailed, status.state);
+  EXPECT_EQ("invalid_path_for_test", status.model_path);
+  EXPECT_EQ(1, status.num_requests);
+  rescorer_->SyncDynamicModels(model_manager.get());
+  auto state =
+      FindModelInStates(rescorer_->GetEnabledModelState(), "newword");
+  EXPECT_EQ(model_path, state.second);
+  KenLMConfig persisted_config;
+  ASSERT_TRUE(ReadProtoFromFile(model_base_dir + "newword/config.proto",
+                                &persisted_config));
+  EXPECT_FALSE(persisted_config.has_model_path());
+
+  // Only the latest of the updates is persisted.
+  int32 key = rescorer_->GetRescorerKey();
+  dynamic_config.Clear();
+  dynamic_config.set_weight(0.3);
+  EXPECT_TRUE(model_manager->UpdateModelAsync("newword", dynamic_config));
+  dynamic_config.set_weight(0.5);
+  EXPECT_TRUE(model_manager->UpdateModelAsync("newword", dynamic_config));
+  model_manager->WaitModelLoads();
+  status = model_manager->GetModelLoadStatus("newword");
+  EXPECT_EQ(ModelLoadState::kPublished, status.state);
+  EXPECT_EQ(3, status.num_requests);
+  ASSERT_TRUE(ReadProtoFromFile(model_base_dir + "newword/config.proto",
+                                &persisted_config));
+  EXPECT_FLOAT_EQ(0.5, persisted_config.weight());
+  rescorer_->SyncDynamicModels(model_manager.get());
+  EXPECT_NE(key, rescorer_->GetRescorerKey());
+  state = FindModelInStates(rescorer_->GetEnabledModelState(), "newword");
+  EXPECT_EQ(model_path, state.second);
+
+  dynamic_config.Clear();
+  WriteProtoToFile(model_base_dir + "newword/config.proto", dynamic_config);
+}
+
+TEST_F(KenLMRescorerTest, ParallelInit) {
+  base::AtExitManager at_exit;
+  string model_base_dir = "engine/rescorer/testdata/";
+  string model_path = model_base_dir + "lm.bin";
+  string corrupted_path = "/tmp/kenlm_rescorer_test_corrupted_lm.bin";
+  ASSERT_TRUE(File::WriteStringToFile("not a model", corrupted_path));
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  auto params = config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("secondpass");
+  params->set_group("secondpass");
+  params = config.add_kenlm_config();
+  params->set_model_path(corrupted_path);
+  params->set_name("bugfix");
+  params->set_group("bugfix");
+  params = config.add_kenlm_config();
+  params->set_model_path("missing_path_for_test");
+  params->set_name("newword");
+  params->set_group("newword");
+  for (int i = 0; i < 8; ++i) {
+    params = config.add_kenlm_config();
+    params->set_model_path(model_path);
+    params->set_name("poi" + std::to_string(i));
+    params->set_group("poi");
+    params->set_weight(0.0);
+  }
+
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", 28633);
+  vector<vector<std::tuple<string, string, bool>>> tables;
+  vector<vector<uint32>> generations;
+  for (int threads : {1, 4}) {
+    FLAGS_rescorer_init_load_threads = threads;
+    RescorerModelManager model_manager("", false);
+    model_manager.Init(config, word_symbols.get());
+    auto table = model_manager.GetInitModelTable();
+    tables.emplace_back();
+    generations.emplace_back();
+    for (const auto& params : config.kenlm_config()) {
+      const RescorerModelItem& item =
+          table->models[table->name2id.at(params.name())];
+      tables.back().emplace_back(item.name, item.model_path, item.is_valid);
+      generations.back().push_back(item.generation);
+    }
+  }
+  FLAGS_rescorer_init_load_threads = 4;
+  std::remove(corrupted_path.c_str());
+
+  // Failed models are left invalid, and the others are loaded the same way.
+  EXPECT_EQ(tables[0], tables[1]);
+  EXPECT_TRUE(std::get<2>(tables[1][0]));
+  EXPECT_FALSE(std::get<2>(tables[1][1]));
+  EXPECT_FALSE(std::get<2>(tables[1][2]));
+  EXPECT_TRUE(std::get<2>(tables[1][3]));
+  // Generations are in config order.
+  for (const auto& table : generations) {
+    EXPECT_TRUE(std::is_sorted(table.begin(), table.end()));
+  }
+
+  // So are stats slots, though larger models load first.
+  const string small_path = "/tmp/kenlm_rescorer_test_small.arpa";
+  ASSERT_TRUE(WriteSentenceArpa({"打电话", "给"}, 2, small_path));
+  mobvoi::LMRescorerConfig slot_config;
+  slot_config.set_model_type("KenLMRescorer");
+  slot_config.set_epoch(2);
+  params = slot_config.add_kenlm_config();
+  params->set_model_path(small_path);
+  params->set_name("parallel_init_small");
+  params->set_group("secondpass");
+  params = slot_config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("parallel_init_large");
+  params->set_group("poi");
+  FLAGS_rescorer_init_load_threads = 1;
+  RescorerModelManager slot_manager("", false);
+  slot_manager.Init(slot_config, word_symbols.get());
+  FLAGS_rescorer_init_load_threads = 4;
+  std::remove(small_path.c_str());
+  EXPECT_LT(RescorerStats::ModelSlot("parallel_init_small"),
+            RescorerStats::ModelSlot("parallel_init_large"));
+}
+
+TEST_F(KenLMRescorerTest, LoadPolicy) {
+  base::AtExitManager at_exit;
+  string model_path = "engine/rescorer/testdata/lm.bin";
+
+  mobvoi::LMRescorerConfig static_config;
+  static_config.set_model_type("KenLMRescorer");
+  static_config.set_epoch(2);
+  auto params = static_config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("secondpass");
+  params->set_group("secondpass");
+  params->set_huge_pages(true);
+  params->set_lock_memory(true);
+  params = static_config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("poi");
+  params->set_group("poi");
+  params->set_weight(0.0);
+  params->set_load_method(KenLMConfig::LAZY);
+  params->set_warm_up(true);
+
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  RescorerModelManager model_manager("", false);
+  model_manager.Init(static_config, word_symbols.get());
+  auto table = model_manager.GetInitModelTable();
+  ASSERT_EQ(2u, table->models.size());
+  const lm::base::Model& populated = *table->models[0].model;
+  const lm::base::Model& lazy = *table->models[1].model;
+  lm::ngram::State out;
+  for (lm::WordIndex word = 0; word < 16; ++word) {
+    EXPECT_EQ(populated.BaseScore(populated.BeginSentenceMemory(), word, &out),
+              lazy.BaseScore(lazy.BeginSentenceMemory(), word, &out));
+  }
+}
+
+TEST_F(KenLMRescorerTest, OnDemandModel) {
+  base::AtExitManager at_exit;
+  string model_path = "engine/rescorer/testdata/lm.bin";
+
+  mobvoi::LMRescorerConfig static_config;
+  static_config.set_model_type("KenLMRescorer");
+  static_config.set_epoch(2);
+  auto params = static_config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("secondpass");
+  params->set_group("secondpass");
+  params = static_config.add_kenlm_config();
+  params->set_model_path(model_path);
+  params->set_name("poi_beijing");
+  params->set_group("poi");
+  params->set_weight(0.5);
+  params->set_load_on_demand(true);
+
+  rescorer_ = mobvoi::LMRescorer::Create(static_config.model_type());
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  RescorerModelManager model_manager("", false);
+  model_manager.Init(static_config, word_symbols.get());
+  rescorer_->Init(&model_manager);
+  EXPECT_EQ(0, model_manager.GetModelResidencyStats().loads);
+
+  int32 key = rescorer_->GetRescorerKey();
+  rescorer_->EnableModelByPath(model_path);
+  rescorer_->EnableModel("poi_beijing");
+  EXPECT_EQ("poi_beijing",
+            FindModelInStates(rescorer_->GetEnabledModelState(),
+                              "poi_beijing").first);
+  EXPECT_NE(key, rescorer_->GetRescorerKey());
+
+  // Copies share the loaded model.
+  unique_ptr<LMRescorer> copy(rescorer_->Copy());
+  copy->EnableModel("poi_beijing");
+  ModelResidencyStats stats = model_manager.GetModelResidencyStats();
+  EXPECT_EQ(1, stats.loads);
+  EXPECT_EQ(1, stats.resident_models);
+
+  mobvoi::RescoringHistory history(1);
+  vector<LabelType> context;
+  EXPECT_FLOAT_EQ(
+      rescorer_->GetLmScore(history, dcd::kEndOfSentence, context, context),
+      copy->GetLmScore(history, dcd::kEndOfSentence, context, context));
+}
+
+TEST_F(KenLMRescorerTest, ClassMembers) {
+  base::AtExitManager at_exit;
+  const vector<string> sentence = {"打电话", "给", "$CONTACT", "说"};
+  const string model_path = "/tmp/kenlm_rescorer_test_class.arpa";
+  ASSERT_TRUE(WriteSentenceArpa(sentence, 3, model_path));
+  vector<int> words;
+  unique_ptr<fst::SymbolTable> word_symbols(
+      MakeSentenceSymbols(sentence, &words));
+  const int contact = words[2];
+  // Member words, not in the model.
+  const int qu = 200, fei = 201, zhang = 202, san = 203;
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  auto params = config.add_kenlm_config();
+  params->set_ngram_order(3);
+  params->set_model_path(model_path);
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(config, word_symbols.get());
+  LMRescorerWrapper wrapper(rescorer_.get(), 64);
+  wrapper.SetClassMembers(
+      contact, {{qu, fei}, {zhang, san}, {zhang}, {zhang, san, qu, fei}});
+
+  mobvoi::ClassRescoringHistory history;
+  for (int word : {words[0], words[1]}) {
+    mobvoi::ClassRescoringHistory next;
+    wrapper.UpdateHistory(history, word, &next);
+    history = next;
+  }
+  // The class token is scored by the model, and enters the class.
+  vector<LabelType> context;
+  EXPECT_FLOAT_EQ(
+      rescorer_->GetLmScore(history.history, contact, context, context),
+      wrapper.GetLmScore(history, contact));
+  mobvoi::ClassRescoringHistory in_class;
+  wrapper.UpdateHistory(history, contact, &in_class);
+  EXPECT_TRUE(in_class.InClass());
+
+  // "张 三 曲 飞" is one of four members. Three start with "张", two of them
+  // go on with "三", and one of those with "曲 飞".
+  const float kLn10 = 2.302585f;
+  const float probs[] = {3.0f / 4, 2.0f / 3, 1.0f / 2, 1.0f};
+  mobvoi::ClassRescoringHistory member = in_class;
+  int index = 0;
+  for (int word : {zhang, san, qu, fei}) {
+    EXPECT_NEAR(-std::log10(probs[index++]) * kLn10,
+                wrapper.GetLmScore(member, word), 1e-5)
+        << word;
+    mobvoi::ClassRescoringHistory next;
+    wrapper.UpdateHistory(member, word, &next);
+    member = next;
+  }
+  EXPECT_NEAR(0.0f,
+              wrapper.GetLmScore(member, dcd::kClassTagIdForRescoring), 1e-5);
+  // Words continuing no member.
+  EXPECT_LT(100.0f, wrapper.GetLmScore(member, qu));
+  EXPECT_LT(100.0f, wrapper.GetLmScore(in_class, fei));
+
+  // After the slot the model scores the words in the context of the class
+  // token and the words before it, however long the member was.
+  mobvoi::ClassRescoringHistory closed;
+  wrapper.UpdateHistory(member, dcd::kClassTagIdForRescoring, &closed);
+  EXPECT_FALSE(closed.InClass());
+  mobvoi::RescoringHistory expected;
+  mobvoi::RescoringUtil::UpdateHistory(history.history, contact, &expected);
+  EXPECT_EQ(expected, closed.history);
+  EXPECT_NEAR(0.3f * kLn10, wrapper.GetLmScore(closed, words[3]), 1e-5);
+  mobvoi::ClassRescoringHistory after;
+  wrapper.UpdateHistory(closed, words[3], &after);
+  EXPECT_FALSE(after.InClass());
+  EXPECT_EQ(words[3], after.history[0]);
+  EXPECT_EQ(contact, after.history[1]);
+
+  // Members are per session.
+  wrapper.Reset();
+  EXPECT_EQ(dcd::kMaxCost, wrapper.GetLmScore(in_class, zhang));
+  wrapper.SetClassMembers(contact, {{zhang}});
+  EXPECT_NEAR(0.0f, wrapper.GetLmScore(in_class, zhang), 1e-5);
+  wrapper.SetClassMembers(contact, {});
+  EXPECT_EQ(dcd::kMaxCost, wrapper.GetLmScore(in_class, zhang));
+  // Unbound, the class token is an ordinary word.
+  mobvoi::ClassRescoringHistory unbound;
+  wrapper.UpdateHistory(history, contact, &unbound);
+  EXPECT_FALSE(unbound.InClass());
+  std::remove(model_path.c_str());
+}
+
+TEST_F(KenLMRescorerTest, LongHistory) {
+  base::AtExitManager at_exit;
+  string model_path = "engine/rescorer/testdata/lm.bin";
+  int words[] = {28633, 22801, 32411, 10906, 1, 2};
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", words[0]);
+  word_symbols->AddSymbol("给", words[1]);
+  word_symbols->AddSymbol("曲", words[2]);
+  word_symbols->AddSymbol("飞", words[3]);
+
+  for (int ngram_order : {3, 4, 6}) {
+    mobvoi::LMRescorerConfig config;
+    config.set_model_type("KenLMRescorer");
+    auto params = config.add_kenlm_config();
+    params->set_ngram_order(ngram_order);
+    params->set_model_path(model_path);
+    rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+    rescorer_->Init(config, word_symbols.get());
+
+    // Histories of more words than a RescoringHistory holds.
+    mobvoi::RescoringHistory history(words[0]);
+    mobvoi::LongRescoringHistory long_history(words[0]);
+    for (int i = 1; i < 7; ++i) {
+      mobvoi::RescoringHistory next;
+      mobvoi::RescoringUtil::UpdateHistory(history, words[i % 3], &next);
+      history = next;
+      mobvoi::LongRescoringHistory long_next;
+      mobvoi::RescoringUtil::UpdateHistory(long_history, words[i % 3],
+                                           &long_next);
+      long_history = long_next;
+    }
+
+    // Up to 5-gram, the first four words of a long history decide the score.
+    vector<LabelType> context;
+    RescoringCache cache(100);
+    float score = rescorer_->GetLmScore(history, words[3], context, context);
+    EXPECT_FLOAT_EQ(score, rescorer_->GetLmScore(long_history, words[3],
+                                                 context, context, nullptr,
+                                                 &cache))
+        << ngram_order;
+    EXPECT_FLOAT_EQ(score, rescorer_->GetLmScore(long_history, words[3],
+                                                 context, context, nullptr,
+                                                 &cache))
+        << ngram_order;
+  }
+}
+
+TEST_F(KenLMRescorerTest, SentenceBeginContext) {
+  base::AtExitManager at_exit;
+  const vector<string> sentence = {"<s>", "打电话", "给", "曲", "飞", "说"};
+  const string model_path = "/tmp/kenlm_rescorer_test_begin.arpa";
+  ASSERT_TRUE(WriteSentenceArpa(sentence, sentence.size(), model_path));
+  vector<int> words;
+  unique_ptr<fst::SymbolTable> word_symbols(
+      MakeSentenceSymbols(sentence, &words));
+
+  const float kLn10 = 2.302585f;
+  vector<LabelType> context;
+  for (int ngram_order : {5, 6}) {
+    mobvoi::LMRescorerConfig config;
+    config.set_model_type("KenLMRescorer");
+    auto params = config.add_kenlm_config();
+    params->set_ngram_order(ngram_order);
+    params->set_model_path(model_path);
+    rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+    rescorer_->Init(config, word_symbols.get());
+
+    // A history starting at the sentence boundary scores the n-grams of <s>.
+    mobvoi::RescoringHistory history;
+    for (int i = 1; i < 3; ++i) {
+      mobvoi::RescoringHistory next;
+      mobvoi::RescoringUtil::UpdateHistory(history, words[i], &next);
+      history = next;
+    }
+    EXPECT_NEAR(0.4f * kLn10,
+                rescorer_->GetLmScore(history, words[3], context, context),
+                1e-5)
+        << ngram_order;
+
+    // A full history does not, whatever the model order.
+    mobvoi::RescoringHistory full = history;
+    for (int i = 3; i < 5; ++i) {
+      mobvoi::RescoringHistory next;
+      mobvoi::RescoringUtil::UpdateHistory(full, words[i], &next);
+      full = next;
+    }
+    EXPECT_NEAR(0.5f * kLn10,
+                rescorer_->GetLmScore(full, words[5], context, context),
+                1e-5)
+        << ngram_order;
+  }
+  std::remove(model_path.c_str());
+}
+
+TEST_F(KenLMRescorerTest, ModelOrderAboveConfig) {
+  base::AtExitManager at_exit;
+  // A 6-gram model of one sentence, configured as a 5-gram one.
+  const vector<string> sentence = {"打电话", "给", "曲", "飞", "说", "好"};
+  string model_path = "/tmp/kenlm_rescorer_test_6gram.arpa";
+  ASSERT_TRUE(WriteSentenceArpa(sentence, sentence.size(), model_path));
+
+  vector<int> words;
+  unique_ptr<fst::SymbolTable> word_symbols(
+      MakeSentenceSymbols(sentence, &words));
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  auto params = config.add_kenlm_config();
+  params->set_ngram_order(5);
+  params->set_model_path(model_path);
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(config, word_symbols.get());
+
+  // Scores through the state cache are the same as without it, over
+  // histories longer than the cached states hold.
+  vector<LabelType> context;
+  RescoringCache cache(100);
+  for (int round = 0; round < 2; ++round) {
+    mobvoi::RescoringHistory history;
+    for (int word : words) {
+      EXPECT_FLOAT_EQ(
+          rescorer_->GetLmScore(history, word, context, context),
+          rescorer_->GetLmScore(history, word, context, context, nullptr,
+                                &cache))
+          << round << " " << word;
+      mobvoi::RescoringHistory next;
+      mobvoi::RescoringUtil::UpdateHistory(history, word, &next);
+      history = next;
+    }
+  }
+  std::remove(model_path.c_str());
+}
+
+TEST_F(KenLMRescorerTest, FusedModel) {
+  base::AtExitManager at_exit;
+  string model_path = "engine/rescorer/testdata/lm.bin";
+  int words[] = {28633, 22801, 32411, 10906};
+  unique_ptr<fst::SymbolTable> word_symbols(new fst::SymbolTable());
+  word_symbols->AddSymbol("打电话", words[0]);
+  word_symbols->AddSymbol("给", words[1]);
+  word_symbols->AddSymbol("曲", words[2]);
+  word_symbols->AddSymbol("飞", words[3]);
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  FusedKenLMConfig* fused = config.mutable_fused_model();
+  fused->mutable_model()->set_model_path(model_path);
+  for (const char* name : {"secondpass", "bugfix", "newword", "poi"}) {
+    auto params = config.add_kenlm_config();
+    params->set_model_path(model_path);
+    params->set_name(name);
+    params->set_group(name);
+    params->set_weight(name == string("secondpass") ? 1.0 : 0.1);
+    if (name == string("poi"))
+      continue;
+    auto component = fused->add_component();
+    component->set_name(name);
+    component->set_model_path(model_path);
+    component->set_weight(params->weight());
+  }
+
+  // The fused model is ignored if a model changes after it was built.
+  LMRescorerConfig stale_config(config);
+  stale_config.mutable_kenlm_config(1)->set_weight(0.2);
+  FLAGS_rescorer_use_fused_model = true;
+  RescorerModelManager stale_manager("", false);
+  stale_manager.Init(stale_config, word_symbols.get());
+  FLAGS_rescorer_use_fused_model = false;
+  EXPECT_EQ(nullptr, stale_manager.GetInitModelTable()->fused);
+
+  FLAGS_rescorer_use_fused_model = true;
+  RescorerModelManager model_manager("", false);
+  model_manager.Init(config, word_symbols.get());
+  FLAGS_rescorer_use_fused_model = false;
+  ASSERT_NE(nullptr, model_manager.GetInitModelTable()->fused);
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(&model_manager);
+
+  LMRescorerConfig separate_config(config);
+  separate_config.clear_fused_model();
+  unique_ptr<LMRescorer> separate =
+      mobvoi::LMRescorer::Create(config.model_type());
+  separate->Init(separate_config, word_symbols.get());
+
+  // The fused model is built from copies of one model here, so it scores the
+  // same as the separate models, with or without the extra poi model.
+  mobvoi::RescoringHistory history(words[0]);
+  mobvoi::RescoringHistory next;
+  mobvoi::RescoringUtil::UpdateHistory(history, words[1], &next);
+  vector<LabelType> context;
+  int32 key = rescorer_->GetRescorerKey();
+  for (int word : words) {
+    EXPECT_FLOAT_EQ(separate->GetLmScore(next, word, context, context),
+                    rescorer_->GetLmScore(next, word, context, context));
+  }
+  rescorer_->EnableModel("poi");
+  separate->EnableModel("poi");
+  EXPECT_NE(key, rescorer_->GetRescorerKey());
+  for (int word : words) {
+    EXPECT_FLOAT_EQ(separate->GetLmScore(next, word, context, context),
+                    rescorer_->GetLmScore(next, word, context, context));
+  }
+}
+
+TEST_F(KenLMRescorerTest, FusedModelOptIn) {
+  base::AtExitManager at_exit;
+  // Two different component models, and a fused model which is normalized
+  // so it does not reproduce their weighted sum.
+  const vector<string> sentence = {"打电话", "给", "曲", "飞", "说", "好"};
+  const vector<string> reversed(sentence.rbegin(), sentence.rend());
+  const string base_path = "/tmp/kenlm_rescorer_test_base.arpa";
+  const string bugfix_path = "/tmp/kenlm_rescorer_test_bugfix.arpa";
+  const string fused_path = "/tmp/kenlm_rescorer_test_fused.arpa";
+  ASSERT_TRUE(WriteSentenceArpa(sentence, 3, base_path));
+  ASSERT_TRUE(WriteSentenceArpa(reversed, 2, bugfix_path));
+  ASSERT_TRUE(WriteSentenceArpa(sentence, 2, fused_path));
+  vector<int> words;
+  unique_ptr<fst::SymbolTable> word_symbols(
+      MakeSentenceSymbols(sentence, &words));
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  FusedKenLMConfig* fused = config.mutable_fused_model();
+  fused->mutable_model()->set_model_path(fused_path);
+  fused->mutable_model()->set_ngram_order(3);
+  for (const char* name : {"secondpass", "bugfix"}) {
+    bool is_base = name == string("secondpass");
+    auto params = config.add_kenlm_config();
+    params->set_model_path(is_base ? base_path : bugfix_path);
+    params->set_ngram_order(3);
+    params->set_name(name);
+    params->set_group(name);
+    params->set_weight(is_base ? 1.0 : 0.1);
+    auto component = fused->add_component();
+    component->set_name(name);
+    component->set_model_path(params->model_path());
+    component->set_weight(params->weight());
+  }
+  LMRescorerConfig separate_config(config);
+  separate_config.clear_fused_model();
+  unique_ptr<LMRescorer> separate =
+      mobvoi::LMRescorer::Create(config.model_type());
+  separate->Init(separate_config, word_symbols.get());
+
+  LMRescorerConfig fused_only_config;
+  fused_only_config.set_model_type("KenLMRescorer");
+  fused_only_config.add_kenlm_config()->CopyFrom(fused->model());
+  unique_ptr<LMRescorer> fused_only =
+      mobvoi::LMRescorer::Create(config.model_type());
+  fused_only->Init(fused_only_config, word_symbols.get());
+
+  // Off by default, so the separate models are queried.
+  RescorerModelManager default_manager("", false);
+  default_manager.Init(config, word_symbols.get());
+  EXPECT_EQ(nullptr, default_manager.GetInitModelTable()->fused);
+  unique_ptr<LMRescorer> unfused =
+      mobvoi::LMRescorer::Create(config.model_type());
+  unfused->Init(&default_manager);
+
+  FLAGS_rescorer_use_fused_model = true;
+  RescorerModelManager fused_manager("", false);
+  fused_manager.Init(config, word_symbols.get());
+  FLAGS_rescorer_use_fused_model = false;
+  ASSERT_NE(nullptr, fused_manager.GetInitModelTable()->fused);
+  rescorer_ = mobvoi::LMRescorer::Create(config.model_type());
+  rescorer_->Init(&fused_manager);
+
+  vector<LabelType> context;
+  bool differs = false;
+  mobvoi::RescoringHistory history;
+  for (int word : words) {
+    float separate_score = separate->GetLmScore(history, word, context,
+                                                context);
+    EXPECT_FLOAT_EQ(separate_score,
+                    unfused->GetLmScore(history, word, context, context));
+    // Opted in, the fused model is queried alone.
+    float fused_score = rescorer_->GetLmScore(history, word, context,
+                                              context);
+    EXPECT_FLOAT_EQ(fused_only->GetLmScore(history, word, context, context),
+                    fused_score);
+    differs = differs || std::fabs(separate_score - fused_score) > 1e-4;
+    mobvoi::RescoringHistory next;
+    mobvoi::RescoringUtil::UpdateHistory(history, word, &next);
+    history = next;
+  }
+  EXPECT_TRUE(differs);
+  std::remove(base_path.c_str());
+  std::remove(bugfix_path.c_str());
+  std::remove(fused_path.c_str());
+}
+
 }  // namespace mobvoi
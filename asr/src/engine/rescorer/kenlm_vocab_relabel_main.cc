@@ -3,6 +3,7 @@
 // Kenlm arpa binary file has its own vocabulary, so we need to map it to real
 // words.txt in decoding.
 
+#include "engine/rescorer/relabel_table.h"
 #include "fst/symbol-table.h"
 #include "mobvoi/base/at_exit.h"
 #include "mobvoi/base/compat.h"
@@ -15,12 +16,31 @@ DEFINE_string(word_symbol_table,
               "word symbol table for crf model");
 DEFINE_string(kenlm_model, "", "interrogative words list");
 DEFINE_string(output_file, "", "output file name");
+DEFINE_string(output_format, "text",
+              "text: tab separated label pairs, to be converted by "
+              "relabel_convert_tool; binary: relabel file which can be set to "
+              "KenLMConfig.relabel_file_path directly.");
 
 template <class Model>
 void GenerateMap() {
   lm::ngram::Config lm_config;
   unique_ptr<Model> model(new Model(FLAGS_kenlm_model.c_str(), lm_config));
-  auto symbol_table = fst::SymbolTable::ReadText(FLAGS_word_symbol_table);
+  unique_ptr<fst::SymbolTable> symbol_table(
+      fst::SymbolTable::ReadText(FLAGS_word_symbol_table));
+  if (FLAGS_output_format == "binary") {
+    mobvoi::RelabelTable relabel_table(symbol_table->AvailableKey());
+    fst::SymbolTableIterator iref(*symbol_table);
+    for (iref.Reset(); !iref.Done(); iref.Next()) {
+      relabel_table.Set(iref.Value(),
+                        model->GetVocabulary().Index(iref.Symbol()));
+    }
+    CHECK(relabel_table.WriteBinary(
+        FLAGS_output_file,
+        mobvoi::RelabelTable::SymbolTableFingerprint(*symbol_table),
+        mobvoi::RelabelTable::KenLMFingerprint(FLAGS_kenlm_model)));
+    return;
+  }
+  CHECK_EQ(FLAGS_output_format, "text") << "Unknown output format.";
   unordered_map<int, int> relabel_pair;
   fst::SymbolTableIterator iref(*symbol_table);
   for (iref.Reset(); !iref.Done(); iref.Next()) {
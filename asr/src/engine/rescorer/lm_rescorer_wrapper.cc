@@ -3,20 +3,57 @@
 
 #include "engine/rescorer/lm_rescorer_wrapper.h"
 
+#include "mobvoi/base/flags.h"
+
+DEFINE_int32(aho_corasick_cache_mb, 64,
+             "memory budget of the look ahead automata of app contexts "
+             "shared by all sessions, in MB.");
+DEFINE_int32(levenshtein_automata_cache_mb, 64,
+             "memory budget of the levenshtein automata of app contexts "
+             "shared by all sessions, in MB.");
+
 namespace mobvoi {
 
-void LMRescorerWrapper::OnCacheClear() {
-  if (cache_) {
-    cache_->Clear();
-  }
-  if (kenlm_cache_) {
-    kenlm_cache_->Clear();
+namespace {
+
+const float kNegLn10 = -2.302585f;
+
+// Rough memory taken by a levenshtein automaton per state. A keyword of n
+// labels within |distance| edits takes about (n + 1) * (2 * distance + 1)
+// states.
+const size_t kLevenAutoBytesPerState = 64;
+
+// Insert the keywords of |app_context| into |leven_auto| and build it.
+// Return the memory it takes, estimated from the keywords, since
+// LevenshteinAutomata does not report it.
+size_t InsertKeywords(const vector<LabelType>& app_context,
+                      const vector<int>& keywords_limit, int distance,
+                      LevenshteinAutomata* leven_auto) {
+  size_t bytes = sizeof(LevenshteinAutomata);
+  if (app_context.empty()) return bytes;
+  int start = app_context.size() - 1;
+  vector<LabelType> word;
+  int limit_index = keywords_limit.size() - 1;
+  while (start > 0) {
+    while (app_context[start] == dcd::kSentenceBoundary) start--;
+    word.clear();
+    while (app_context[start] != dcd::kSentenceBoundary) {
+      word.emplace_back(app_context[start--]);
+    }
+    int limit = (limit_index >= 0) ? keywords_limit[limit_index--] : 0;
+    leven_auto->Insert(word, distance, limit);
+    bytes += (word.size() + 1) * (2 * distance + 1) * kLevenAutoBytesPerState;
   }
+  leven_auto->Build();
+  return bytes;
 }
 
+}  // namespace
+
 template <>
 float LMRescorerWrapper::GetLmScore(const RescoringHistory& history,
                                     int word, int* context_matched) {
+  RESCORER_STATS_SCOPED_LATENCY(scoped_latency);
   if (word == 0) {
     return .0f;
   }
@@ -25,26 +62,40 @@ float LMRescorerWrapper::GetLmScore(const RescoringHistory& history,
   }
   if (cache_) {
     LMHistoryCKey lm_cache_key(word, history, rescorer_->GetRescorerKey());
+    const auto* cached = cache_->Get(lm_cache_key);
+    if (cached != nullptr) {
+      RESCORER_STATS_ADD(kScoreCacheHits);
+      if (context_matched != nullptr) {
+        *context_matched = cached->second;
+      }
+      return cached->first;
+    }
+    RESCORER_STATS_ADD(kScoreCacheMisses);
 
-    auto it = cache_->Peek(lm_cache_key);
-    if (it != cache_->end()) {
-      const auto& pair = it->second;
+    // Scores depend on the contexts of the session besides the key, so only
+    // context free scores are shared with other sessions.
+    const bool shared = shared_cache_ != nullptr &&
+        (query_context_ == nullptr || query_context_->empty()) &&
+        (app_context_ == nullptr || app_context_->empty());
+    SharedRescoringCache::Value shared_value;
+    if (shared && shared_cache_->Lookup(lm_cache_key, &shared_value)) {
+      RESCORER_STATS_ADD(kSharedCacheHits);
+      cache_->Put(lm_cache_key, shared_value);
       if (context_matched != nullptr) {
-        *context_matched = pair.second;
+        *context_matched = shared_value.second;
       }
-      return pair.first;
+      return shared_value.first;
     }
 
     auto score = rescorer_->GetLmScore(history, word,
         query_context_ == nullptr ? vector<LabelType>() : *query_context_,
         app_context_ == nullptr ? vector<LabelType>() : *app_context_,
         context_matched, kenlm_cache_.get());
-    // Here we use PutNewKey instead of Put, since we know that the key is NOT
-    // in the cache, if in it, this function will return in previous branch.
-    if (context_matched != nullptr) {
-      cache_->PutNewKey(lm_cache_key, std::make_pair(score, *context_matched));
-    } else {
-      cache_->PutNewKey(lm_cache_key, std::make_pair(score, false));
+    auto value = std::make_pair(
+        score, context_matched != nullptr ? *context_matched : 0);
+    cache_->Put(lm_cache_key, value);
+    if (shared) {
+      shared_cache_->Insert(lm_cache_key, value);
     }
     return score;
   }
@@ -69,68 +120,159 @@ float LMRescorerWrapper::GetLmScore(const RescoringHistoryT<N>& history,
       context_matched);
 }
 
+template <size_t N>
+float LMRescorerWrapper::GetLmScore(const ClassRescoringHistoryT<N>& history,
+                                    int word, int* context_matched) {
+  if (!history.InClass()) {
+    return GetLmScore(history.history, word, context_matched);
+  }
+  if (word == 0) {
+    return .0f;
+  }
+  auto it = class_members_.find(history.class_token);
+  if (it == class_members_.end()) {
+    return dcd::kMaxCost;
+  }
+  // Session specific, so not cached.
+  float log10_prob = 0.0f;
+  if (word == dcd::kClassTagIdForRescoring) {
+    log10_prob = it->second->End(history.class_node);
+  } else {
+    it->second->Next(history.class_node, word, log10_prob);
+  }
+  return log10_prob * kNegLn10;
+}
+
+template <size_t N>
+void LMRescorerWrapper::UpdateHistory(
+    const ClassRescoringHistoryT<N>& history, LabelType word,
+    ClassRescoringHistoryT<N>* new_history) const {
+  ClassRescoringHistoryT<N> next;
+  if (word == 0) {
+    next = history;
+  } else if (!history.InClass()) {
+    RescoringUtil::UpdateHistory(history.history, word, &next.history);
+    if (class_members_.find(word) != class_members_.end()) {
+      next.class_token = word;
+      next.class_node = lm::ngram::ClassMembers::kRoot;
+    }
+  } else {
+    // The member words stay out of the history, so the words after the slot
+    // go on from the class token.
+    next.history = history.history;
+    if (word != dcd::kClassTagIdForRescoring) {
+      auto it = class_members_.find(history.class_token);
+      float log10_prob = 0.0f;
+      next.class_token = history.class_token;
+      next.class_node = it == class_members_.end() ?
+          lm::ngram::ClassMembers::kNoNode :
+          it->second->Next(history.class_node, word, log10_prob);
+    }
+  }
+  *new_history = next;
+}
+
+void LMRescorerWrapper::SetClassMembers(
+    LabelType class_token, const vector<vector<LabelType>>& members) {
+  if (members.empty()) {
+    class_members_.erase(class_token);
+    return;
+  }
+  unique_ptr<lm::ngram::ClassMembers> class_members(
+      new lm::ngram::ClassMembers());
+  vector<lm::WordIndex> words;
+  for (const auto& member : members) {
+    words.assign(member.begin(), member.end());
+    class_members->Add(words.data(), words.data() + words.size());
+  }
+  class_members->Finish();
+  class_members_[class_token] = std::move(class_members);
+}
+
 void LMRescorerWrapper::Reset() {
   if (cache_) {
-    cache_->Clear();
+    cache_->Reset();
   }
   if (kenlm_cache_) {
     kenlm_cache_->Clear();
   }
   query_context_.reset();
+  class_members_.clear();
   tree_.reset();
   app_context_ = nullptr;
 }
 
+ContextAutomatonCache<AhoCorasickTree>*
+LMRescorerWrapper::GetAutomatonCache() {
+  // Leaked, like the other process-wide caches.
+  static ContextAutomatonCache<AhoCorasickTree>* cache =
+      new ContextAutomatonCache<AhoCorasickTree>(
+          static_cast<size_t>(FLAGS_aho_corasick_cache_mb) << 20);
+  return cache;
+}
+
 void LMRescorerWrapper::BuildAutomaton(const vector<LabelType>& app_context) {
-  tree_.reset(new AhoCorasickTree());
-  if (app_context.empty()) return;
-  int start = app_context.size() - 1;
-  for (int i = app_context.size() - 1; i >= 0; --i) {
-    if (app_context[i] == dcd::kSentenceBoundary) {
-      if (i < start - 1) {
-        tree_->Insert(app_context.crbegin() + app_context.size() - start,
-                      app_context.crbegin() + app_context.size() - i - 1);
-      }
-      start = i;
-    }
+  if (app_context.empty()) {
+    AhoCorasickTree* tree = new AhoCorasickTree();
+    tree->Build();
+    tree_.reset(tree);
+    return;
   }
-  tree_->Build();
+  tree_ = GetAutomatonCache()->GetOrBuild(
+      app_context, [&app_context](size_t* bytes) {
+        AhoCorasickTree* tree = new AhoCorasickTree();
+        int start = app_context.size() - 1;
+        for (int i = app_context.size() - 1; i >= 0; --i) {
+          if (app_context[i] == dcd::kSentenceBoundary) {
+            if (i < start - 1) {
+              tree->Insert(app_context.crbegin() + app_context.size() - start,
+                           app_context.crbegin() + app_context.size() - i - 1);
+            }
+            start = i;
+          }
+        }
+        tree->Build();
+        *bytes = tree->MemoryUsage();
+        return tree;
+      });
+}
+
+ContextAutomatonCache<LevenshteinAutomata>*
+LMRescorerWrapper::GetLevenAutoCache() {
+  static ContextAutomatonCache<LevenshteinAutomata>* cache =
+      new ContextAutomatonCache<LevenshteinAutomata>(
+          static_cast<size_t>(FLAGS_levenshtein_automata_cache_mb) << 20);
+  return cache;
 }
 
 void LMRescorerWrapper::BuildLevenAuto(const vector<LabelType>& app_context,
                                        const vector<int>& keywords_limit) {
-  if (leven_auto_cache_sum_ == std::accumulate(app_context.begin(),
-                                              app_context.end(),
-                                              0)) {
-    LOG(INFO) << "Levenshtein automata: Cache";
-    return;
-  }
-  leven_auto_.reset(new LevenshteinAutomata());
-  if (app_context.empty()) return;
-  int start = app_context.size() - 1;
-  vector<LabelType> word;
-  int distance = 1;
-  int limit_index = keywords_limit.size() - 1;
-  while (start > 0) {
-    while (app_context[start] == dcd::kSentenceBoundary) start--;
-    word.clear();
-    while (app_context[start] != dcd::kSentenceBoundary) {
-      word.emplace_back(app_context[start--]);
-    }
-    int limit = (limit_index >= 0) ? keywords_limit[limit_index--] : 0;
-    leven_auto_->Insert(word, distance, limit);
-  }
-  leven_auto_->Build();
-  leven_auto_cache_sum_ = std::accumulate(app_context.begin(),
-                                          app_context.end(),
-                                          0);
-  LOG(INFO) << "Levenshtein automata: Build";
+  const int distance = 1;
+  // Everything the automaton is built from: the distance, the limits and the
+  // app context.
+  vector<int32> key;
+  key.reserve(2 + keywords_limit.size() + app_context.size());
+  key.push_back(distance);
+  key.push_back(keywords_limit.size());
+  key.insert(key.end(), keywords_limit.begin(), keywords_limit.end());
+  key.insert(key.end(), app_context.begin(), app_context.end());
+
+  bool built = false;
+  leven_auto_ = GetLevenAutoCache()->GetOrBuild(
+      key, [&](size_t* bytes) {
+        built = true;
+        LevenshteinAutomata* leven_auto = new LevenshteinAutomata();
+        *bytes = InsertKeywords(app_context, keywords_limit, distance,
+                                leven_auto);
+        return leven_auto;
+      });
+  LOG(INFO) << "Levenshtein automata: " << (built ? "Build" : "Cache");
 }
 
 float LMRescorerWrapper::LookAheadScore(uint16_t* state, int word,
                                         int* height) const {
   if (!tree_) {
-    LOG(FATAL) << "Please build automaton first!";
+    LOG(FATAL) << "Please set app context first!";
   }
   return rescorer_->LookAheadScore(*tree_, state, word, height);
 }
@@ -157,4 +299,14 @@ int LMRescorerWrapper::LookLevenScore(const vector<LAState>& in,
 
 template float LMRescorerWrapper::GetLmScore(
     const LongRescoringHistory& history, int word, int* context_matched);
+template float LMRescorerWrapper::GetLmScore(
+    const ClassRescoringHistory& history, int word, int* context_matched);
+template float LMRescorerWrapper::GetLmScore(
+    const LongClassRescoringHistory& history, int word, int* context_matched);
+template void LMRescorerWrapper::UpdateHistory(
+    const ClassRescoringHistory& history, LabelType word,
+    ClassRescoringHistory* new_history) const;
+template void LMRescorerWrapper::UpdateHistory(
+    const LongClassRescoringHistory& history, LabelType word,
+    LongClassRescoringHistory* new_history) const;
 }  // namespace mobvoi
@@ -7,53 +7,77 @@
 #include <algorithm>
 #include <array>
 #include <memory>
-#include <numeric>
+#include <unordered_map>
 #include <vector>
 
 #include "base/mru_cache.h"
+#include "engine/rescorer/context_automaton_cache.h"
 #include "engine/rescorer/levenshtein_automata.h"
 #include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescorer_stats.h"
+#include "engine/rescorer/rescoring_cache.h"
+#include "engine/rescorer/rescoring_key_hash.h"
+#include "engine/rescorer/shared_rescoring_cache.h"
+#include "third_party/kenlm/lm/class_model.hh"
 
 namespace mobvoi {
 
-class LMRescorerWrapper : RescoringCacheDelegate {
+class LMRescorerWrapper {
  public:
   explicit LMRescorerWrapper(LMRescorer* rescorer, int cache_size) :
       LMRescorerWrapper(rescorer, false, cache_size) {}
 
   LMRescorerWrapper(LMRescorer* rescorer, bool own_rescorer, int cache_size) :
-      rescorer_(rescorer), own_rescorer_(own_rescorer), app_context_(nullptr) {
+      rescorer_(rescorer), own_rescorer_(own_rescorer), app_context_(nullptr),
+      shared_cache_(nullptr) {
     if (cache_size > 0) {
-      cache_.reset(new HashingMRUCache<LMHistoryCKey,
-           std::pair<float, int>, LMHistoryCKeyHash>(cache_size));
+      shared_cache_ = SharedRescoringCache::Get();
+      cache_.reset(new ClockCache<LMHistoryCKey,
+           std::pair<float, int>, LMHistoryKeyHash>(cache_size));
       kenlm_cache_.reset(new HashingMRUCache<RescoringHistoryCKey,
           State, RescoringHistoryCKeyHash>(cache_size));
-      if (rescorer_)
-        rescorer_->SetRescoringCacheDelegate(this);
     }
   }
 
   ~LMRescorerWrapper() {
-    if (rescorer_)
-      rescorer_->SetRescoringCacheDelegate(nullptr);
     if (own_rescorer_) {
       delete rescorer_;
       rescorer_ = nullptr;
     }
   }
 
-  // RescoringCacheDelegate method:
-  void OnCacheClear() override;
-
   template <size_t N>
   float GetLmScore(const RescoringHistoryT<N>& history, int word,
                    int* context_matched = nullptr);
+  // Score |word| after |history|. Inside a class slot the members of the
+  // class score the member words and the closing kClassTagIdForRescoring,
+  // outside of one the models score the words, the class tokens included.
+  template <size_t N>
+  float GetLmScore(const ClassRescoringHistoryT<N>& history, int word,
+                   int* context_matched = nullptr);
+  // Read |word| into |history|. A class token of bound members enters its
+  // class slot, and kClassTagIdForRescoring leaves it.
+  template <size_t N>
+  void UpdateHistory(const ClassRescoringHistoryT<N>& history, LabelType word,
+                     ClassRescoringHistoryT<N>* new_history) const;
   void Reset();
-  // Take ownership of query_context, app_context is not owned here.
+  // Bind the members of the class of |class_token|, e.g. the contacts of the
+  // user, for this session until Reset(). Each member is a sequence of word
+  // labels, which need not be known to the models. Empty |members| unbinds
+  // the class. Class slots are read with ClassRescoringHistory.
+  void SetClassMembers(LabelType class_token,
+                       const vector<vector<LabelType>>& members);
+  // Counters of all rescorers in the process, see --rescorer_stats. The score
+  // cache hits of this wrapper are counted there.
+  static RescorerStatsSnapshot GetStats() { return RescorerStats::Snapshot(); }
+  // Take ownership of query_context, app_context is not owned here. The look
+  // ahead automaton of app_context is built here, or taken from the cache.
   void SetContext(const vector<LabelType>* app_context,
                   vector<LabelType>* query_context) {
     app_context_ = app_context;
     query_context_.reset(query_context);
+    tree_.reset();
+    if (app_context != nullptr) BuildAutomaton(*app_context);
   }
   void SetContext(const vector<LabelType>* app_context,
                   const vector<int>& keywords_limit) {
@@ -61,6 +85,12 @@ class LMRescorerWrapper : RescoringCacheDelegate {
   }
   float LookAheadScore(uint16_t* state, int word, int* height) const;
   vector<LabelType> GetLevenMatch(const LAState state) const;
+  // Process-wide cache of the look ahead automata of app contexts, sized by
+  // --aho_corasick_cache_mb.
+  static ContextAutomatonCache<AhoCorasickTree>* GetAutomatonCache();
+  // Process-wide cache of the levenshtein automata of app contexts, sized by
+  // --levenshtein_automata_cache_mb.
+  static ContextAutomatonCache<LevenshteinAutomata>* GetLevenAutoCache();
   int LookLevenScore(const vector<LAState>& in,
                      const int word,
                      const uint16_t frame,
@@ -76,15 +106,25 @@ class LMRescorerWrapper : RescoringCacheDelegate {
   bool own_rescorer_;
   const vector<LabelType>* app_context_;
   unique_ptr<vector<LabelType>> query_context_;
-  unique_ptr<AhoCorasickTree> tree_;
-  unique_ptr<LevenshteinAutomata> leven_auto_;
-  int leven_auto_cache_sum_{0};
-  // TODO(spye): Consider use HashingHashingMRUCache, compare performance for
-  // different cache type.
-  unique_ptr<HashingMRUCache<LMHistoryCKey, std::pair<float, int>,
-      LMHistoryCKeyHash>> cache_;
+  // Shared with the other sessions of the same app context.
+  shared_ptr<const AhoCorasickTree> tree_;
+  // Shared with the other sessions of the same app context and limits. It is
+  // immutable once built, and the queries keep their states in the
+  // LAState vectors of the session, so sessions query it without a lock.
+  shared_ptr<const LevenshteinAutomata> leven_auto_;
+  // Class members of this session by class token.
+  std::unordered_map<LabelType, unique_ptr<lm::ngram::ClassMembers>>
+      class_members_;
+  // Score cache. It is probed for every arc and reset at every utterance, so
+  // it uses the allocation free ClockCache, see rescoring_cache_bench.cc.
+  unique_ptr<ClockCache<LMHistoryCKey, std::pair<float, int>,
+      LMHistoryKeyHash>> cache_;
+  // kenlm state cache. Its type is the RescoringCache of the LMRescorer
+  // interface.
   unique_ptr<HashingMRUCache<RescoringHistoryCKey, State,
       RescoringHistoryCKeyHash>> kenlm_cache_;
+  // Process-wide cache behind |cache_|, nullptr if disabled.
+  SharedRescoringCache* shared_cache_;
 
   DISALLOW_COPY_AND_ASSIGN(LMRescorerWrapper);
 };
@@ -0,0 +1,241 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/overlay_ngram_model.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "mobvoi/base/log.h"
+#include "third_party/kenlm/util/exception.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/murmur_hash.hh"
+
+namespace {
+
+const char kOverlayFileMagic[8] = {'m', 'v', 'o', 'v', 'e', 'r', 'l', 'y'};
+
+// Bump it whenever the layout below changes.
+const uint32 kOverlayFileVersion = 1;
+
+// Bytes of the shortest n-gram record, a unigram.
+const uint64 kMinNgramRecordSize = 2 * sizeof(int32) + 2 * sizeof(float);
+
+// Overlay file layout, followed by |num_ngrams| records of an int32 order,
+// the order int32 words, and the float log10 probability and backoff.
+struct OverlayFileHeader {
+  char magic[8];
+  uint32 version;
+  uint32 unused;
+  uint64 symbol_table_fingerprint;
+  uint64 num_ngrams;
+  uint64 data_size;
+};
+
+uint64 NgramKey(const int32* words, int size) {
+  return util::MurmurHash64A(words, size * sizeof(int32),
+                             kOverlayFileVersion);
+}
+
+template <class T>
+void Append(const T& value, string* data) {
+  data->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <class T>
+bool Consume(const char** data, const char* end, T* value) {
+  if (end - *data < static_cast<ptrdiff_t>(sizeof(T)))
+    return false;
+  memcpy(value, *data, sizeof(T));
+  *data += sizeof(T);
+  return true;
+}
+
+}  // namespace
+
+namespace mobvoi {
+
+OverlayNgramModel::OverlayNgramModel() : max_order_(0) {}
+
+OverlayNgramModel::~OverlayNgramModel() {}
+
+OverlayNgramModel* OverlayNgramModel::Add(
+    const vector<OverlayNgram>& ngrams) const {
+  unique_ptr<OverlayNgramModel> overlay(new OverlayNgramModel(*this));
+  for (const auto& ngram : ngrams) {
+    if (!overlay->Insert(ngram))
+      return nullptr;
+  }
+  return overlay.release();
+}
+
+bool OverlayNgramModel::Insert(const OverlayNgram& ngram) {
+  const int size = ngram.words.size();
+  bool valid = size > 0 && size <= kMaxOrder && ngram.log10_prob <= 0.0f;
+  for (int i = 0; valid && i < size; ++i) {
+    int32 word = ngram.words[i];
+    if (word == dcd::kSentenceBoundary) {
+      valid = i == 0 && size > 1;
+    } else if (word == dcd::kEndOfSentence) {
+      valid = i == size - 1;
+    } else {
+      valid = word > 0;
+    }
+  }
+  if (!valid) {
+    LOG(WARNING) << "Malformed overlay n-gram of " << size << " words, prob "
+                 << ngram.log10_prob;
+    return false;
+  }
+
+  // N-grams of different words may share a key, so only the one of the same
+  // words is replaced.
+  uint64 key = NgramKey(ngram.words.data(), size);
+  auto range = index_.equal_range(key);
+  auto it = range.first;
+  while (it != range.second && ngrams_[it->second].words != ngram.words) ++it;
+  if (it != range.second) {
+    ngrams_[it->second] = ngram;
+  } else {
+    index_.emplace(key, ngrams_.size());
+    ngrams_.push_back(ngram);
+  }
+  last_words_.insert(ngram.words.back());
+  max_order_ = std::max(max_order_, size);
+  return true;
+}
+
+const OverlayNgram* OverlayNgramModel::Find(const int32* words,
+                                            int size) const {
+  auto range = index_.equal_range(NgramKey(words, size));
+  for (auto it = range.first; it != range.second; ++it) {
+    const OverlayNgram& ngram = ngrams_[it->second];
+    if (std::equal(words, words + size, ngram.words.begin(),
+                   ngram.words.end()))
+      return &ngram;
+  }
+  return nullptr;
+}
+
+bool OverlayNgramModel::ScoreContext(const int32* context, int size,
+                                     int32 word, OverlayScore* score) const {
+  // The context oldest first followed by |word|, so that every n-gram looked
+  // up is a suffix.
+  int32 words[kMaxOrder];
+  for (int i = 0; i < size; ++i) {
+    words[i] = context[size - 1 - i];
+  }
+  words[size] = word;
+
+  float backoff = 0.0f;
+  uint32 backoff_contexts = 0;
+  for (int length = size; length >= 0; --length) {
+    const int32* begin = words + size - length;
+    const OverlayNgram* ngram = Find(begin, length + 1);
+    if (ngram != nullptr) {
+      score->log10_prob = ngram->log10_prob + backoff;
+      score->order = length + 1;
+      score->backoff_contexts = backoff_contexts;
+      return true;
+    }
+    if (length > 0) {
+      const OverlayNgram* context_ngram = Find(begin, length);
+      if (context_ngram != nullptr) {
+        backoff += context_ngram->log10_backoff;
+        backoff_contexts |= 1u << (length - 1);
+      }
+    }
+  }
+  return false;
+}
+
+bool OverlayNgramModel::Save(const string& path,
+                             uint64 symbol_table_fingerprint) const {
+  string data;
+  for (const auto& ngram : ngrams_) {
+    Append(static_cast<int32>(ngram.words.size()), &data);
+    for (int32 word : ngram.words) Append(word, &data);
+    Append(ngram.log10_prob, &data);
+    Append(ngram.log10_backoff, &data);
+  }
+
+  OverlayFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kOverlayFileMagic, sizeof(header.magic));
+  header.version = kOverlayFileVersion;
+  header.symbol_table_fingerprint = symbol_table_fingerprint;
+  header.num_ngrams = ngrams_.size();
+  header.data_size = data.size();
+  const string temp_path = path + ".tmp";
+  try {
+    util::scoped_fd fd(util::CreateOrThrow(temp_path.c_str()));
+    util::WriteOrThrow(fd.get(), &header, sizeof(header));
+    util::WriteOrThrow(fd.get(), data.data(), data.size());
+    util::FSyncOrThrow(fd.get());
+  } catch (const util::Exception& e) {
+    LOG(ERROR) << "Failed to write overlay " << temp_path << ": "
+               << e.what();
+    return false;
+  }
+  if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Failed to rename overlay " << temp_path << " to " << path;
+    return false;
+  }
+  return true;
+}
+
+OverlayNgramModel* OverlayNgramModel::Load(const string& path,
+                                           uint64 symbol_table_fingerprint) {
+  OverlayFileHeader header;
+  string data;
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    uint64 file_size = util::SizeOrThrow(fd.get());
+    if (file_size < sizeof(header)) {
+      LOG(WARNING) << "Overlay " << path << " is truncated.";
+      return nullptr;
+    }
+    util::ReadOrThrow(fd.get(), &header, sizeof(header));
+    if (memcmp(header.magic, kOverlayFileMagic, sizeof(header.magic)) ||
+        header.version != kOverlayFileVersion) {
+      LOG(WARNING) << "Overlay " << path << " has unsupported format.";
+      return nullptr;
+    }
+    if (file_size != sizeof(header) + header.data_size ||
+        header.num_ngrams > header.data_size / kMinNgramRecordSize) {
+      LOG(WARNING) << "Overlay " << path << " has wrong size.";
+      return nullptr;
+    }
+    data.resize(header.data_size);
+    util::ReadOrThrow(fd.get(), &data[0], data.size());
+  } catch (const util::Exception& e) {
+    LOG(WARNING) << "Failed to read overlay " << path << ": " << e.what();
+    return nullptr;
+  }
+  if (header.symbol_table_fingerprint != symbol_table_fingerprint) {
+    LOG(WARNING) << "Overlay " << path
+                 << " was saved with another symbol table.";
+    return nullptr;
+  }
+
+  vector<OverlayNgram> ngrams(header.num_ngrams);
+  const char* begin = data.data();
+  const char* end = begin + data.size();
+  for (auto& ngram : ngrams) {
+    int32 size = 0;
+    bool valid = Consume(&begin, end, &size) && size > 0 && size <= kMaxOrder;
+    ngram.words.resize(valid ? size : 0);
+    for (auto& word : ngram.words) {
+      valid = valid && Consume(&begin, end, &word);
+    }
+    valid = valid && Consume(&begin, end, &ngram.log10_prob) &&
+            Consume(&begin, end, &ngram.log10_backoff);
+    if (!valid) {
+      LOG(WARNING) << "Overlay " << path << " is corrupted.";
+      return nullptr;
+    }
+  }
+  return OverlayNgramModel().Add(ngrams);
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,118 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_OVERLAY_NGRAM_MODEL_H_
+#define ENGINE_RESCORER_OVERLAY_NGRAM_MODEL_H_
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "engine/decoder/constants.h"
+#include "mobvoi/base/compat.h"
+
+namespace mobvoi {
+
+// An n-gram of an overlay, in decoder labels, oldest word first. The first
+// word may be dcd::kSentenceBoundary for <s>, and the last one
+// dcd::kEndOfSentence for </s>.
+struct OverlayNgram {
+  vector<int32> words;
+  float log10_prob = 0.0f;
+  // Backoff of the n-gram as the context of a longer one, 0 if none.
+  float log10_backoff = 0.0f;
+};
+
+// Score of a word by an overlay.
+struct OverlayScore {
+  // log10 probability of the longest n-gram of the overlay ending with the
+  // word, plus the backoffs of the longer contexts in the overlay.
+  float log10_prob = 0.0f;
+  // Order of that n-gram.
+  int order = 0;
+  // Bit i is set if the backoff of the context of the i + 1 most recent
+  // words is in |log10_prob|.
+  uint32 backoff_contexts = 0;
+};
+
+// Explicit n-grams consulted before the kenlm binary of a model, so that a
+// handful of new words or phrases of the newword and bugfix models take
+// effect without building and reloading a binary.
+//
+// A word is scored by the longest n-gram of the overlay ending with it in the
+// context, plus the backoffs of the longer contexts in the overlay, as kenlm
+// scores an ARPA model. Words with no n-gram in the overlay are left to the
+// binary, and so are words the binary has a longer n-gram of in the context,
+// see KenLMRescorer::Query(). Being keyed by decoder labels, the overlay
+// scores words the binary does not know.
+//
+// An overlay is immutable once built, so rescorers read it without locking.
+// Add() returns a copy with the new n-grams, which RescorerModelManager
+// publishes with a new model table, the way it publishes reloaded models.
+class OverlayNgramModel {
+ public:
+  // Longest n-gram of an overlay.
+  static const int kMaxOrder = KENLM_MAX_ORDER;
+
+  OverlayNgramModel();
+  ~OverlayNgramModel();
+
+  // Copy of the overlay with |ngrams| added, replacing the n-grams of the
+  // same words. Return nullptr if any of |ngrams| is malformed.
+  OverlayNgramModel* Add(const vector<OverlayNgram>& ngrams) const;
+
+  // Write the n-grams to |path|, bound to |symbol_table_fingerprint| since
+  // they are in decoder labels. The file is replaced at once, so a crash
+  // never leaves a truncated overlay.
+  bool Save(const string& path, uint64 symbol_table_fingerprint) const;
+
+  // Read an overlay written by Save(). Return nullptr if the file is missing,
+  // corrupted, or saved with another symbol table.
+  static OverlayNgramModel* Load(const string& path,
+                                 uint64 symbol_table_fingerprint);
+
+  // Score of |word| following |history|, most recent word first, if the
+  // overlay has an n-gram of |word|. The history ends at the first
+  // dcd::kSentenceBoundary, which is <s>.
+  template <class History>
+  bool Score(const History& history, int history_size, int32 word,
+             OverlayScore* score) const {
+    // Most words have no n-gram in the overlay.
+    if (last_words_.find(word) == last_words_.end())
+      return false;
+    int32 words[kMaxOrder];
+    int count = 0;
+    while (count < max_order_ - 1 && count < history_size) {
+      words[count] = history[count];
+      if (words[count++] == dcd::kSentenceBoundary)
+        break;
+    }
+    return ScoreContext(words, count, word, score);
+  }
+
+  const vector<OverlayNgram>& ngrams() const { return ngrams_; }
+  int max_order() const { return max_order_; }
+
+ private:
+  // |context| is most recent word first.
+  bool ScoreContext(const int32* context, int size, int32 word,
+                    OverlayScore* score) const;
+
+  // The n-gram of |words|, oldest first, or nullptr.
+  const OverlayNgram* Find(const int32* words, int size) const;
+
+  // Validate and insert |ngram|, replacing the one of the same words.
+  bool Insert(const OverlayNgram& ngram);
+
+  // Indexes |ngrams_| by the hash of their words, oldest first. N-grams of
+  // colliding hashes are told apart by their words.
+  std::unordered_multimap<uint64, int32> index_;
+  vector<OverlayNgram> ngrams_;
+  // Last words of |ngrams_|, which are the words the overlay scores.
+  unordered_set<int32> last_words_;
+  int max_order_;
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_OVERLAY_NGRAM_MODEL_H_
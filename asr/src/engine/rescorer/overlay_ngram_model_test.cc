@@ -0,0 +1,138 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/overlay_ngram_model.h"
+
+#include <cstdio>
+
+#include "engine/rescorer/rescoring_utils.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+const char kOverlayFile[] = "engine/rescorer/testdata/overlay_test.bin";
+
+OverlayNgram MakeNgram(const vector<int32>& words, float log10_prob,
+                       float log10_backoff = 0.0f) {
+  OverlayNgram ngram;
+  ngram.words = words;
+  ngram.log10_prob = log10_prob;
+  ngram.log10_backoff = log10_backoff;
+  return ngram;
+}
+
+// Words of a history, most recent first.
+RescoringHistory MakeHistory(const vector<int32>& words) {
+  RescoringHistory history;
+  for (size_t i = 0; i < words.size(); ++i) history[i] = words[i];
+  return history;
+}
+
+bool Score(const OverlayNgramModel& overlay, const vector<int32>& history,
+           int32 word, float* log10_prob, int* order = nullptr) {
+  RescoringHistory key = MakeHistory(history);
+  OverlayScore score;
+  if (!overlay.Score(key, key.order(), word, &score)) return false;
+  *log10_prob = score.log10_prob;
+  if (order != nullptr) *order = score.order;
+  return true;
+}
+}  // namespace
+
+TEST(OverlayNgramModelTest, Backoff) {
+  unique_ptr<OverlayNgramModel> overlay(OverlayNgramModel().Add({
+      MakeNgram({5}, -2.0f, -0.5f),
+      MakeNgram({6}, -3.0f, -0.25f),
+      MakeNgram({5, 6}, -1.0f, -0.125f),
+      MakeNgram({5, 6, 7}, -0.5f),
+      MakeNgram({dcd::kSentenceBoundary, 7}, -1.5f),
+  }));
+  ASSERT_TRUE(overlay != nullptr);
+  EXPECT_EQ(3, overlay->max_order());
+
+  float prob = 0.0f;
+  int order = 0;
+  // Longest n-gram.
+  ASSERT_TRUE(Score(*overlay, {6, 5}, 7, &prob, &order));
+  EXPECT_FLOAT_EQ(-0.5f, prob);
+  EXPECT_EQ(3, order);
+  // Unigram after the backoff of context 6.
+  ASSERT_TRUE(Score(*overlay, {6, 9}, 5, &prob, &order));
+  EXPECT_FLOAT_EQ(-2.25f, prob);
+  EXPECT_EQ(1, order);
+  // Unigram after the backoffs of contexts 5 6 and 6.
+  ASSERT_TRUE(Score(*overlay, {6, 5}, 6, &prob));
+  EXPECT_FLOAT_EQ(-3.375f, prob);
+  // Start of sentence.
+  ASSERT_TRUE(Score(*overlay, {}, 7, &prob));
+  EXPECT_FLOAT_EQ(-1.5f, prob);
+  // Left to the base model.
+  EXPECT_FALSE(Score(*overlay, {6, 9}, 7, &prob));
+  EXPECT_FALSE(Score(*overlay, {6, 5}, 8, &prob));
+}
+
+TEST(OverlayNgramModelTest, AddReplaces) {
+  unique_ptr<OverlayNgramModel> overlay(
+      OverlayNgramModel().Add({MakeNgram({5}, -2.0f)}));
+  ASSERT_TRUE(overlay != nullptr);
+  unique_ptr<OverlayNgramModel> updated(
+      overlay->Add({MakeNgram({5}, -1.0f), MakeNgram({6}, -3.0f)}));
+  ASSERT_TRUE(updated != nullptr);
+  EXPECT_EQ(2u, updated->ngrams().size());
+
+  float prob = 0.0f;
+  ASSERT_TRUE(Score(*updated, {}, 5, &prob));
+  EXPECT_FLOAT_EQ(-1.0f, prob);
+  // The original is not changed.
+  ASSERT_TRUE(Score(*overlay, {}, 5, &prob));
+  EXPECT_FLOAT_EQ(-2.0f, prob);
+  EXPECT_FALSE(Score(*overlay, {}, 6, &prob));
+}
+
+TEST(OverlayNgramModelTest, Malformed) {
+  OverlayNgramModel empty;
+  EXPECT_TRUE(empty.Add({MakeNgram({}, -1.0f)}) == nullptr);
+  EXPECT_TRUE(empty.Add({MakeNgram({5}, 1.0f)}) == nullptr);
+  EXPECT_TRUE(empty.Add({MakeNgram({5, dcd::kSentenceBoundary}, -1.0f)}) ==
+              nullptr);
+  EXPECT_TRUE(empty.Add({MakeNgram({dcd::kEndOfSentence, 5}, -1.0f)}) ==
+              nullptr);
+  EXPECT_TRUE(empty.Add({MakeNgram(
+      vector<int32>(OverlayNgramModel::kMaxOrder + 1, 5), -1.0f)}) ==
+              nullptr);
+}
+
+TEST(OverlayNgramModelTest, SaveLoad) {
+  unique_ptr<OverlayNgramModel> overlay(OverlayNgramModel().Add({
+      MakeNgram({5}, -2.0f, -0.5f),
+      MakeNgram({5, dcd::kEndOfSentence}, -0.75f),
+  }));
+  ASSERT_TRUE(overlay != nullptr);
+  ASSERT_TRUE(overlay->Save(kOverlayFile, 11));
+
+  EXPECT_TRUE(OverlayNgramModel::Load(kOverlayFile, 12) == nullptr);
+  unique_ptr<OverlayNgramModel> loaded(
+      OverlayNgramModel::Load(kOverlayFile, 11));
+  ASSERT_TRUE(loaded != nullptr);
+  EXPECT_EQ(2u, loaded->ngrams().size());
+  float prob = 0.0f;
+  ASSERT_TRUE(Score(*loaded, {5}, dcd::kEndOfSentence, &prob));
+  EXPECT_FLOAT_EQ(-0.75f, prob);
+
+  // A count of n-grams the data can not hold is rejected before reading them.
+  string content;
+  ASSERT_TRUE(File::ReadFileToString(kOverlayFile, &content));
+  const uint64 num_ngrams = 1ULL << 60;
+  const size_t kNumNgramsOffset = 24;
+  content.replace(kNumNgramsOffset, sizeof(num_ngrams),
+                  reinterpret_cast<const char*>(&num_ngrams),
+                  sizeof(num_ngrams));
+  ASSERT_TRUE(File::WriteStringToFile(content, kOverlayFile));
+  EXPECT_TRUE(OverlayNgramModel::Load(kOverlayFile, 11) == nullptr);
+  std::remove(kOverlayFile);
+  EXPECT_TRUE(OverlayNgramModel::Load(kOverlayFile, 11) == nullptr);
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,181 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/relabel_table.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mobvoi/base/log.h"
+#include "third_party/kenlm/lm/binary_format.hh"
+#include "third_party/kenlm/util/exception.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/murmur_hash.hh"
+
+namespace {
+
+const char kRelabelFileMagic[8] = {'m', 'v', 'r', 'e', 'l', 'a', 'b', 'l'};
+
+// Bump it whenever the layout below changes.
+const uint32 kRelabelFileVersion = 1;
+
+// Bytes of a kenlm model read at a time by KenLMFingerprint().
+const size_t kFingerprintChunkSize = 1 << 20;
+
+// Bytes at the start of a kenlm binary hashed by KenLMFingerprint(). The
+// header is smaller than a page.
+const uint64 kFingerprintHeaderSize = 4096;
+
+// Binary relabel file layout, followed by |size| lm::WordIndex entries.
+struct RelabelFileHeader {
+  char magic[8];
+  uint32 version;
+  uint32 word_index_size;
+  uint64 symbol_table_fingerprint;
+  uint64 kenlm_fingerprint;
+  uint64 size;
+  uint64 checksum;
+};
+
+uint64 TableChecksum(const lm::WordIndex* data, size_t size) {
+  return util::MurmurHash64A(data, size * sizeof(lm::WordIndex),
+                             kRelabelFileVersion);
+}
+
+// Hash the bytes of |fd| in [begin, end) into |seed|.
+uint64 HashFileRange(int fd, uint64 begin, uint64 end, uint64 seed) {
+  vector<char> buffer(std::min<uint64>(end - begin, kFingerprintChunkSize));
+  for (uint64 offset = begin; offset < end; offset += buffer.size()) {
+    size_t size = std::min<uint64>(buffer.size(), end - offset);
+    util::ErsatzPRead(fd, buffer.data(), size, offset);
+    seed = util::MurmurHash64A(buffer.data(), size, seed);
+  }
+  return seed;
+}
+
+// Offset of the vocabulary strings of a kenlm binary, the |count| null
+// terminated words at the end of the file after the mapped region. Reading
+// back from the end, it is found before the mapped region is read.
+uint64 VocabStringsOffset(int fd, uint64 file_size, uint64 count) {
+  vector<char> buffer(std::min<uint64>(file_size, kFingerprintChunkSize));
+  uint64 terminators = 0;
+  for (uint64 end = file_size; end > 0;) {
+    size_t size = std::min<uint64>(buffer.size(), end);
+    uint64 begin = end - size;
+    util::ErsatzPRead(fd, buffer.data(), size, begin);
+    for (size_t i = size; i > 0; --i) {
+      // The terminator of the word before the first one.
+      if (buffer[i - 1] == '\0' && ++terminators > count) return begin + i;
+    }
+    end = begin;
+  }
+  return 0;
+}
+
+}  // namespace
+
+namespace mobvoi {
+
+bool RelabelTable::WriteBinary(const string& path,
+                               uint64 symbol_table_fingerprint,
+                               uint64 kenlm_fingerprint) const {
+  RelabelFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kRelabelFileMagic, sizeof(header.magic));
+  header.version = kRelabelFileVersion;
+  header.word_index_size = sizeof(lm::WordIndex);
+  header.symbol_table_fingerprint = symbol_table_fingerprint;
+  header.kenlm_fingerprint = kenlm_fingerprint;
+  header.size = size_;
+  header.checksum = TableChecksum(data_, size_);
+  try {
+    util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+    util::WriteOrThrow(fd.get(), &header, sizeof(header));
+    util::WriteOrThrow(fd.get(), data_, size_ * sizeof(lm::WordIndex));
+  } catch (const util::Exception& e) {
+    LOG(ERROR) << "Failed to write relabel file " << path << ": " << e.what();
+    return false;
+  }
+  return true;
+}
+
+RelabelTable* RelabelTable::LoadBinary(const string& path,
+                                       uint64 symbol_table_fingerprint,
+                                       uint64 kenlm_fingerprint) {
+  unique_ptr<RelabelTable> table(new RelabelTable());
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    uint64 file_size = util::SizeOrThrow(fd.get());
+    if (file_size < sizeof(RelabelFileHeader)) {
+      LOG(WARNING) << "Relabel file " << path << " is truncated.";
+      return nullptr;
+    }
+    util::MapRead(util::POPULATE_OR_LAZY, fd.get(), 0, file_size,
+                  table->mapped_);
+  } catch (const util::Exception& e) {
+    LOG(WARNING) << "Failed to map relabel file " << path << ": " << e.what();
+    return nullptr;
+  }
+
+  const RelabelFileHeader* header =
+      reinterpret_cast<const RelabelFileHeader*>(table->mapped_.begin());
+  if (memcmp(header->magic, kRelabelFileMagic, sizeof(header->magic)) ||
+      header->version != kRelabelFileVersion ||
+      header->word_index_size != sizeof(lm::WordIndex)) {
+    LOG(WARNING) << "Relabel file " << path << " has unsupported format.";
+    return nullptr;
+  }
+  if (header->symbol_table_fingerprint != symbol_table_fingerprint ||
+      header->kenlm_fingerprint != kenlm_fingerprint) {
+    LOG(WARNING) << "Relabel file " << path
+                 << " was generated from another symbol table or kenlm model.";
+    return nullptr;
+  }
+  if (table->mapped_.size() !=
+      sizeof(RelabelFileHeader) + header->size * sizeof(lm::WordIndex)) {
+    LOG(WARNING) << "Relabel file " << path << " has wrong size.";
+    return nullptr;
+  }
+  const lm::WordIndex* data = reinterpret_cast<const lm::WordIndex*>(
+      table->mapped_.begin() + sizeof(RelabelFileHeader));
+  if (TableChecksum(data, header->size) != header->checksum) {
+    LOG(WARNING) << "Relabel file " << path << " is corrupted.";
+    return nullptr;
+  }
+
+  table->data_ = data;
+  table->size_ = header->size;
+  return table.release();
+}
+
+uint64 RelabelTable::SymbolTableFingerprint(const fst::SymbolTable& symbols) {
+  const string& checksum = symbols.LabeledCheckSum();
+  return util::MurmurHash64A(checksum.data(), checksum.size(),
+                             symbols.AvailableKey());
+}
+
+uint64 RelabelTable::KenLMFingerprint(const string& model_path) {
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(model_path.c_str()));
+    const uint64 file_size = util::SizeOrThrow(fd.get());
+    if (!lm::ngram::IsBinaryFormat(fd.get())) {
+      // An ARPA file is read through when loading anyway.
+      return HashFileRange(fd.get(), 0, file_size, file_size);
+    }
+    lm::ngram::Parameters params;
+    lm::ngram::ReadHeader(fd.get(), params);
+    uint64 fingerprint = HashFileRange(
+        fd.get(), 0, std::min(file_size, kFingerprintHeaderSize), file_size);
+    if (params.fixed.has_vocabulary && !params.counts.empty()) {
+      fingerprint = HashFileRange(
+          fd.get(), VocabStringsOffset(fd.get(), file_size, params.counts[0]),
+          file_size, fingerprint);
+    }
+    return fingerprint;
+  } catch (const util::Exception& e) {
+    LOG(WARNING) << "Failed to fingerprint " << model_path << ": "
+                 << e.what();
+    return 0;
+  }
+}
+
+}  // namespace mobvoi
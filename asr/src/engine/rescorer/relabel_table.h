@@ -0,0 +1,82 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RELABEL_TABLE_H_
+#define ENGINE_RESCORER_RELABEL_TABLE_H_
+
+#include <vector>
+
+#include "engine/decoder/constants.h"
+#include "fst/symbol-table.h"
+#include "mobvoi/base/compat.h"
+#include "third_party/kenlm/lm/word_index.hh"
+#include "third_party/kenlm/util/mmap.hh"
+
+namespace mobvoi {
+
+// kenlm maps every unknown word to <unk>, whose index is always 0.
+const lm::WordIndex kRelabelOOVIndex = 0;
+
+// Dense mapping from base ASR model word labels to kenlm vocabulary indexes.
+// The table is indexed by label directly and sized to the symbol table, so a
+// lookup is a bound check plus one load. Labels which are unknown to kenlm, or
+// out of the table range, map to |kRelabelOOVIndex|. It is immutable once
+// built and shared among all rescorer copies.
+//
+// A table is either built in memory with Set(), or memory mapped from a binary
+// file written by WriteBinary() (see kenlm_vocab_relabel_main). The binary
+// file is bound to the fingerprints of the symbol table and of the kenlm model
+// it was generated from, so a stale file is rejected instead of silently
+// producing wrong word indexes.
+class RelabelTable {
+ public:
+  explicit RelabelTable(size_t size)
+      : table_(size, kRelabelOOVIndex), data_(table_.data()), size_(size) {}
+
+  lm::WordIndex operator[](LabelType label) const {
+    // Negative labels wrap around and fail the bound check as well.
+    return static_cast<size_t>(label) < size_ ? data_[label]
+                                              : kRelabelOOVIndex;
+  }
+
+  // Only valid for tables built in memory.
+  void Set(LabelType label, lm::WordIndex index) {
+    CHECK_LT(static_cast<size_t>(label), table_.size()) << label;
+    table_[label] = index;
+  }
+
+  size_t size() const { return size_; }
+
+  bool WriteBinary(const string& path,
+                   uint64 symbol_table_fingerprint,
+                   uint64 kenlm_fingerprint) const;
+
+  // Map a file written by WriteBinary(). Return nullptr if the file is
+  // missing, corrupted, of another version, or generated from a different
+  // symbol table or kenlm model.
+  static RelabelTable* LoadBinary(const string& path,
+                                  uint64 symbol_table_fingerprint,
+                                  uint64 kenlm_fingerprint);
+
+  // Fingerprint of the symbol table the labels come from.
+  static uint64 SymbolTableFingerprint(const fst::SymbolTable& symbols);
+
+  // Fingerprint of a kenlm model. Of a binary, it covers the header with the
+  // n-gram counts, and the vocabulary strings at the end of the file, which
+  // decide the relabel table, so that the n-grams are not read. Of an ARPA
+  // file, it covers the whole file.
+  static uint64 KenLMFingerprint(const string& model_path);
+
+ private:
+  RelabelTable() : data_(nullptr), size_(0) {}
+
+  std::vector<lm::WordIndex> table_;
+  util::scoped_memory mapped_;
+  const lm::WordIndex* data_;
+  size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(RelabelTable);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_RELABEL_TABLE_H_
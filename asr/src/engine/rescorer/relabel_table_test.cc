@@ -0,0 +1,102 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/relabel_table.h"
+
+#include <cstdio>
+
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "third_party/gtest/gtest.h"
+#include "third_party/kenlm/lm/model.hh"
+
+namespace mobvoi {
+
+namespace {
+const char kRelabelFile[] = "/tmp/relabel_table_test.bin";
+const char kModelFile[] = "/tmp/relabel_table_test_model.bin";
+const char kArpaFile[] = "/tmp/relabel_table_test_model.arpa";
+
+// Write a kenlm binary of a bigram model over |words| to kModelFile.
+void WriteBigramBinary(const vector<string>& words) {
+  string arpa = "\\data\\\nngram 1=" + std::to_string(words.size() + 3) +
+                "\nngram 2=1\n\n\\1-grams:\n"
+                "-1.0\t<unk>\n-1.0\t<s>\t-0.5\n-1.0\t</s>\n";
+  for (const string& word : words) {
+    arpa += "-1.0\t" + word + "\n";
+  }
+  arpa += "\n\\2-grams:\n-0.5\t<s> " + words[0] + "\n\n\\end\\\n";
+  ASSERT_TRUE(File::WriteStringToFile(arpa, kArpaFile));
+  lm::ngram::Config config;
+  config.write_mmap = kModelFile;
+  config.messages = nullptr;
+  lm::ngram::ProbingModel model(kArpaFile, config);
+  remove(kArpaFile);
+}
+}  // namespace
+
+TEST(RelabelTableTest, Lookup) {
+  RelabelTable table(4);
+  table.Set(1, 10);
+  table.Set(3, 30);
+  EXPECT_EQ(table[0], kRelabelOOVIndex);
+  EXPECT_EQ(table[1], 10u);
+  EXPECT_EQ(table[2], kRelabelOOVIndex);
+  EXPECT_EQ(table[3], 30u);
+  EXPECT_EQ(table[4], kRelabelOOVIndex);
+  EXPECT_EQ(table[-1], kRelabelOOVIndex);
+}
+
+TEST(RelabelTableTest, BinaryRoundTrip) {
+  RelabelTable table(1000);
+  for (int i = 1; i < 1000; i += 3) {
+    table.Set(i, i * 7);
+  }
+  ASSERT_TRUE(table.WriteBinary(kRelabelFile, 11, 22));
+
+  unique_ptr<RelabelTable> loaded(
+      RelabelTable::LoadBinary(kRelabelFile, 11, 22));
+  ASSERT_TRUE(loaded != nullptr);
+  EXPECT_EQ(loaded->size(), table.size());
+  for (int i = -1; i <= 1000; ++i) {
+    EXPECT_EQ((*loaded)[i], table[i]) << i;
+  }
+
+  // Fingerprint mismatches must be rejected.
+  EXPECT_TRUE(RelabelTable::LoadBinary(kRelabelFile, 12, 22) == nullptr);
+  EXPECT_TRUE(RelabelTable::LoadBinary(kRelabelFile, 11, 23) == nullptr);
+  EXPECT_TRUE(RelabelTable::LoadBinary("not_existed", 11, 22) == nullptr);
+
+  // So is a corrupted table.
+  string content;
+  File::ReadFileToString(kRelabelFile, &content);
+  content[content.size() - 1] ^= 0x01;
+  File::WriteStringToFile(content, kRelabelFile);
+  EXPECT_TRUE(RelabelTable::LoadBinary(kRelabelFile, 11, 22) == nullptr);
+  remove(kRelabelFile);
+}
+
+TEST(RelabelTableTest, KenLMFingerprint) {
+  // Larger than a chunk, changed in the middle only.
+  string content(3 << 20, 'a');
+  ASSERT_TRUE(File::WriteStringToFile(content, kModelFile));
+  uint64 fingerprint = RelabelTable::KenLMFingerprint(kModelFile);
+  EXPECT_EQ(fingerprint, RelabelTable::KenLMFingerprint(kModelFile));
+  content[content.size() / 2] = 'b';
+  ASSERT_TRUE(File::WriteStringToFile(content, kModelFile));
+  EXPECT_NE(fingerprint, RelabelTable::KenLMFingerprint(kModelFile));
+  remove(kModelFile);
+}
+
+TEST(RelabelTableTest, KenLMBinaryFingerprint) {
+  WriteBigramBinary({"a", "b", "c"});
+  uint64 fingerprint = RelabelTable::KenLMFingerprint(kModelFile);
+  EXPECT_NE(fingerprint, 0u);
+  WriteBigramBinary({"a", "b", "c"});
+  EXPECT_EQ(fingerprint, RelabelTable::KenLMFingerprint(kModelFile));
+  // Same counts and size, a different vocabulary.
+  WriteBigramBinary({"a", "b", "d"});
+  EXPECT_NE(fingerprint, RelabelTable::KenLMFingerprint(kModelFile));
+  remove(kModelFile);
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,150 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Benchmark the startup of RescorerModelManager: the time Init takes to load
+// a config of many models per --rescorer_init_load_threads. The config is
+// the one of kenlm_rescorer_test, secondpass, bugfix and newword, followed
+// by poi models up to --num_models, each a copy of one binary built from
+// --arpa, so it runs without production models. Use a large --arpa to see
+// disk bound loads. The page cache of the copies is dropped before every
+// run when --drop_cache is set, which approximates a cold start.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "engine/rescorer/rescorer_model_manager.h"
+#include "fst/symbol-table.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/kenlm/lm/model.hh"
+
+DEFINE_string(arpa, "third_party/kenlm/lm/test.arpa",
+              "ARPA file the benchmarked models are built from.");
+DEFINE_string(temp_prefix, "/tmp/rescorer_init_bench_",
+              "prefix of the built model files.");
+DEFINE_int32(num_models, 16, "number of models in the config.");
+DEFINE_string(threads, "1,2,4,8",
+              "comma separated numbers of load threads to benchmark.");
+DEFINE_bool(drop_cache, true,
+            "drop the page cache of the models before every run.");
+DEFINE_int32(repeats, 3, "runs per number of threads.");
+
+DECLARE_int32(rescorer_init_load_threads);
+
+namespace mobvoi {
+namespace {
+
+string BuildModel() {
+  string path = FLAGS_temp_prefix + "probing.bin";
+  lm::ngram::Config config;
+  config.messages = nullptr;
+  config.write_mmap = path.c_str();
+  config.write_method = lm::ngram::Config::WRITE_AFTER;
+  lm::ngram::ProbingModel model(FLAGS_arpa.c_str(), config);
+  return path;
+}
+
+// Copy the model once per config entry, so that no load shares the page
+// cache of another.
+vector<string> CopyModel(const string& path) {
+  vector<string> paths;
+  for (int i = 0; i < FLAGS_num_models; ++i) {
+    string copy = FLAGS_temp_prefix + std::to_string(i) + ".bin";
+    std::ifstream from(path, std::ios::binary);
+    std::ofstream to(copy, std::ios::binary);
+    CHECK(from && to) << copy;
+    to << from.rdbuf();
+    paths.push_back(copy);
+  }
+  return paths;
+}
+
+void DropCache(const vector<string>& paths) {
+  for (const auto& path : paths) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+}
+
+LMRescorerConfig CreateConfig(const vector<string>& paths) {
+  const char* kDefaultGroups[] = {"secondpass", "bugfix", "newword"};
+  LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  config.set_epoch(2);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    KenLMConfig* kenlm_config = config.add_kenlm_config();
+    if (i < 3) {
+      kenlm_config->set_name(kDefaultGroups[i]);
+      kenlm_config->set_group(kDefaultGroups[i]);
+    } else {
+      kenlm_config->set_name("poi" + std::to_string(i));
+      kenlm_config->set_group("poi");
+      kenlm_config->set_weight(0.0);
+    }
+    kenlm_config->set_model_path(paths[i]);
+  }
+  return config;
+}
+
+fst::SymbolTable* CreateSymbols() {
+  fst::SymbolTable* symbols = new fst::SymbolTable();
+  symbols->AddSymbol("<eps>", 0);
+  return symbols;
+}
+
+vector<int> ParseInts(const string& flag) {
+  vector<string> items;
+  SplitStringToVector(flag, ",", true, &items);
+  vector<int> values;
+  for (const auto& item : items) values.push_back(std::stoi(item));
+  return values;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Benchmark the model loading of RescorerModelManager::Init\n"
+      "Usage:  rescorer_init_bench [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  string model_path = mobvoi::BuildModel();
+  vector<string> paths = mobvoi::CopyModel(model_path);
+  std::remove(model_path.c_str());
+  mobvoi::LMRescorerConfig config = mobvoi::CreateConfig(paths);
+  unique_ptr<fst::SymbolTable> symbols(mobvoi::CreateSymbols());
+  std::cout << "models=" << paths.size() << std::endl;
+
+  for (int threads : mobvoi::ParseInts(FLAGS_threads)) {
+    FLAGS_rescorer_init_load_threads = threads;
+    double total_ms = 0;
+    for (int r = 0; r < FLAGS_repeats; ++r) {
+      if (FLAGS_drop_cache) mobvoi::DropCache(paths);
+      auto start = std::chrono::steady_clock::now();
+      mobvoi::RescorerModelManager model_manager("", false);
+      model_manager.Init(config, symbols.get());
+      total_ms += std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+    }
+    std::cout << "threads=" << threads
+              << "\tinit_ms=" << total_ms / FLAGS_repeats << std::endl;
+  }
+
+  for (const auto& path : paths) {
+    std::remove(path.c_str());
+  }
+  return 0;
+}
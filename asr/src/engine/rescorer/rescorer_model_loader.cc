@@ -0,0 +1,179 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescorer_model_loader.h"
+
+#include <cmath>
+
+#include "engine/rescorer/kenlm_rescorer.h"
+#include "engine/rescorer/rescorer_model_manager.h"
+#include "mobvoi/base/log.h"
+#include "third_party/kenlm/lm/state.hh"
+
+namespace mobvoi {
+
+namespace {
+
+int64 ElapsedMs(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - since).count();
+}
+
+// Check that a loaded item is usable before publishing it: it must have a
+// model and a relabel table, and the model must score a sentence end.
+bool ValidateModelItem(const RescorerModelItem& item) {
+  if (!item.is_valid || !item.model || !item.relabel_table)
+    return false;
+  const lm::base::Model& model = *item.model;
+  lm::ngram::State out;
+  float prob = model.BaseScore(model.BeginSentenceMemory(),
+                               model.BaseVocabulary().EndSentence(), &out);
+  return std::isfinite(prob) && prob <= 0;
+}
+
+}  // namespace
+
+const char* ModelLoadStateName(ModelLoadState state) {
+  switch (state) {
+    case ModelLoadState::kIdle:
+      return "idle";
+    case ModelLoadState::kQueued:
+      return "queued";
+    case ModelLoadState::kLoading:
+      return "loading";
+    case ModelLoadState::kPublished:
+      return "published";
+    case ModelLoadState::kFailed:
+      return "failed";
+    case ModelLoadState::kSuperseded:
+      return "superseded";
+  }
+  return "unknown";
+}
+
+RescorerModelLoader::RescorerModelLoader(RescorerModelManager* manager,
+                                         int num_threads)
+    : manager_(manager), num_loading_(0), stopped_(false) {
+  CHECK_GT(num_threads, 0);
+  for (int i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(&RescorerModelLoader::WorkerLoop, this);
+  }
+}
+
+RescorerModelLoader::~RescorerModelLoader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void RescorerModelLoader::Schedule(const string& model_name,
+                                   const KenLMConfig& dynamic_config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Task& task = tasks_[model_name];
+  task.config = dynamic_config;
+  ++task.sequence;
+  ++task.status.num_requests;
+  task.status.model_path = dynamic_config.model_path();
+  if (task.queued) {
+    // Coalesced into the queued update.
+    return;
+  }
+  task.queued = true;
+  if (!task.loading) {
+    // Otherwise the worker loading the model queues it once it finishes, so
+    // that a model is never loaded by two workers at the same time.
+    task.status.state = ModelLoadState::kQueued;
+    task.state_time = Clock::now();
+    queue_.push_back(model_name);
+    task_cv_.notify_one();
+  }
+}
+
+ModelLoadStatus RescorerModelLoader::GetStatus(
+    const string& model_name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = tasks_.find(model_name);
+  if (it == tasks_.end())
+    return ModelLoadStatus();
+  ModelLoadStatus status = it->second.status;
+  if (status.state == ModelLoadState::kQueued ||
+      status.state == ModelLoadState::kLoading) {
+    status.elapsed_ms = ElapsedMs(it->second.state_time);
+  }
+  return status;
+}
+
+void RescorerModelLoader::WaitIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_cv_.wait(lock, [this]() { return queue_.empty() && !num_loading_; });
+}
+
+void RescorerModelLoader::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    task_cv_.wait(lock, [this]() { return stopped_ || !queue_.empty(); });
+    if (stopped_)
+      return;
+    string model_name = queue_.front();
+    queue_.pop_front();
+    Task& task = tasks_[model_name];
+    task.queued = false;
+    task.loading = true;
+    task.status.state = ModelLoadState::kLoading;
+    task.state_time = Clock::now();
+    KenLMConfig config = task.config;
+    int64 sequence = task.sequence;
+    ++num_loading_;
+
+    lock.unlock();
+    Load(model_name, config, sequence);
+    lock.lock();
+
+    --num_loading_;
+    Task& done = tasks_[model_name];
+    done.loading = false;
+    if (done.queued) {
+      // Requested again while loading.
+      done.status.state = ModelLoadState::kQueued;
+      done.state_time = Clock::now();
+      queue_.push_back(model_name);
+      task_cv_.notify_one();
+    }
+    if (queue_.empty() && !num_loading_)
+      idle_cv_.notify_all();
+  }
+}
+
+void RescorerModelLoader::Load(const string& model_name,
+                               const KenLMConfig& config,
+                               int64 sequence) {
+  Clock::time_point start = Clock::now();
+  ModelLoadState state = ModelLoadState::kFailed;
+  auto request = manager_->MakeUpdateRequest(model_name);
+  if (request && request->Load(config) &&
+      ValidateModelItem(*request->rescorer_model_item())) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tasks_[model_name].sequence != sequence) {
+      state = ModelLoadState::kSuperseded;
+    } else if (request->Persist(config)) {
+      // Publish under |mutex_|, so that a newer request of the model can
+      // not be published before it.
+      request->Commit();
+      state = ModelLoadState::kPublished;
+    }
+  }
+  LOG(INFO) << "Background load of rescorer model " << model_name << " "
+            << config.model_path() << ": " << ModelLoadStateName(state)
+            << " in " << ElapsedMs(start) << " ms.";
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Task& task = tasks_[model_name];
+  task.status.state = state;
+  task.status.elapsed_ms = ElapsedMs(start);
+}
+
+}  // namespace mobvoi
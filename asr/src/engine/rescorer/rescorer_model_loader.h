@@ -0,0 +1,113 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RESCORER_MODEL_LOADER_H_
+#define ENGINE_RESCORER_RESCORER_MODEL_LOADER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "mobvoi/base/compat.h"
+
+namespace mobvoi {
+
+class RescorerModelManager;
+
+enum class ModelLoadState {
+  // No update was requested.
+  kIdle,
+  kQueued,
+  kLoading,
+  // The update is published, rescorers pick it up in SyncDynamicModels().
+  kPublished,
+  // The model failed to load or validate. Nothing is published or written
+  // to the dynamic config, so rescorers keep the previous model.
+  kFailed,
+  // A newer update of the same model was requested while this one was
+  // loading, so it was dropped instead of being published.
+  kSuperseded,
+};
+
+const char* ModelLoadStateName(ModelLoadState state);
+
+struct ModelLoadStatus {
+  ModelLoadState state = ModelLoadState::kIdle;
+  // Model path of the latest requested update.
+  string model_path;
+  // Number of update requests of the model, including coalesced ones.
+  int32 num_requests = 0;
+  // Time spent in the latest state change, in milliseconds: waiting in the
+  // queue for kQueued, loading so far for kLoading, and the whole load for
+  // the final states.
+  int64 elapsed_ms = 0;
+};
+
+// Loads dynamic model updates of a RescorerModelManager in background
+// threads, so that the caller of an update is not blocked by model loading
+// and relabel table building.
+//
+// Each update is loaded into a private item, validated, and then published
+// by RescorerModelManager::CommitUpdate() as a new model table, while
+// decoders keep using the old table until they sync. Updates of the same
+// model are coalesced: a queued update is replaced by a newer one, and a
+// loading update is superseded by a newer one, which is loaded next. At most
+// |num_threads| models are loaded at the same time, which bounds the I/O of
+// populating them.
+class RescorerModelLoader {
+ public:
+  RescorerModelLoader(RescorerModelManager* manager, int num_threads);
+  ~RescorerModelLoader();
+
+  // Queue an update of |model_name| with |dynamic_config|, see
+  // RescorerModelManager::UpdateModel().
+  void Schedule(const string& model_name, const KenLMConfig& dynamic_config);
+
+  ModelLoadStatus GetStatus(const string& model_name) const;
+
+  // Block until all scheduled updates are published or dropped.
+  void WaitIdle();
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Task {
+    ModelLoadStatus status;
+    // Config of the queued or loading update.
+    KenLMConfig config;
+    // Bumped by every request, a load only publishes if it is still the
+    // latest one when it finishes.
+    int64 sequence = 0;
+    bool queued = false;
+    bool loading = false;
+    Clock::time_point state_time;
+  };
+
+  void WorkerLoop();
+  void Load(const string& model_name, const KenLMConfig& config,
+            int64 sequence);
+
+  RescorerModelManager* manager_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable task_cv_;
+  std::condition_variable idle_cv_;
+  // Names of queued models, each at most once.
+  std::deque<string> queue_;
+  map<string, Task> tasks_;
+  int num_loading_;
+  bool stopped_;
+
+  vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(RescorerModelLoader);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_RESCORER_MODEL_LOADER_H_
@@ -3,19 +3,58 @@
 
 #include "engine/rescorer/rescorer_model_manager.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <thread>
 #include <vector>
 #include <map>
 
 #include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescorer_model_loader.h"
+#include "engine/rescorer/rescorer_stats.h"
 #include "mobvoi/base/file.h"
 #include "mobvoi/base/file/proto_util.h"
 #include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
 #include "third_party/openfst/include/fst/types.h"
 #include "third_party/kenlm/lm/model.hh"
+#include "third_party/kenlm/util/exception.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/usage.hh"
+
+DEFINE_int32(rescorer_model_loader_threads, 1,
+             "number of threads loading rescorer models updated by "
+             "UpdateModelAsync().");
+DEFINE_int32(rescorer_on_demand_memory_mb, 2048,
+             "memory budget of the resident rescorer models configured with "
+             "load_on_demand, in MB.");
+DEFINE_bool(rescorer_use_fused_model, false,
+            "query the fused model of LMRescorerConfig.fused_model instead "
+            "of the models it is built from. It is normalized, so it only "
+            "approximates their weighted sum.");
+DEFINE_bool(rescorer_probe_query_latency, false,
+            "time a few queries of every loaded rescorer model and log the "
+            "latency. It faults in pages of lazily loaded models.");
+DEFINE_int32(rescorer_init_load_threads, 4,
+             "number of threads loading the rescorer models at init.");
+DEFINE_int32(rescorer_init_large_model_mb, 256,
+             "rescorer models of at least this size, in MB, are large ones "
+             "for --rescorer_init_large_loads.");
+DEFINE_int32(rescorer_init_large_loads, 1,
+             "number of large rescorer models read at the same time at "
+             "init, so that they do not compete for the disk.");
 
 namespace {
 
 const char kDynamicConfigFileName[] = "config.proto";
+const char kOverlayFileName[] = "overlay.bin";
 
 const char kRescorerBaseModelName[] = "secondpass";
 const char kRescorerBaseModelGroup[] = "secondpass";
@@ -31,6 +70,77 @@ const char kRescorerPoiModelGroup[] = "poi";
 
 const unordered_set<string> kGroupsSupportingDynamicConfig = {
     kRescorerBugfixModelGroup, kRescorerNewWordModelGroup};
+
+// Source of RescorerModelItem::generation, shared by all managers so that
+// generations are unique in the process.
+std::atomic<uint32> next_model_generation(1);
+
+// Number of queries timed after loading a model.
+const int kLatencyProbeQueries = 256;
+
+// Keeps the probe queries from being optimized away.
+volatile float probe_score_sink;
+
+lm::ngram::Config MakeLoadConfig(const mobvoi::KenLMConfig& config) {
+  lm::ngram::Config load_config;
+  switch (config.load_method()) {
+    case mobvoi::KenLMConfig::LAZY:
+      load_config.load_method = util::LAZY;
+      break;
+    case mobvoi::KenLMConfig::POPULATE_OR_LAZY:
+      load_config.load_method = util::POPULATE_OR_LAZY;
+      break;
+    case mobvoi::KenLMConfig::POPULATE_OR_READ:
+      load_config.load_method = util::POPULATE_OR_READ;
+      break;
+    case mobvoi::KenLMConfig::READ:
+      load_config.load_method = util::READ;
+      break;
+    case mobvoi::KenLMConfig::PARALLEL_READ:
+      load_config.load_method = util::PARALLEL_READ;
+      break;
+  }
+  if (config.huge_pages() && load_config.load_method != util::READ &&
+      load_config.load_method != util::PARALLEL_READ) {
+    // Only the anonymous memory of READ is backed by huge pages.
+    load_config.load_method = util::READ;
+  }
+  load_config.lock_memory = config.lock_memory();
+  load_config.warm_up = config.warm_up();
+  return load_config;
+}
+
+// Average latency of scoring a word after <s>, in microseconds. Words are
+// spread over the symbol table, so that a lazily loaded model shows its page
+// faults.
+double ProbeQueryLatencyUs(const lm::base::Model& model,
+                           const mobvoi::RelabelTable& relabel_table) {
+  lm::ngram::State out;
+  float sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kLatencyProbeQueries; ++i) {
+    size_t label = relabel_table.size()
+                       ? static_cast<uint64>(i) * 2654435761ULL %
+                             relabel_table.size()
+                       : 0;
+    sum += model.BaseScore(model.BeginSentenceMemory(), relabel_table[label],
+                           &out);
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  probe_score_sink = sum;
+  return elapsed / 1000.0 / kLatencyProbeQueries;
+}
+
+uint64 ModelFileSize(const string& path) {
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    uint64 size = util::SizeFile(fd.get());
+    return size == util::kBadSize ? 0 : size;
+  } catch (const util::Exception& e) {
+    return 0;
+  }
+}
 }  // namespace
 
 namespace mobvoi {
@@ -49,6 +159,10 @@ RescorerModelManager::UpdateRequest::UpdateRequest(
 RescorerModelManager::UpdateRequest::~UpdateRequest() {}
 
 bool RescorerModelManager::UpdateRequest::DoUpdate(const KenLMConfig& config) {
+  return Persist(config) && Load(config);
+}
+
+bool RescorerModelManager::UpdateRequest::Persist(const KenLMConfig& config) {
   VLOG(1) << __FUNCTION__ << " model name: " << model_name_ << " write to "
           << dynamic_config_path_;
   if (!WriteProtoToFile(dynamic_config_path_, config)) {
@@ -56,7 +170,10 @@ bool RescorerModelManager::UpdateRequest::DoUpdate(const KenLMConfig& config) {
                << dynamic_config_path_;
     return false;
   }
+  return true;
+}
 
+bool RescorerModelManager::UpdateRequest::Load(const KenLMConfig& config) {
   merged_config_.MergeFrom(config);
   manager_->UpdateModelItem(merged_config_, item_.get());
   if (!item_->is_valid) {
@@ -73,6 +190,7 @@ RescorerModelManager::RescorerModelManager(const string& recognizer_model_dir,
                                            bool enable_dynamic_config)
     : model_base_dir_(recognizer_model_dir),
       word_symbols_(nullptr),
+      symbol_table_fingerprint_(0),
       dynamic_config_enabled_(enable_dynamic_config) {}
 
 void RescorerModelManager::Init(const LMRescorerConfig& config,
@@ -83,15 +201,39 @@ void RescorerModelManager::Init(const LMRescorerConfig& config,
   homophone_path_ = config.homophone_path();
   function_config_ = config.function_config();
   word_symbols_ = word_symbols;
+  symbol_table_fingerprint_ =
+      RelabelTable::SymbolTableFingerprint(*word_symbols_);
 
   if (config.epoch() == 1) {
     ParseLMRescorerConfigV1(config);
   } else {
     ParseLMRescorerConfig(config);
   }
+
+  shared_ptr<RescorerModelTable> table(new RescorerModelTable());
+  for (auto it = init_models_.begin(); it != init_models_.end(); ++it) {
+    table->models.push_back(it->second);
+  }
+  table->BuildIndexes();
+  table->residency = residency_;
+  if (config.has_fused_model()) {
+    if (FLAGS_rescorer_use_fused_model) {
+      LoadFusedModel(config.fused_model(), table.get());
+    } else {
+      LOG(INFO) << "Ignore fused model "
+                << config.fused_model().model().model_path()
+                << ", --rescorer_use_fused_model is not set.";
+    }
+  }
+  init_model_table_ = table;
+  std::lock_guard<std::mutex> lock(model_table_mutex_);
+  model_table_ = init_model_table_;
 }
 
-RescorerModelManager::~RescorerModelManager() {}
+RescorerModelManager::~RescorerModelManager() {
+  // Stop loading before the models are destroyed.
+  loader_.reset();
+}
 
 void RescorerModelManager::ParseLMRescorerConfigV1(
     const LMRescorerConfig& config) {
@@ -127,10 +269,25 @@ void RescorerModelManager::ParseLMRescorerConfigV1(
 
 void RescorerModelManager::ParseLMRescorerConfig(
     const LMRescorerConfig& config) {
+  vector<RescorerModelItem> items(config.kenlm_config_size());
+  // Models finish loading in any order, so their stats slots are registered
+  // in config order first, as loading them one by one does.
+  for (int i = 0; i < config.kenlm_config_size(); ++i) {
+    RescorerStats::ModelSlot(config.kenlm_config(i).name());
+  }
+  vector<int> loaded;
+  for (int i = 0; i < config.kenlm_config_size(); ++i) {
+    if (config.kenlm_config(i).load_on_demand()) {
+      AddOnDemandModelItem(config.kenlm_config(i), &items[i]);
+    } else {
+      loaded.push_back(i);
+    }
+  }
+  LoadModelItems(config, loaded, &items);
+
   for (int i = 0; i < config.kenlm_config_size(); ++i) {
     const KenLMConfig& kenlm_config = config.kenlm_config(i);
-    RescorerModelItem item;
-    LoadModelItem(kenlm_config, &item);
+    const RescorerModelItem& item = items[i];
     VLOG(1) << __FUNCTION__ << " name = " << item.name
             << ", group = " << item.group
             << ", ngram_order = " << item.ngram_order
@@ -138,7 +295,7 @@ void RescorerModelManager::ParseLMRescorerConfig(
 
     init_models_.emplace(item.name, item);
 
-    if (dynamic_config_enabled_ &&
+    if (dynamic_config_enabled_ && !item.on_demand &&
         (kGroupsSupportingDynamicConfig.find(item.group) !=
          kGroupsSupportingDynamicConfig.end())) {
       supporting_dynamic_models_.emplace(item.name, kenlm_config);
@@ -146,8 +303,166 @@ void RescorerModelManager::ParseLMRescorerConfig(
   }
 }
 
+void RescorerModelManager::LoadModelItems(const LMRescorerConfig& config,
+                                          const vector<int>& indexes,
+                                          vector<RescorerModelItem>* items) {
+  // Large models are read by at most --rescorer_init_large_loads threads,
+  // largest first, while the other threads load the small ones.
+  const uint64 large_size =
+      static_cast<uint64>(FLAGS_rescorer_init_large_model_mb) << 20;
+  vector<pair<uint64, int>> sized;
+  for (int index : indexes) {
+    sized.emplace_back(ModelFileSize(config.kenlm_config(index).model_path()),
+                       index);
+  }
+  std::stable_sort(sized.begin(), sized.end(),
+                   [](const pair<uint64, int>& left,
+                      const pair<uint64, int>& right) {
+                     return left.first > right.first;
+                   });
+  std::deque<int> large, small;
+  for (const auto& model : sized) {
+    (model.first >= large_size ? large : small).push_back(model.second);
+  }
+
+  const int num_threads = std::max(
+      1, std::min<int>(FLAGS_rescorer_init_load_threads, indexes.size()));
+  const int max_large_loads = std::max(1, FLAGS_rescorer_init_large_loads);
+  std::mutex mutex;
+  std::condition_variable large_done;
+  int large_loading = 0;
+  vector<string> errors(items->size());
+  auto load = [&]() {
+    while (true) {
+      int index;
+      bool is_large;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        large_done.wait(lock, [&]() {
+          return !small.empty() || large.empty() ||
+                 large_loading < max_large_loads;
+        });
+        is_large = !large.empty() && large_loading < max_large_loads;
+        if (is_large) {
+          index = large.front();
+          large.pop_front();
+          ++large_loading;
+        } else if (!small.empty()) {
+          index = small.front();
+          small.pop_front();
+        } else {
+          return;
+        }
+      }
+      const KenLMConfig& kenlm_config = config.kenlm_config(index);
+      RescorerModelItem* item = &(*items)[index];
+      try {
+        LoadModelItem(kenlm_config, item, num_threads > 1);
+        if (!item->is_valid) {
+          errors[index] = File::Exists(item->model_path)
+                              ? "no relabel table"
+                              : "model file does not exist";
+        }
+      } catch (const util::Exception& e) {
+        item->is_valid = false;
+        errors[index] = e.what();
+      }
+      if (is_large) {
+        std::lock_guard<std::mutex> lock(mutex);
+        --large_loading;
+        large_done.notify_all();
+      }
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) threads.emplace_back(load);
+  load();
+  for (auto& thread : threads) thread.join();
+  LOG(INFO) << "Loaded " << indexes.size() << " rescorer models with "
+            << num_threads << " threads in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " ms.";
+
+  for (int index : indexes) {
+    RescorerModelItem& item = (*items)[index];
+    if (!errors[index].empty()) {
+      LOG(WARNING) << "Failed to load rescorer model "
+                   << config.kenlm_config(index).name() << " from "
+                   << item.model_path << ": " << errors[index];
+    }
+    // Loads finish in any order, so generations are given in config order,
+    // as loading the models one by one does.
+    item.generation = next_model_generation++;
+  }
+}
+
+void RescorerModelManager::AddOnDemandModelItem(const KenLMConfig& config,
+                                                RescorerModelItem* item) {
+  if (!residency_) {
+    residency_.reset(new RescorerModelResidency(
+        static_cast<size_t>(FLAGS_rescorer_on_demand_memory_mb) << 20,
+        [this](const KenLMConfig& config, RescorerModelItem* item) {
+          UpdateModelItem(config, item);
+        }));
+  }
+  residency_->Register(config);
+  item->name = config.name();
+  item->stats_slot = RescorerStats::ModelSlot(item->name);
+  item->group = config.group();
+  item->weight = config.weight();
+  item->ngram_order = config.ngram_order();
+  item->model_path = config.model_path();
+  item->on_demand = true;
+}
+
+void RescorerModelManager::LoadFusedModel(const FusedKenLMConfig& config,
+                                          RescorerModelTable* table) {
+  // The fused model is only valid for the models and weights it was built
+  // with. Dynamic configs are checked as well, since they override the
+  // static ones at init.
+  vector<pair<int32, uint32>> components;
+  for (const auto& component : config.component()) {
+    auto it = table->name2id.find(component.name());
+    if (it == table->name2id.end()) {
+      LOG(WARNING) << "Ignore fused model " << config.model().model_path()
+                   << ", model " << component.name() << " is not configured.";
+      return;
+    }
+    const RescorerModelItem& item = table->models[it->second];
+    if (item.model_path != component.model_path() ||
+        std::fabs(item.weight - component.weight()) >
+            std::numeric_limits<float>::epsilon() ||
+        !item.is_valid || item.on_demand) {
+      LOG(WARNING) << "Ignore fused model " << config.model().model_path()
+                   << ", model " << component.name() << " is changed since "
+                   << "the fused model was built.";
+      return;
+    }
+    components.emplace_back(it->second, item.generation);
+  }
+
+  shared_ptr<RescorerModelItem> fused(new RescorerModelItem());
+  UpdateModelItem(config.model(), fused.get());
+  if (!fused->is_valid) {
+    LOG(WARNING) << "Failed to load fused model "
+                 << config.model().model_path();
+    return;
+  }
+  // Queried as the base model, with no other model.
+  fused->group = kRescorerBaseModelGroup;
+  fused->weight = 1.0f;
+  table->fused = fused;
+  table->fused_components = components;
+  LOG(INFO) << "Loaded fused model " << fused->model_path << " of "
+            << components.size() << " models.";
+}
+
 void RescorerModelManager::LoadModelItem(const KenLMConfig& static_config,
-                                         RescorerModelItem* item) {
+                                         RescorerModelItem* item,
+                                         bool concurrent) {
   KenLMConfig merged_config(static_config);
   KenLMConfig dynamic_config;
   string dynamic_config_path = File::JoinPath(
@@ -158,18 +473,36 @@ void RescorerModelManager::LoadModelItem(const KenLMConfig& static_config,
     // Dynamic config override static config.
     merged_config.MergeFrom(dynamic_config);
   }
-  UpdateModelItem(merged_config, item);
+  UpdateModelItem(merged_config, item, concurrent);
+
+  string overlay_path = File::JoinPath(
+      model_base_dir_,
+      File::JoinPath(static_config.name(), kOverlayFileName));
+  if (dynamic_config_enabled_ && File::Exists(overlay_path)) {
+    item->overlay.reset(
+        OverlayNgramModel::Load(overlay_path, symbol_table_fingerprint_));
+    if (item->overlay) {
+      // Models are loaded concurrently at init.
+      std::lock_guard<std::mutex> lock(update_mutex_);
+      overlays_[item->name] = item->overlay;
+      LOG(INFO) << "Loaded " << item->overlay->ngrams().size()
+                << " overlay n-grams of " << item->name;
+    }
+  }
 }
 
 void RescorerModelManager::UpdateModelItem(const KenLMConfig& config,
-                                           RescorerModelItem* item) {
+                                           RescorerModelItem* item,
+                                           bool concurrent) {
   item->name = config.name();
+  item->stats_slot = RescorerStats::ModelSlot(item->name);
   item->group = config.group();
   item->weight = config.weight();
   item->ngram_order = config.ngram_order();
+  item->generation = next_model_generation++;
   if (item->model_path == config.model_path()) {
     // Model file is not changed, so we can ignore the expensive operations.
-    // |is_valid| state also keeps unchanged.
+    // |is_valid| state also keeps unchanged, and so does the load policy.
     return;
   }
   item->model_path = config.model_path();
@@ -180,19 +513,60 @@ void RescorerModelManager::UpdateModelItem(const KenLMConfig& config,
 
   VLOG(1) << "Load model: " << item->name
           << " begin, model_path = " << item->model_path;
+  uint64 rss_before = util::RSSCurrent();
+  auto start = std::chrono::steady_clock::now();
   item->model.reset(lm::ngram::LoadVirtual(
-      item->model_path.c_str(), lm::ngram::Config(), item->model_type));
+      item->model_path.c_str(), MakeLoadConfig(config), item->model_type));
+  auto load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  uint64 rss_after = util::RSSCurrent();
   VLOG(1) << "Load model: " << item->name << " done.";
 
   VLOG(1) << "Generate relabel mapping for " << item->name << " begin.";
-  item->relabel_pair.reset(
-      CreateRelabelMapping(item->model_type, item->model.get()));
+  item->relabel_table.reset();
+  if (!config.relabel_file_path().empty()) {
+    item->relabel_table.reset(RelabelTable::LoadBinary(
+        config.relabel_file_path(), symbol_table_fingerprint_,
+        RelabelTable::KenLMFingerprint(item->model_path)));
+    if (!item->relabel_table) {
+      LOG(WARNING) << "Ignore relabel file " << config.relabel_file_path()
+                   << " of " << item->name
+                   << ", generate the mapping from symbol table instead.";
+    }
+  }
+  if (!item->relabel_table) {
+    item->relabel_table.reset(
+        CreateRelabelMapping(item->model_type, item->model.get()));
+  }
   VLOG(1) << "Generate relabel mapping for " << item->name << " done.";
 
-  item->is_valid = (item->model.get() && item->relabel_pair.get());
+  item->is_valid = (item->model.get() && item->relabel_table.get());
+  if (item->is_valid) {
+    // The RSS of the process and the query latency also measure the other
+    // models loading meanwhile.
+    string measures;
+    if (!concurrent) {
+      measures = ", rss growth = " +
+                 std::to_string((static_cast<int64>(rss_after) -
+                                 static_cast<int64>(rss_before)) / 1024) +
+                 " KB";
+      if (FLAGS_rescorer_probe_query_latency) {
+        measures += ", query latency = " +
+                    std::to_string(ProbeQueryLatencyUs(
+                        *item->model, *item->relabel_table)) +
+                    " us";
+      }
+    }
+    LOG(INFO) << "Loaded model: " << item->name << ", load_method = "
+              << KenLMConfig::LoadMethod_Name(config.load_method())
+              << ", huge_pages = " << config.huge_pages()
+              << ", lock_memory = " << config.lock_memory()
+              << ", warm_up = " << config.warm_up() << ", load time = "
+              << load_ms << " ms" << measures << ".";
+  }
 }
 
-unordered_map<LabelType, LabelType>* RescorerModelManager::CreateRelabelMapping(
+RelabelTable* RescorerModelManager::CreateRelabelMapping(
     const lm::ngram::ModelType model_type,
     const lm::base::Model* model) {
   switch (model_type) {
@@ -221,24 +595,24 @@ unordered_map<LabelType, LabelType>* RescorerModelManager::CreateRelabelMapping(
 }
 
 template <class Model>
-unordered_map<LabelType, LabelType>* RescorerModelManager::RelabelMappingHelper(
-    const Model* model) {
-  auto relabel_pair = new unordered_map<LabelType, LabelType>();
+RelabelTable* RescorerModelManager::RelabelMappingHelper(const Model* model) {
+  auto relabel_table = new RelabelTable(word_symbols_->AvailableKey());
   fst::SymbolTableIterator iref(*word_symbols_);
   for (iref.Reset(); !iref.Done(); iref.Next()) {
-    relabel_pair->emplace(
-        iref.Value(),
-        static_cast<LabelType>(model->GetVocabulary().Index(iref.Symbol())));
+    relabel_table->Set(iref.Value(),
+                       model->GetVocabulary().Index(iref.Symbol()));
   }
-  return relabel_pair;
+  return relabel_table;
 }
 
-vector<RescorerModelItem> RescorerModelManager::GetInitModelItems() const {
-  vector<RescorerModelItem> models;
-  for (auto it = init_models_.begin(); it != init_models_.end(); ++it) {
-    models.push_back(it->second);
-  }
-  return models;
+shared_ptr<const RescorerModelTable> RescorerModelManager::GetModelTable()
+    const {
+  std::lock_guard<std::mutex> lock(model_table_mutex_);
+  return model_table_;
+}
+
+ModelResidencyStats RescorerModelManager::GetModelResidencyStats() const {
+  return residency_ ? residency_->GetStats() : ModelResidencyStats();
 }
 
 const map<string, shared_ptr<RescorerModelItem>>&
@@ -259,6 +633,42 @@ bool RescorerModelManager::UpdateModel(const string& model_name,
   return true;
 }
 
+bool RescorerModelManager::UpdateModelAsync(
+    const string& model_name, const KenLMConfig& dynamic_config) {
+  if (supporting_dynamic_models_.find(model_name) ==
+      supporting_dynamic_models_.end()) {
+    LOG(WARNING) << "Cannot find " << model_name
+                 << " in dynamic model supporting list, is it a wrong name?";
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(loader_mutex_);
+  if (!loader_) {
+    loader_.reset(
+        new RescorerModelLoader(this, FLAGS_rescorer_model_loader_threads));
+  }
+  loader_->Schedule(model_name, dynamic_config);
+  return true;
+}
+
+ModelLoadStatus RescorerModelManager::GetModelLoadStatus(
+    const string& model_name) const {
+  std::lock_guard<std::mutex> lock(loader_mutex_);
+  return loader_ ? loader_->GetStatus(model_name) : ModelLoadStatus();
+}
+
+void RescorerModelManager::WaitModelLoads() {
+  // The loader lives as long as the manager once created, so it is waited on
+  // without holding |loader_mutex_|, which would block the status queries
+  // and the schedules of other threads until all loads finish.
+  RescorerModelLoader* loader = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(loader_mutex_);
+    loader = loader_.get();
+  }
+  if (loader)
+    loader->WaitIdle();
+}
+
 shared_ptr<RescorerModelManager::UpdateRequest>
 RescorerModelManager::MakeUpdateRequest(const string& model_name) {
   shared_ptr<UpdateRequest> request;
@@ -270,6 +680,7 @@ RescorerModelManager::MakeUpdateRequest(const string& model_name) {
   }
 
   shared_ptr<RescorerModelItem> item;
+  std::lock_guard<std::mutex> lock(update_mutex_);
   auto it = dynamic_models_.find(model_name);
   if (it == dynamic_models_.end()) {
     // |dynamic_models_| is lazily loaded because usually most of the models
@@ -288,13 +699,141 @@ RescorerModelManager::MakeUpdateRequest(const string& model_name) {
 
 void RescorerModelManager::CommitUpdate(
     RescorerModelManager::UpdateRequest* update_request) {
-  auto it = dynamic_models_.find(update_request->model_name());
-  if (it == dynamic_models_.end()) {
-    dynamic_models_.emplace(update_request->model_name(),
-                            update_request->rescorer_model_item());
-  } else {
-    it->second = update_request->rescorer_model_item();
+  std::lock_guard<std::mutex> update_lock(update_mutex_);
+  const string& model_name = update_request->model_name();
+  shared_ptr<RescorerModelItem> item = update_request->rescorer_model_item();
+  // The overlay may have changed while the request was loading the model.
+  auto overlay = overlays_.find(model_name);
+  if (overlay != overlays_.end())
+    item->overlay = overlay->second;
+  dynamic_models_[model_name] = item;
+  PublishModelItem(model_name, *item);
+}
+
+void RescorerModelManager::PublishModelItem(const string& model_name,
+                                            const RescorerModelItem& item) {
+  // Publish a new snapshot with the updated model, the current one may be in
+  // use by rescorers.
+  shared_ptr<const RescorerModelTable> current = GetModelTable();
+  auto index = current->name2id.find(model_name);
+  if (index == current->name2id.end()) {
+    LOG(WARNING) << "Cannot find " << model_name << " in the model table.";
+    return;
+  }
+  shared_ptr<RescorerModelTable> table(new RescorerModelTable(*current));
+  table->models[index->second] = item;
+  table->BuildIndexes();
+  std::lock_guard<std::mutex> lock(model_table_mutex_);
+  model_table_ = table;
+}
+
+bool RescorerModelManager::ParseOverlayNgram(const string& line,
+                                             OverlayNgram* ngram) const {
+  vector<string> fields;
+  SplitStringToVector(line, "\t", true, &fields);
+  if (fields.size() != 2 && fields.size() != 3)
+    return false;
+  char* end = nullptr;
+  ngram->log10_prob = strtof(fields[0].c_str(), &end);
+  if (*end != '\0')
+    return false;
+  ngram->log10_backoff = 0.0f;
+  if (fields.size() == 3) {
+    ngram->log10_backoff = strtof(fields[2].c_str(), &end);
+    if (*end != '\0')
+      return false;
+  }
+  vector<string> words;
+  SplitStringToVector(fields[1], " ", true, &words);
+  ngram->words.clear();
+  for (const auto& word : words) {
+    if (word == "<s>") {
+      ngram->words.push_back(dcd::kSentenceBoundary);
+    } else if (word == "</s>") {
+      ngram->words.push_back(dcd::kEndOfSentence);
+    } else {
+      int64 label = word_symbols_->Find(word);
+      if (label <= 0) {
+        LOG(WARNING) << "Overlay word " << word
+                     << " is not in the symbol table.";
+        return false;
+      }
+      ngram->words.push_back(label);
+    }
+  }
+  return true;
+}
+
+bool RescorerModelManager::AddOverlayNgrams(const string& model_name,
+                                            const vector<string>& arpa_lines) {
+  if (supporting_dynamic_models_.find(model_name) ==
+      supporting_dynamic_models_.end()) {
+    LOG(WARNING) << "Cannot find " << model_name
+                 << " in dynamic model supporting list, is it a wrong name?";
+    return false;
+  }
+  vector<OverlayNgram> ngrams(arpa_lines.size());
+  for (size_t i = 0; i < arpa_lines.size(); ++i) {
+    if (!ParseOverlayNgram(arpa_lines[i], &ngrams[i])) {
+      LOG(WARNING) << "Malformed overlay n-gram of " << model_name << ": "
+                   << arpa_lines[i];
+      return false;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  shared_ptr<const OverlayNgramModel>& current = overlays_[model_name];
+  shared_ptr<const OverlayNgramModel> overlay(
+      current ? current->Add(ngrams) : OverlayNgramModel().Add(ngrams));
+  if (!overlay || !CommitOverlay(model_name, overlay))
+    return false;
+  LOG(INFO) << "Added " << ngrams.size() << " overlay n-grams to "
+            << model_name << ", " << overlay->ngrams().size()
+            << " in total, in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now() - start).count()
+            << " us.";
+  return true;
+}
+
+bool RescorerModelManager::ClearOverlayNgrams(const string& model_name) {
+  if (supporting_dynamic_models_.find(model_name) ==
+      supporting_dynamic_models_.end()) {
+    LOG(WARNING) << "Cannot find " << model_name
+                 << " in dynamic model supporting list, is it a wrong name?";
+    return false;
   }
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  return CommitOverlay(model_name, nullptr);
+}
+
+bool RescorerModelManager::CommitOverlay(
+    const string& model_name, shared_ptr<const OverlayNgramModel> overlay) {
+  if (dynamic_config_enabled_) {
+    const string overlay_path = File::JoinPath(
+        model_base_dir_, File::JoinPath(model_name, kOverlayFileName));
+    if (overlay) {
+      if (!overlay->Save(overlay_path, symbol_table_fingerprint_))
+        return false;
+    } else if (File::Exists(overlay_path) &&
+               std::remove(overlay_path.c_str()) != 0) {
+      LOG(ERROR) << "Failed to remove overlay " << overlay_path;
+      return false;
+    }
+  }
+  overlays_[model_name] = overlay;
+
+  auto it = dynamic_models_.find(model_name);
+  shared_ptr<RescorerModelItem> item(new RescorerModelItem(
+      it == dynamic_models_.end() ? init_models_[model_name] : *it->second));
+  item->overlay = overlay;
+  // Partitions the rescoring caches like a reload, so no stale score of the
+  // model is hit.
+  item->generation = next_model_generation++;
+  dynamic_models_[model_name] = item;
+  PublishModelItem(model_name, *item);
+  return true;
 }
 
 }  // namespace mobvoi
@@ -5,9 +5,11 @@
 #define ENGINE_RESCORER_RESCORER_MODEL_MANAGER_H_
 
 #include <memory>
+#include <mutex>
 
 #include "engine/rescorer/lm_rescorer_config.pb.h"
 #include "engine/rescorer/kenlm_rescorer.h"
+#include "engine/rescorer/rescorer_model_loader.h"
 
 namespace mobvoi {
 
@@ -21,7 +23,12 @@ class RescorerModelManager {
                   shared_ptr<RescorerModelItem> item);
     ~UpdateRequest();
 
+    // Persist() and then Load().
     bool DoUpdate(const KenLMConfig& config);
+    // Write |config| as the dynamic config of the model.
+    bool Persist(const KenLMConfig& config);
+    // Load the model of |config| into the private item of the request.
+    bool Load(const KenLMConfig& config);
     void Commit();
 
     shared_ptr<RescorerModelItem> rescorer_model_item() const { return item_; }
@@ -41,13 +48,43 @@ class RescorerModelManager {
 
   void Init(const LMRescorerConfig& config,
             const fst::SymbolTable* word_symbols);
-  vector<RescorerModelItem> GetInitModelItems() const;
+  // Snapshot of the models as loaded by Init().
+  shared_ptr<const RescorerModelTable> GetInitModelTable() const {
+    return init_model_table_;
+  }
+  // Latest snapshot of the models, with all committed updates. It is safe to
+  // call concurrently with CommitUpdate().
+  shared_ptr<const RescorerModelTable> GetModelTable() const;
   const map<string, shared_ptr<RescorerModelItem>>& GetDynamicModelItems()
       const;
+  // Load and eviction metrics of the on demand models.
+  ModelResidencyStats GetModelResidencyStats() const;
 
   // Update dynamic config.
   bool UpdateModel(const string& model_name, const KenLMConfig& dynamic_config);
 
+  // Like UpdateModel(), but load the model in a background thread and return
+  // at once. The update is only persisted and committed if the model loads
+  // and validates, see RescorerModelLoader. Return false if the model does
+  // not support dynamic update.
+  bool UpdateModelAsync(const string& model_name,
+                        const KenLMConfig& dynamic_config);
+  ModelLoadStatus GetModelLoadStatus(const string& model_name) const;
+  // Block until all UpdateModelAsync() updates are committed or dropped.
+  void WaitModelLoads();
+
+  // Add n-grams to the overlay of the dynamic model |model_name| and commit
+  // them at once, without reloading the model, see OverlayNgramModel. Each of
+  // |arpa_lines| is an n-gram line of an ARPA file, "log10 prob<TAB>words" and
+  // an optional "<TAB>log10 backoff", of words in the symbol table. With
+  // dynamic config enabled, the overlay is saved next to the dynamic config
+  // and loaded again at init.
+  bool AddOverlayNgrams(const string& model_name,
+                        const vector<string>& arpa_lines);
+  // Drop the overlay of |model_name|, e.g. once the binary the model is
+  // updated to has its n-grams.
+  bool ClearOverlayNgrams(const string& model_name);
+
   // UpdateModel() is splitted to three-staged update because of
   // mutex optimization consideration.
   // Note that change will just take effect after re-init unless
@@ -68,21 +105,53 @@ class RescorerModelManager {
   void ParseLMRescorerConfigV1(const LMRescorerConfig& config);
   void ParseLMRescorerConfig(const LMRescorerConfig& config);
 
-  // Load real model according to config.
-  void LoadModelItem(const KenLMConfig& kenlm_config, RescorerModelItem* item);
-
-  void UpdateModelItem(const KenLMConfig& config, RescorerModelItem* item);
+  // Load real model according to config. |concurrent| tells that other models
+  // load at the same time, see UpdateModelItem().
+  void LoadModelItem(const KenLMConfig& kenlm_config, RescorerModelItem* item,
+                     bool concurrent);
+
+  // Load the models |indexes| of |config| into |items| concurrently, see
+  // --rescorer_init_load_threads. A model which fails to load is reported
+  // and left invalid. |items| are the same as if loaded one by one.
+  void LoadModelItems(const LMRescorerConfig& config,
+                      const vector<int>& indexes,
+                      vector<RescorerModelItem>* items);
+
+  // Load the fused model into |table| if it is built from the models of
+  // |table| as they are configured.
+  void LoadFusedModel(const FusedKenLMConfig& config,
+                      RescorerModelTable* table);
+
+  // Register an on demand model to |residency_|, with an unloaded item.
+  void AddOnDemandModelItem(const KenLMConfig& config,
+                            RescorerModelItem* item);
+
+  // Load |item| of |config| if its model file is changed. Unless
+  // |concurrent|, the RSS growth and the query latency of the model are
+  // logged, which other models loading at the same time would add to.
+  void UpdateModelItem(const KenLMConfig& config, RescorerModelItem* item,
+                       bool concurrent = false);
 
   void RealtimeUpdateModel(RescorerModelItem* item);
 
+  // Parse an n-gram line of an ARPA file into |ngram|.
+  bool ParseOverlayNgram(const string& line, OverlayNgram* ngram) const;
+  // Persist |overlay| as the overlay of |model_name|, which drops it if it is
+  // nullptr, and publish it. Must hold |update_mutex_|.
+  bool CommitOverlay(const string& model_name,
+                     shared_ptr<const OverlayNgramModel> overlay);
+  // Publish a new snapshot of the model table with |item| as |model_name|.
+  // Must hold |update_mutex_|.
+  void PublishModelItem(const string& model_name,
+                        const RescorerModelItem& item);
+
   // Base ASR model and rescore models do not share label index. Need to
   // compute mapping between kenlm binary vocabulary and base model symbol
   // table.
-  unordered_map<LabelType, LabelType>* CreateRelabelMapping(
-      const lm::ngram::ModelType model_type,
-      const lm::base::Model* model);
+  RelabelTable* CreateRelabelMapping(const lm::ngram::ModelType model_type,
+                                     const lm::base::Model* model);
   template <class Model>
-  unordered_map<LabelType, LabelType>* RelabelMappingHelper(const Model* model);
+  RelabelTable* RelabelMappingHelper(const Model* model);
 
   // Model base dir for dynamic model storage.
   const string model_base_dir_;
@@ -94,17 +163,45 @@ class RescorerModelManager {
   // Store model items for init parsing.
   map<string, RescorerModelItem> init_models_;
 
-  // Keep the latest changed dynamic models for rescorer copies to sync.
+  // Keep the latest changed dynamic models, on which the next update of the
+  // model is based.
   map<string, shared_ptr<RescorerModelItem>> dynamic_models_;
 
+  shared_ptr<const RescorerModelTable> init_model_table_;
+
+  // Latest snapshot for rescorer copies to sync. CommitUpdate() replaces it
+  // with a new snapshot rather than modifying it, so readers only hold
+  // |model_table_mutex_| to copy the pointer.
+  shared_ptr<const RescorerModelTable> model_table_;
+  mutable std::mutex model_table_mutex_;
+
+  // Loads the models configured with load_on_demand. It is shared with the
+  // model tables, so rescorers must not enable models after the manager is
+  // destroyed.
+  shared_ptr<RescorerModelResidency> residency_;
+
   // Supporting dynamic model update list: model name and static config.
   unordered_map<string, const KenLMConfig> supporting_dynamic_models_;
 
   // Base ASR model symbol table.
   const fst::SymbolTable* word_symbols_;
 
+  // Checked against precomputed relabel files, see RelabelTable.
+  uint64 symbol_table_fingerprint_;
+
   bool dynamic_config_enabled_;
 
+  // Overlays of the dynamic models, which updates of the models carry over.
+  map<string, shared_ptr<const OverlayNgramModel>> overlays_;
+
+  // Guards |dynamic_models_|, |overlays_| and the publishing of
+  // |model_table_| against concurrent updates.
+  std::mutex update_mutex_;
+
+  // Created by the first UpdateModelAsync().
+  unique_ptr<RescorerModelLoader> loader_;
+  mutable std::mutex loader_mutex_;
+
   DISALLOW_COPY_AND_ASSIGN(RescorerModelManager);
 };
 
@@ -0,0 +1,149 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescorer_model_residency.h"
+
+#include <chrono>
+
+#include "engine/rescorer/kenlm_rescorer.h"
+#include "mobvoi/base/log.h"
+#include "third_party/kenlm/util/exception.hh"
+#include "third_party/kenlm/util/file.hh"
+
+namespace mobvoi {
+
+namespace {
+
+int64 ElapsedMs(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - since).count();
+}
+
+// Memory taken by a loaded item: the model file, which kenlm maps or reads
+// as a whole, and the relabel table.
+size_t EstimateItemBytes(const RescorerModelItem& item) {
+  size_t bytes = 0;
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(item.model_path.c_str()));
+    uint64 file_size = util::SizeFile(fd.get());
+    if (file_size != util::kBadSize)
+      bytes += file_size;
+  } catch (const util::Exception& e) {
+    LOG(WARNING) << "Failed to get the size of " << item.model_path << ": "
+                 << e.what();
+  }
+  if (item.relabel_table)
+    bytes += item.relabel_table->size() * sizeof(lm::WordIndex);
+  return bytes;
+}
+
+}  // namespace
+
+RescorerModelResidency::RescorerModelResidency(size_t memory_budget,
+                                               const LoadFunction& load)
+    : memory_budget_(memory_budget), load_(load) {
+  stats_.memory_budget = memory_budget;
+}
+
+RescorerModelResidency::~RescorerModelResidency() {}
+
+void RescorerModelResidency::Register(const KenLMConfig& config) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  unique_ptr<Entry>& entry = entries_[config.name()];
+  CHECK(!entry) << "Duplicated on demand model " << config.name();
+  entry.reset(new Entry());
+  entry->config = config;
+}
+
+shared_ptr<const RescorerModelItem> RescorerModelResidency::Acquire(
+    const string& model_name) {
+  Entry* entry = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(model_name);
+    if (it == entries_.end())
+      return nullptr;
+    entry = it->second.get();
+    if (entry->item) {
+      ++stats_.hits;
+      lru_.splice(lru_.begin(), lru_, entry->lru_position);
+      return entry->item;
+    }
+  }
+
+  std::lock_guard<std::mutex> load_lock(entry->load_mutex);
+  {
+    // Loaded by another thread while waiting for |load_mutex|.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entry->item) {
+      ++stats_.hits;
+      lru_.splice(lru_.begin(), lru_, entry->lru_position);
+      return entry->item;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  shared_ptr<RescorerModelItem> item(new RescorerModelItem());
+  load_(entry->config, item.get());
+  int64 load_ms = ElapsedMs(start);
+  if (!item->is_valid) {
+    LOG(WARNING) << "Failed to load on demand model " << model_name << " "
+                 << entry->config.model_path();
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.load_failures;
+    // Not kept resident, so that it is retried by the next enable.
+    return item;
+  }
+  size_t bytes = EstimateItemBytes(*item);
+  LOG(INFO) << "Loaded on demand model " << model_name << " of " << bytes
+            << " bytes in " << load_ms << " ms.";
+
+  vector<shared_ptr<const RescorerModelItem>> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.loads;
+    stats_.load_ms += load_ms;
+    entry->item = item;
+    entry->bytes = bytes;
+    lru_.push_front(entry);
+    entry->lru_position = lru_.begin();
+    ++stats_.resident_models;
+    stats_.resident_bytes += bytes;
+    EvictLocked(entry, &evicted);
+  }
+
+  if (!evicted.empty()) {
+    // Unload out of |mutex_|, unmapping a large model takes a while. Models
+    // still used by rescorers are unloaded when they are released instead.
+    start = std::chrono::steady_clock::now();
+    evicted.clear();
+    int64 evict_ms = ElapsedMs(start);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.evict_ms += evict_ms;
+  }
+  return item;
+}
+
+void RescorerModelResidency::EvictLocked(
+    const Entry* keep,
+    vector<shared_ptr<const RescorerModelItem>>* evicted) {
+  while (stats_.resident_bytes > memory_budget_ && !lru_.empty() &&
+         lru_.back() != keep) {
+    Entry* victim = lru_.back();
+    lru_.pop_back();
+    VLOG(1) << "Evict on demand model " << victim->config.name() << " of "
+            << victim->bytes << " bytes.";
+    evicted->push_back(victim->item);
+    victim->item.reset();
+    ++stats_.evictions;
+    --stats_.resident_models;
+    stats_.resident_bytes -= victim->bytes;
+    victim->bytes = 0;
+  }
+}
+
+ModelResidencyStats RescorerModelResidency::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,95 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RESCORER_MODEL_RESIDENCY_H_
+#define ENGINE_RESCORER_RESCORER_MODEL_RESIDENCY_H_
+
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "mobvoi/base/compat.h"
+
+namespace mobvoi {
+
+struct RescorerModelItem;
+
+struct ModelResidencyStats {
+  int64 hits = 0;
+  int64 loads = 0;
+  int64 load_failures = 0;
+  int64 evictions = 0;
+  // Accumulated latency of loading and evicting models.
+  int64 load_ms = 0;
+  int64 evict_ms = 0;
+  int32 resident_models = 0;
+  size_t resident_bytes = 0;
+  size_t memory_budget = 0;
+};
+
+// Keeps the models configured with KenLMConfig.load_on_demand, e.g. the per
+// city POI models, resident within a memory budget. A model is loaded the
+// first time a rescorer enables it, and the least recently enabled models
+// are evicted when the resident models exceed the budget.
+//
+// Rescorers hold a reference to the models they enabled, so an evicted model
+// is only unloaded once no rescorer uses it any more, and the memory budget
+// may be exceeded by the models in use. The model size is estimated from the
+// model file and its relabel table.
+//
+// It is thread-safe. A model is loaded by one thread, other threads enabling
+// it wait for the load, while enabling other models goes on.
+class RescorerModelResidency {
+ public:
+  // Load the model of |config| into an empty item.
+  typedef std::function<void(const KenLMConfig& config,
+                             RescorerModelItem* item)> LoadFunction;
+
+  RescorerModelResidency(size_t memory_budget, const LoadFunction& load);
+  ~RescorerModelResidency();
+
+  void Register(const KenLMConfig& config);
+
+  // Return the loaded model |model_name|, loading it if it is not resident.
+  // The returned item is invalid if the model failed to load, and nullptr is
+  // returned if the model is not registered.
+  shared_ptr<const RescorerModelItem> Acquire(const string& model_name);
+
+  ModelResidencyStats GetStats() const;
+
+ private:
+  struct Entry {
+    KenLMConfig config;
+    shared_ptr<const RescorerModelItem> item;
+    size_t bytes = 0;
+    // Position in |lru_| if resident.
+    std::list<Entry*>::iterator lru_position;
+    // Serializes the loads of the entry.
+    std::mutex load_mutex;
+  };
+
+  // Evict the least recently enabled models other than |keep| until the
+  // resident models fit in the budget, moving them to |evicted| to be
+  // released out of the lock. Must be called with |mutex_| held.
+  void EvictLocked(const Entry* keep,
+                   vector<shared_ptr<const RescorerModelItem>>* evicted);
+
+  const size_t memory_budget_;
+  const LoadFunction load_;
+
+  mutable std::mutex mutex_;
+  map<string, unique_ptr<Entry>> entries_;
+  // Resident entries, the most recently enabled first.
+  std::list<Entry*> lru_;
+  ModelResidencyStats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(RescorerModelResidency);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_RESCORER_MODEL_RESIDENCY_H_
@@ -0,0 +1,105 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescorer_model_residency.h"
+
+#include <cstdio>
+
+#include "engine/rescorer/kenlm_rescorer.h"
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+const size_t kModelBytes = 1000;
+
+// Write a fake model file of |kModelBytes|.
+string WriteModelFile(const string& name) {
+  string path = "/tmp/rescorer_model_residency_test_" + name;
+  FILE* file = fopen(path.c_str(), "wb");
+  CHECK(file != nullptr) << path;
+  string data(kModelBytes, 'x');
+  fwrite(data.data(), 1, data.size(), file);
+  fclose(file);
+  return path;
+}
+
+class RescorerModelResidencyTest : public ::testing::Test {
+ protected:
+  RescorerModelResidencyTest()
+      : residency_(2500, [this](const KenLMConfig& config,
+                                RescorerModelItem* item) {
+          ++num_loads_;
+          item->name = config.name();
+          item->model_path = config.model_path();
+          item->generation = num_loads_;
+          item->is_valid = (config.name() != "broken");
+        }),
+        num_loads_(0) {
+    for (const char* name : {"a", "b", "c", "broken"}) {
+      KenLMConfig config;
+      config.set_name(name);
+      config.set_model_path(WriteModelFile(name));
+      residency_.Register(config);
+    }
+  }
+
+  RescorerModelResidency residency_;
+  int num_loads_;
+};
+
+}  // namespace
+
+TEST_F(RescorerModelResidencyTest, LoadOnFirstAcquire) {
+  EXPECT_EQ(nullptr, residency_.Acquire("unknown"));
+  EXPECT_EQ(0, num_loads_);
+
+  auto a = residency_.Acquire("a");
+  ASSERT_NE(nullptr, a);
+  EXPECT_TRUE(a->is_valid);
+  EXPECT_EQ(1, num_loads_);
+  EXPECT_EQ(a, residency_.Acquire("a"));
+  EXPECT_EQ(1, num_loads_);
+
+  ModelResidencyStats stats = residency_.GetStats();
+  EXPECT_EQ(1, stats.loads);
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(1, stats.resident_models);
+  EXPECT_EQ(kModelBytes, stats.resident_bytes);
+}
+
+TEST_F(RescorerModelResidencyTest, EvictLeastRecentlyAcquired) {
+  residency_.Acquire("a");
+  auto b = residency_.Acquire("b");
+  residency_.Acquire("a");
+  // Over the budget of two models, "b" is the least recently acquired.
+  residency_.Acquire("c");
+
+  ModelResidencyStats stats = residency_.GetStats();
+  EXPECT_EQ(3, stats.loads);
+  EXPECT_EQ(1, stats.evictions);
+  EXPECT_EQ(2, stats.resident_models);
+  EXPECT_EQ(2 * kModelBytes, stats.resident_bytes);
+
+  // The evicted model stays usable by its holder, and is loaded again by the
+  // next acquire.
+  EXPECT_EQ("b", b->name);
+  auto reloaded = residency_.Acquire("b");
+  EXPECT_NE(b, reloaded);
+  EXPECT_NE(b->generation, reloaded->generation);
+  EXPECT_EQ(4, residency_.GetStats().loads);
+}
+
+TEST_F(RescorerModelResidencyTest, FailedLoadIsNotResident) {
+  auto broken = residency_.Acquire("broken");
+  ASSERT_NE(nullptr, broken);
+  EXPECT_FALSE(broken->is_valid);
+  residency_.Acquire("broken");
+  EXPECT_EQ(2, num_loads_);
+
+  ModelResidencyStats stats = residency_.GetStats();
+  EXPECT_EQ(2, stats.load_failures);
+  EXPECT_EQ(0, stats.resident_models);
+}
+
+}  // namespace mobvoi
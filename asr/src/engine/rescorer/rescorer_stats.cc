@@ -0,0 +1,147 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescorer_stats.h"
+
+#include <map>
+#include <set>
+
+#include "mobvoi/base/log.h"
+
+DEFINE_bool(rescorer_stats, false,
+            "count rescorer queries and cache lookups, see RescorerStats.");
+DEFINE_int32(rescorer_stats_sample_interval, 64,
+             "time one of every this many LM score queries of a thread when "
+             "--rescorer_stats is on.");
+
+namespace mobvoi {
+
+namespace {
+
+// Registry of the model slots and the thread blocks.
+struct StatsRegistry {
+  std::mutex mutex;
+  map<string, int> slots;
+  vector<string> names;
+  std::set<const void*> blocks;
+  // Counters of the exited threads, a Block behind a void pointer since it
+  // is private to RescorerStats.
+  void* retired = nullptr;
+};
+
+StatsRegistry* GetRegistry() {
+  // Leaked, threads may exit after static destruction.
+  static StatsRegistry* registry = new StatsRegistry();
+  return registry;
+}
+
+}  // namespace
+
+RescorerStats::Block::Block() {
+  for (auto& model : models) {
+    for (auto& value : model) value.store(0, std::memory_order_relaxed);
+  }
+  for (auto& value : counters) value.store(0, std::memory_order_relaxed);
+  for (auto& value : latency) value.store(0, std::memory_order_relaxed);
+}
+
+void RescorerStats::Block::AddTo(Block* total) const {
+  for (int i = 0; i < kMaxModels; ++i) {
+    for (int j = 0; j < kNumModelCounters; ++j) {
+      total->models[i][j].fetch_add(
+          models[i][j].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+  }
+  for (int i = 0; i < kNumCounters; ++i) {
+    total->counters[i].fetch_add(counters[i].load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+  }
+  for (int i = 0; i < kNumLatencyBuckets; ++i) {
+    total->latency[i].fetch_add(latency[i].load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+  }
+}
+
+RescorerStats::LocalHolder::LocalHolder() {
+  StatsRegistry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  registry->blocks.insert(&block);
+}
+
+RescorerStats::LocalHolder::~LocalHolder() {
+  StatsRegistry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  if (registry->retired == nullptr) registry->retired = new Block();
+  block.AddTo(static_cast<Block*>(registry->retired));
+  registry->blocks.erase(&block);
+}
+
+int RescorerStats::ModelSlot(const string& model_name) {
+  StatsRegistry* registry = GetRegistry();
+  std::lock_guard<std::mutex> lock(registry->mutex);
+  auto it = registry->slots.find(model_name);
+  if (it != registry->slots.end()) return it->second;
+  int slot = registry->names.size();
+  if (slot >= kMaxModels) {
+    LOG(WARNING) << "Too many rescorer models, count " << model_name
+                 << " with others.";
+    slot = kMaxModels - 1;
+  } else {
+    registry->names.push_back(model_name);
+  }
+  registry->slots.emplace(model_name, slot);
+  return slot;
+}
+
+void RescorerStats::AddLatency(int64 ns) {
+  int bucket = 0;
+  while (bucket + 1 < kNumLatencyBuckets && (ns >> (bucket + 1)) > 0) {
+    ++bucket;
+  }
+  Increment(&LocalBlock()->latency[bucket]);
+}
+
+RescorerStatsSnapshot RescorerStats::Snapshot() {
+  unique_ptr<Block> total(new Block());
+  StatsRegistry* registry = GetRegistry();
+  vector<string> names;
+  {
+    std::lock_guard<std::mutex> lock(registry->mutex);
+    for (const void* block : registry->blocks) {
+      static_cast<const Block*>(block)->AddTo(total.get());
+    }
+    if (registry->retired != nullptr)
+      static_cast<const Block*>(registry->retired)->AddTo(total.get());
+    names = registry->names;
+  }
+
+  RescorerStatsSnapshot snapshot;
+  for (size_t slot = 0; slot < names.size(); ++slot) {
+    const auto& counters = total->models[slot];
+    RescorerModelStats model;
+    model.name = names[slot];
+    if (slot + 1 == kMaxModels) model.name += " and others";
+    model.queries = counters[kModelQueries].load(std::memory_order_relaxed);
+    model.oov = counters[kModelOOV].load(std::memory_order_relaxed);
+    model.state_cache_hits =
+        counters[kStateCacheHits].load(std::memory_order_relaxed);
+    model.state_cache_misses =
+        counters[kStateCacheMisses].load(std::memory_order_relaxed);
+    model.overlay_hits =
+        counters[kOverlayHits].load(std::memory_order_relaxed);
+    snapshot.models.push_back(model);
+  }
+  snapshot.score_cache_hits =
+      total->counters[kScoreCacheHits].load(std::memory_order_relaxed);
+  snapshot.score_cache_misses =
+      total->counters[kScoreCacheMisses].load(std::memory_order_relaxed);
+  snapshot.shared_cache_hits =
+      total->counters[kSharedCacheHits].load(std::memory_order_relaxed);
+  for (const auto& bucket : total->latency) {
+    snapshot.latency_ns_histogram.push_back(
+        bucket.load(std::memory_order_relaxed));
+  }
+  return snapshot;
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,176 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RESCORER_STATS_H_
+#define ENGINE_RESCORER_RESCORER_STATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+
+DECLARE_bool(rescorer_stats);
+DECLARE_int32(rescorer_stats_sample_interval);
+
+namespace mobvoi {
+
+// Counters of one rescoring model.
+struct RescorerModelStats {
+  string name;
+  int64 queries = 0;
+  // Queries answered with the OOV score without querying kenlm.
+  int64 oov = 0;
+  // Lookups of the kenlm state cache.
+  int64 state_cache_hits = 0;
+  int64 state_cache_misses = 0;
+  // Queries scored by the overlay n-grams of the model.
+  int64 overlay_hits = 0;
+};
+
+struct RescorerStatsSnapshot {
+  vector<RescorerModelStats> models;
+  // Lookups of the LMRescorerWrapper score caches.
+  int64 score_cache_hits = 0;
+  int64 score_cache_misses = 0;
+  // Score cache misses answered by the shared cache.
+  int64 shared_cache_hits = 0;
+  // Latency of the sampled LMRescorerWrapper::GetLmScore() calls. Bucket i
+  // counts the calls of [2^i, 2^(i+1)) ns.
+  vector<int64> latency_ns_histogram;
+};
+
+// Process-wide counters of the rescorers, e.g. for the server to export.
+//
+// Every thread counts into its own block with plain stores, so counting never
+// contends, and blocks are summed on Snapshot(). The counting macros below
+// cost a branch on --rescorer_stats when it is off, and nothing when built
+// with DISABLE_RESCORER_STATS.
+class RescorerStats {
+ public:
+  enum ModelCounter {
+    kModelQueries = 0,
+    kModelOOV,
+    kStateCacheHits,
+    kStateCacheMisses,
+    kOverlayHits,
+    kNumModelCounters,
+  };
+
+  enum Counter {
+    kScoreCacheHits = 0,
+    kScoreCacheMisses,
+    kSharedCacheHits,
+    kNumCounters,
+  };
+
+  // Models beyond this share the last slot.
+  static const int kMaxModels = 256;
+  static const int kNumLatencyBuckets = 40;
+
+  // Slot of the model counters of |model_name|, the same for all models of
+  // that name.
+  static int ModelSlot(const string& model_name);
+
+  static void AddModel(int slot, ModelCounter counter) {
+    Increment(&LocalBlock()->models[slot][counter]);
+  }
+  static void Add(Counter counter) {
+    Increment(&LocalBlock()->counters[counter]);
+  }
+  // Whether to time this call, one of --rescorer_stats_sample_interval.
+  static bool SampleLatency() {
+    if (!FLAGS_rescorer_stats) return false;
+    Block* block = LocalBlock();
+    if (--block->sample_countdown > 0) return false;
+    block->sample_countdown = FLAGS_rescorer_stats_sample_interval;
+    return true;
+  }
+  static void AddLatency(int64 ns);
+
+  static RescorerStatsSnapshot Snapshot();
+
+ private:
+  struct Block {
+    std::atomic<int64> models[kMaxModels][kNumModelCounters];
+    std::atomic<int64> counters[kNumCounters];
+    std::atomic<int64> latency[kNumLatencyBuckets];
+    int32 sample_countdown = 0;
+
+    Block();
+    void AddTo(Block* total) const;
+  };
+
+  // Registers the block of the thread, and merges it into the retired
+  // counters when the thread exits.
+  struct LocalHolder {
+    LocalHolder();
+    ~LocalHolder();
+    Block block;
+  };
+
+  // Only written by the owning thread, so no atomic read-modify-write.
+  static void Increment(std::atomic<int64>* value) {
+    value->store(value->load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+
+  static Block* LocalBlock() {
+    static thread_local LocalHolder holder;
+    return &holder.block;
+  }
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(RescorerStats);
+};
+
+// Times the enclosing scope if sampled.
+class ScopedRescorerLatency {
+ public:
+  ScopedRescorerLatency() : sampled_(RescorerStats::SampleLatency()) {
+    if (sampled_) start_ = std::chrono::steady_clock::now();
+  }
+  ~ScopedRescorerLatency() {
+    if (!sampled_) return;
+    RescorerStats::AddLatency(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count());
+  }
+
+ private:
+  const bool sampled_;
+  std::chrono::steady_clock::time_point start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedRescorerLatency);
+};
+
+}  // namespace mobvoi
+
+#ifndef DISABLE_RESCORER_STATS
+#define RESCORER_STATS_ADD_MODEL(slot, counter)                          \
+  do {                                                                   \
+    if (FLAGS_rescorer_stats)                                            \
+      ::mobvoi::RescorerStats::AddModel(slot,                            \
+                                        ::mobvoi::RescorerStats::counter); \
+  } while (0)
+#define RESCORER_STATS_ADD(counter)                                          \
+  do {                                                                       \
+    if (FLAGS_rescorer_stats)                                                \
+      ::mobvoi::RescorerStats::Add(::mobvoi::RescorerStats::counter);        \
+  } while (0)
+#define RESCORER_STATS_SCOPED_LATENCY(name) \
+  ::mobvoi::ScopedRescorerLatency name
+#else
+#define RESCORER_STATS_ADD_MODEL(slot, counter) \
+  do {                                          \
+  } while (0)
+#define RESCORER_STATS_ADD(counter) \
+  do {                              \
+  } while (0)
+#define RESCORER_STATS_SCOPED_LATENCY(name) \
+  do {                                      \
+  } while (0)
+#endif
+
+#endif  // ENGINE_RESCORER_RESCORER_STATS_H_
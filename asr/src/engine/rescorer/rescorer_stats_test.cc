@@ -0,0 +1,93 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescorer_stats.h"
+
+#include <thread>
+
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+const RescorerModelStats* FindModel(const RescorerStatsSnapshot& snapshot,
+                                    const string& name) {
+  for (const auto& model : snapshot.models) {
+    if (model.name == name) return &model;
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+TEST(RescorerStatsTest, ModelSlot) {
+  int slot = RescorerStats::ModelSlot("stats_test_a");
+  EXPECT_EQ(slot, RescorerStats::ModelSlot("stats_test_a"));
+  EXPECT_NE(slot, RescorerStats::ModelSlot("stats_test_b"));
+}
+
+#ifndef DISABLE_RESCORER_STATS
+TEST(RescorerStatsTest, MergeThreads) {
+  FLAGS_rescorer_stats = true;
+  const int slot = RescorerStats::ModelSlot("stats_test_merge");
+  RescorerStatsSnapshot before = RescorerStats::Snapshot();
+
+  const int kNumThreads = 4;
+  const int kNumQueries = 1000;
+  // Half of the threads exit before the snapshot, so both the live and the
+  // retired counters are read.
+  vector<std::thread> exited;
+  for (int i = 0; i < kNumThreads / 2; ++i) {
+    exited.emplace_back([slot]() {
+      for (int j = 0; j < kNumQueries; ++j) {
+        RESCORER_STATS_ADD_MODEL(slot, kModelQueries);
+      }
+      RESCORER_STATS_ADD_MODEL(slot, kModelOOV);
+      RESCORER_STATS_ADD(kScoreCacheHits);
+    });
+  }
+  for (auto& thread : exited) thread.join();
+  for (int j = 0; j < kNumQueries; ++j) {
+    RESCORER_STATS_ADD_MODEL(slot, kModelQueries);
+  }
+  RESCORER_STATS_ADD(kScoreCacheMisses);
+
+  RescorerStatsSnapshot after = RescorerStats::Snapshot();
+  const RescorerModelStats* model = FindModel(after, "stats_test_merge");
+  ASSERT_NE(nullptr, model);
+  EXPECT_EQ((kNumThreads / 2 + 1) * kNumQueries, model->queries);
+  EXPECT_EQ(kNumThreads / 2, model->oov);
+  EXPECT_EQ(kNumThreads / 2,
+            after.score_cache_hits - before.score_cache_hits);
+  EXPECT_EQ(1, after.score_cache_misses - before.score_cache_misses);
+  FLAGS_rescorer_stats = false;
+}
+
+TEST(RescorerStatsTest, SampleLatency) {
+  FLAGS_rescorer_stats = true;
+  FLAGS_rescorer_stats_sample_interval = 4;
+  RescorerStatsSnapshot before = RescorerStats::Snapshot();
+  for (int i = 0; i < 16; ++i) {
+    RESCORER_STATS_SCOPED_LATENCY(scoped_latency);
+  }
+  RescorerStatsSnapshot after = RescorerStats::Snapshot();
+  int64 sampled = 0;
+  for (int i = 0; i < RescorerStats::kNumLatencyBuckets; ++i) {
+    sampled += after.latency_ns_histogram[i] - before.latency_ns_histogram[i];
+  }
+  EXPECT_EQ(4, sampled);
+  FLAGS_rescorer_stats = false;
+}
+#endif
+
+TEST(RescorerStatsTest, Disabled) {
+  FLAGS_rescorer_stats = false;
+  const int slot = RescorerStats::ModelSlot("stats_test_disabled");
+  RESCORER_STATS_ADD_MODEL(slot, kModelQueries);
+  RescorerStatsSnapshot snapshot = RescorerStats::Snapshot();
+  const RescorerModelStats* model = FindModel(snapshot, "stats_test_disabled");
+  ASSERT_NE(nullptr, model);
+  EXPECT_EQ(0, model->queries);
+}
+
+}  // namespace mobvoi
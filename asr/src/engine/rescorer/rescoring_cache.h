@@ -0,0 +1,120 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RESCORING_CACHE_H_
+#define ENGINE_RESCORER_RESCORING_CACHE_H_
+
+#include <vector>
+
+#include "mobvoi/base/compat.h"
+
+namespace mobvoi {
+
+// A fixed capacity, allocation free cache for the small POD keys and values
+// of rescoring. Slots are stored inline in a flat array of |kWays|-way sets,
+// and a set evicts with CLOCK (second chance) when it is full. All memory is
+// allocated at construction.
+//
+// Reset() is O(1): every slot is stamped with the epoch it was written in,
+// and a slot of an older epoch is treated as empty, so bumping the epoch
+// invalidates the whole cache without touching it.
+//
+// It is not thread-safe.
+template <class Key, class Value, class Hash>
+class ClockCache {
+ public:
+  static const int kWays = 4;
+
+  explicit ClockCache(size_t capacity) : epoch_(1), mask_(0) {
+    size_t num_sets = 1;
+    while (num_sets * kWays < capacity) num_sets <<= 1;
+    sets_.resize(num_sets);
+    mask_ = num_sets - 1;
+  }
+
+  // Return the cached value of |key|, or nullptr if it is not cached.
+  const Value* Get(const Key& key) {
+    Set& set = sets_[SetIndex(key)];
+    for (int i = 0; i < kWays; ++i) {
+      Slot& slot = set.slots[i];
+      if (slot.epoch == epoch_ && slot.key == key) {
+        set.referenced |= (1 << i);
+        return &slot.value;
+      }
+    }
+    return nullptr;
+  }
+
+  void Put(const Key& key, const Value& value) {
+    Set& set = sets_[SetIndex(key)];
+    int victim = -1;
+    for (int i = 0; i < kWays; ++i) {
+      Slot& slot = set.slots[i];
+      if (slot.epoch != epoch_) {
+        if (victim < 0) victim = i;
+      } else if (slot.key == key) {
+        victim = i;
+        break;
+      }
+    }
+    if (victim < 0) {
+      // The set is full, give referenced slots a second chance.
+      while (set.referenced & (1 << set.hand)) {
+        set.referenced &= ~(1 << set.hand);
+        set.hand = (set.hand + 1) % kWays;
+      }
+      victim = set.hand;
+      set.hand = (set.hand + 1) % kWays;
+    }
+    Slot& slot = set.slots[victim];
+    slot.key = key;
+    slot.value = value;
+    slot.epoch = epoch_;
+    set.referenced &= ~(1 << victim);
+  }
+
+  // Drop all entries.
+  void Reset() {
+    if (++epoch_ == 0) {
+      // Epochs wrapped around, so slots written 2^32 resets ago would become
+      // valid again. Clear them for real, which happens once in a lifetime.
+      for (auto& set : sets_) set = Set();
+      epoch_ = 1;
+    }
+  }
+
+  size_t capacity() const { return sets_.size() * kWays; }
+
+  // Memory taken by an entry, to size a cache for a memory budget.
+  static size_t BytesPerEntry() { return sizeof(Set) / kWays; }
+
+ private:
+  struct Slot {
+    Key key{};
+    Value value{};
+    // 0 is never a valid epoch.
+    uint32 epoch = 0;
+  };
+
+  struct Set {
+    Slot slots[kWays];
+    uint8 referenced = 0;
+    uint8 hand = 0;
+  };
+
+  size_t SetIndex(const Key& key) const {
+    // Fibonacci hashing, so that weak hashes still spread over the sets.
+    return (static_cast<uint64>(hash_(key)) * 0x9E3779B97F4A7C15ULL >> 32) &
+           mask_;
+  }
+
+  std::vector<Set> sets_;
+  uint32 epoch_;
+  size_t mask_;
+  Hash hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(ClockCache);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_RESCORING_CACHE_H_
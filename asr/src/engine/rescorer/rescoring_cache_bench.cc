@@ -0,0 +1,167 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Compare the score cache of LMRescorerWrapper, ClockCache, with the
+// HashingMRUCache it replaces, on a synthetic decoding workload: every
+// utterance resets the cache, then probes it with Zipf distributed keys and
+// inserts the misses, like LMRescorerWrapper::GetLmScore() does.
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "base/mru_cache.h"
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescoring_cache.h"
+#include "engine/rescorer/rescoring_key_hash.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/string_util.h"
+
+DEFINE_string(cache_sizes, "256,1024,4096,16384,65536",
+              "comma separated cache sizes to benchmark");
+DEFINE_int32(num_keys, 100000, "number of distinct keys");
+DEFINE_double(zipf_s, 1.0, "exponent of the Zipf key distribution");
+DEFINE_int32(num_utterances, 200, "number of simulated utterances");
+DEFINE_int32(queries_per_utterance, 20000, "cache probes per utterance");
+DEFINE_int32(seed, 1234, "random seed");
+
+namespace mobvoi {
+namespace {
+
+typedef std::pair<float, int> Score;
+typedef HashingMRUCache<LMHistoryCKey, Score, LMHistoryCKeyHash> MRUCache;
+typedef ClockCache<LMHistoryCKey, Score, LMHistoryKeyHash> ScoreCache;
+
+struct BenchResult {
+  double ns_per_query = 0;
+  double ns_per_reset = 0;
+  double hit_rate = 0;
+};
+
+vector<LMHistoryCKey> GenerateKeys(int num_keys, std::mt19937* rng) {
+  std::uniform_int_distribution<LabelType> label(1, 60000);
+  vector<LMHistoryCKey> keys;
+  keys.reserve(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    RescoringHistory history;
+    for (int j = 0; j < history.order(); ++j) {
+      history.words[j] = label(*rng);
+    }
+    keys.emplace_back(static_cast<uint16>(label(*rng)), history, 0);
+  }
+  return keys;
+}
+
+vector<int> GenerateQueries(int num_keys, int num_queries, std::mt19937* rng) {
+  vector<double> weights(num_keys);
+  for (int i = 0; i < num_keys; ++i) {
+    weights[i] = 1.0 / std::pow(i + 1, FLAGS_zipf_s);
+  }
+  std::discrete_distribution<int> dist(weights.begin(), weights.end());
+  vector<int> queries(num_queries);
+  for (auto& query : queries) query = dist(*rng);
+  return queries;
+}
+
+double ElapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+inline const Score* Lookup(MRUCache* cache, const LMHistoryCKey& key) {
+  auto it = cache->Peek(key);
+  return it == cache->end() ? nullptr : &it->second;
+}
+
+inline void Insert(MRUCache* cache, const LMHistoryCKey& key,
+                   const Score& score) {
+  cache->PutNewKey(key, score);
+}
+
+inline void Clear(MRUCache* cache) { cache->Clear(); }
+
+inline const Score* Lookup(ScoreCache* cache, const LMHistoryCKey& key) {
+  return cache->Get(key);
+}
+
+inline void Insert(ScoreCache* cache, const LMHistoryCKey& key,
+                   const Score& score) {
+  cache->Put(key, score);
+}
+
+inline void Clear(ScoreCache* cache) { cache->Reset(); }
+
+template <class Cache>
+BenchResult Run(int cache_size, const vector<LMHistoryCKey>& keys,
+                const vector<int>& queries) {
+  Cache cache(cache_size);
+  BenchResult result;
+  double query_ns = 0;
+  double reset_ns = 0;
+  int64 hits = 0;
+  float checksum = 0;
+  for (int u = 0; u < FLAGS_num_utterances; ++u) {
+    auto start = std::chrono::steady_clock::now();
+    Clear(&cache);
+    reset_ns += ElapsedNs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < FLAGS_queries_per_utterance; ++i) {
+      int index = queries[(u * FLAGS_queries_per_utterance + i) %
+                          queries.size()];
+      const LMHistoryCKey& key = keys[index];
+      const Score* score = Lookup(&cache, key);
+      if (score != nullptr) {
+        checksum += score->first;
+        ++hits;
+      } else {
+        Insert(&cache, key, Score(index, 0));
+      }
+    }
+    query_ns += ElapsedNs(start);
+  }
+  int64 num_queries =
+      static_cast<int64>(FLAGS_num_utterances) * FLAGS_queries_per_utterance;
+  result.ns_per_query = query_ns / num_queries;
+  result.ns_per_reset = reset_ns / FLAGS_num_utterances;
+  result.hit_rate = static_cast<double>(hits) / num_queries;
+  // Keep the lookups alive.
+  if (checksum < 0) std::cerr << checksum;
+  return result;
+}
+
+void Print(const string& name, int cache_size, const BenchResult& result) {
+  std::cout << name << "\tsize=" << cache_size
+            << "\tns/query=" << result.ns_per_query
+            << "\tns/reset=" << result.ns_per_reset
+            << "\thit_rate=" << result.hit_rate << std::endl;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Benchmark the rescoring score cache against HashingMRUCache\n"
+      "Usage:  rescoring_cache_bench [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  std::mt19937 rng(FLAGS_seed);
+  auto keys = mobvoi::GenerateKeys(FLAGS_num_keys, &rng);
+  auto queries = mobvoi::GenerateQueries(
+      FLAGS_num_keys, FLAGS_queries_per_utterance * 4, &rng);
+
+  vector<string> cache_sizes;
+  mobvoi::SplitStringToVector(FLAGS_cache_sizes, ",", true, &cache_sizes);
+  for (const auto& size_str : cache_sizes) {
+    int cache_size = std::stoi(size_str);
+    mobvoi::Print("HashingMRUCache", cache_size,
+                  mobvoi::Run<mobvoi::MRUCache>(cache_size, keys, queries));
+    mobvoi::Print("ClockCache", cache_size,
+                  mobvoi::Run<mobvoi::ScoreCache>(cache_size, keys, queries));
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescoring_cache.h"
+
+#include <functional>
+
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+typedef ClockCache<int, float, std::hash<int>> IntCache;
+
+TEST(ClockCacheTest, GetAndPut) {
+  IntCache cache(100);
+  EXPECT_GE(cache.capacity(), 100u);
+  EXPECT_TRUE(cache.Get(1) == nullptr);
+
+  cache.Put(1, 1.0f);
+  cache.Put(2, 2.0f);
+  ASSERT_TRUE(cache.Get(1) != nullptr);
+  EXPECT_FLOAT_EQ(*cache.Get(1), 1.0f);
+  ASSERT_TRUE(cache.Get(2) != nullptr);
+  EXPECT_FLOAT_EQ(*cache.Get(2), 2.0f);
+
+  // Overwrite.
+  cache.Put(1, 3.0f);
+  EXPECT_FLOAT_EQ(*cache.Get(1), 3.0f);
+}
+
+TEST(ClockCacheTest, Reset) {
+  IntCache cache(100);
+  for (int i = 0; i < 50; ++i) {
+    cache.Put(i, i);
+  }
+  cache.Reset();
+  for (int i = 0; i < 50; ++i) {
+    EXPECT_TRUE(cache.Get(i) == nullptr);
+  }
+  cache.Put(7, 7.0f);
+  EXPECT_FLOAT_EQ(*cache.Get(7), 7.0f);
+}
+
+TEST(ClockCacheTest, SecondChance) {
+  // A single set.
+  IntCache cache(IntCache::kWays);
+  EXPECT_EQ(cache.capacity(), static_cast<size_t>(IntCache::kWays));
+  for (int i = 0; i < IntCache::kWays; ++i) {
+    cache.Put(i, i);
+  }
+  // Referenced entries survive the next eviction.
+  EXPECT_TRUE(cache.Get(0) != nullptr);
+  cache.Put(IntCache::kWays, 0.0f);
+  EXPECT_TRUE(cache.Get(0) != nullptr);
+  EXPECT_TRUE(cache.Get(1) == nullptr);
+  EXPECT_TRUE(cache.Get(IntCache::kWays) != nullptr);
+}
+
+TEST(ClockCacheTest, BoundedSize) {
+  IntCache cache(64);
+  for (int i = 0; i < 10000; ++i) {
+    cache.Put(i, i);
+  }
+  size_t cached = 0;
+  for (int i = 0; i < 10000; ++i) {
+    const float* value = cache.Get(i);
+    if (value != nullptr) {
+      EXPECT_FLOAT_EQ(*value, i);
+      ++cached;
+    }
+  }
+  EXPECT_LE(cached, cache.capacity());
+  EXPECT_GT(cached, 0u);
+}
+
+}  // namespace mobvoi
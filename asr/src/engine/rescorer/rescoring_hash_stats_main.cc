@@ -0,0 +1,154 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Collision and occupancy statistics of the rescoring hashes. The cache keys
+// are replayed offline from a text file of sentences: every word is scored
+// after its history together with --arcs_per_word competing words, like the
+// decoder expands its tokens, under --num_model_sets rescorer keys.
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescoring_key_hash.h"
+#include "engine/rescorer/rescoring_utils.h"
+#include "fst/symbol-table.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/string_util.h"
+
+DEFINE_string(text_file, "",
+              "text file of sentences, one per line, words separated by "
+              "spaces.");
+DEFINE_string(word_symbol_table, "", "word symbol table of the recognizer.");
+DEFINE_int32(arcs_per_word, 8,
+             "number of words scored after each history of the sentences.");
+DEFINE_int32(num_model_sets, 1,
+             "number of rescorer keys the sentences are replayed under.");
+DEFINE_int32(seed, 1234, "random seed");
+DEFINE_double(load_factor, 1.0, "load factor of the simulated hash tables");
+
+namespace mobvoi {
+namespace {
+
+// RescoringHistoryHash before it was fixed, which only hashed the most recent
+// word. Kept as a baseline.
+class LegacyRescoringHistoryHash {
+ public:
+  size_t operator()(const RescoringHistory& rh) const {
+    static const int8 primes[11] = {3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    size_t key(0);
+    for (int i = 0; i < rh.order() && i < 11; ++i) {
+      key += static_cast<size_t>(rh.words[0]) * primes[i];
+    }
+    return key;
+  }
+};
+
+// Add the keys of scoring every word of |sentence| after its history, with
+// the competing words.
+void AddSentence(const vector<int>& sentence, int num_words,
+                 std::mt19937* rng, vector<LMHistoryCKey>* keys) {
+  std::uniform_int_distribution<int> word_dist(1, num_words);
+  for (int rescorer_key = 0; rescorer_key < FLAGS_num_model_sets;
+       ++rescorer_key) {
+    RescoringHistory history;
+    for (int word : sentence) {
+      keys->emplace_back(word, history, rescorer_key);
+      for (int i = 1; i < FLAGS_arcs_per_word; ++i) {
+        keys->emplace_back(word_dist(*rng), history, rescorer_key);
+      }
+      RescoringHistory next;
+      RescoringUtil::UpdateHistory(history, word, &next);
+      history = next;
+    }
+    keys->emplace_back(dcd::kEndOfSentence, history, rescorer_key);
+  }
+}
+
+// Hash |keys| into an unordered_set, the table of HashingMRUCache, and report
+// the number of full hash collisions and the bucket occupancy.
+template <class Key, class Hash>
+void ReportStats(const string& name, const vector<Key>& keys) {
+  Hash hash;
+  std::unordered_set<size_t> hashes;
+  std::unordered_set<Key, Hash> table;
+  table.max_load_factor(FLAGS_load_factor);
+  for (const auto& key : keys) {
+    hashes.insert(hash(key));
+    table.insert(key);
+  }
+
+  size_t empty_buckets = 0;
+  size_t max_chain = 0;
+  double probes = 0;
+  for (size_t i = 0; i < table.bucket_count(); ++i) {
+    size_t chain = table.bucket_size(i);
+    if (chain == 0) ++empty_buckets;
+    max_chain = std::max(max_chain, chain);
+    // Average cost of the successful lookups of the chain.
+    probes += chain * (chain + 1) / 2.0;
+  }
+  double load = static_cast<double>(table.size()) / table.bucket_count();
+  std::cout << name << "\tkeys=" << table.size()
+            << "\thash_collisions=" << table.size() - hashes.size()
+            << "\tbuckets=" << table.bucket_count()
+            << "\tempty=" << static_cast<double>(empty_buckets) /
+                                 table.bucket_count()
+            << "\tmax_chain=" << max_chain
+            << "\tprobes/hit=" << probes / table.size()
+            << "\tuniform_probes/hit=" << 1 + load / 2 << std::endl;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Collision and occupancy statistics of the rescoring hashes\n"
+      "Usage:  rescoring_hash_stats_main --text_file=sentences.txt "
+      "--word_symbol_table=words.txt\n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  unique_ptr<fst::SymbolTable> symbols(
+      fst::SymbolTable::ReadText(FLAGS_word_symbol_table));
+  CHECK(symbols) << "Failed to read " << FLAGS_word_symbol_table;
+  const int num_words = symbols->AvailableKey() - 1;
+  CHECK_GT(num_words, 0) << FLAGS_word_symbol_table << " has no words.";
+  std::ifstream text(FLAGS_text_file);
+  CHECK(text) << "Failed to open " << FLAGS_text_file;
+  std::mt19937 rng(FLAGS_seed);
+  vector<mobvoi::LMHistoryCKey> keys;
+  string line;
+  while (std::getline(text, line)) {
+    vector<string> words;
+    mobvoi::SplitStringToVector(line, " ", true, &words);
+    vector<int> sentence;
+    for (const auto& word : words) {
+      int64 label = symbols->Find(word);
+      // Words out of the symbol table are replayed as one OOV label.
+      sentence.push_back(label > 0 ? label : num_words + 1);
+    }
+    mobvoi::AddSentence(sentence, num_words, &rng, &keys);
+  }
+  vector<mobvoi::RescoringHistory> histories;
+  for (const auto& key : keys) histories.push_back(std::get<1>(key));
+  LOG(INFO) << "Replayed " << keys.size() << " keys from " << FLAGS_text_file;
+
+  mobvoi::ReportStats<mobvoi::RescoringHistory,
+                      mobvoi::LegacyRescoringHistoryHash>(
+      "legacy_history_hash", histories);
+  mobvoi::ReportStats<mobvoi::RescoringHistory, mobvoi::RescoringHistoryHash>(
+      "history_hash", histories);
+  mobvoi::ReportStats<mobvoi::LMHistoryCKey, mobvoi::LMHistoryCKeyHash>(
+      "lm_history_ckey_hash", keys);
+  mobvoi::ReportStats<mobvoi::LMHistoryCKey, mobvoi::LMHistoryKeyHash>(
+      "lm_history_key_hash", keys);
+  return 0;
+}
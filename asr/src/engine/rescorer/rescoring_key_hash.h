@@ -0,0 +1,29 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_RESCORING_KEY_HASH_H_
+#define ENGINE_RESCORER_RESCORING_KEY_HASH_H_
+
+#include <tuple>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescoring_utils.h"
+#include "mobvoi/base/compat.h"
+
+namespace mobvoi {
+
+// Hash of the rescoring cache keys. The fields besides the history are
+// folded into the seed of HashRescoringWords(), so that the key is mixed as a
+// whole rather than summing up per field hashes, which collide whenever the
+// fields shift against each other.
+class LMHistoryKeyHash {
+ public:
+  size_t operator()(const LMHistoryCKey& key) const {
+    uint64 seed = (static_cast<uint64>(std::get<0>(key)) << 32) |
+                  static_cast<uint32>(std::get<2>(key));
+    return HashRescoringWords(std::get<1>(key).words, seed);
+  }
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_RESCORING_KEY_HASH_H_
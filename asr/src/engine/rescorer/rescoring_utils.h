@@ -4,7 +4,10 @@
 #ifndef ENGINE_RESCORER_RESCORING_UTILS_H_
 #define ENGINE_RESCORER_RESCORING_UTILS_H_
 
+#include <algorithm>
 #include <queue>
+#include <tuple>
+#include <unordered_map>
 
 #include "engine/decoder/constants.h"
 #include "fst/types.h"
@@ -72,18 +75,78 @@ typedef RescoringHistoryT<8> LongRescoringHistory;
 // We support at most 5-gram LM rescore.
 constexpr int kHistoryOrder = 5;
 
+// A history and the class slot it is in, if any. A class slot of a
+// hypothesis, e.g. a contact name, is its class token, the words of one member
+// of the class and the closing kClassTagIdForRescoring, see
+// LMRescorerWrapper::SetClassMembers(). The member words are kept out of
+// |history|, so that the words after the slot see the class token and the
+// words before it, however long the member.
+template <std::size_t N = 4>
+struct ClassRescoringHistoryT {
+  RescoringHistoryT<N> history;
+  // Class token of the slot, 0 outside of a slot.
+  LabelType class_token = 0;
+  // Member prefix read so far, see lm::ngram::ClassMembers::Next().
+  uint32 class_node = 0;
+
+  bool InClass() const { return class_token != 0; }
+
+  bool operator==(const ClassRescoringHistoryT<N>& other) const {
+    return history == other.history && class_token == other.class_token &&
+           class_node == other.class_node;
+  }
+};
+
+typedef ClassRescoringHistoryT<4> ClassRescoringHistory;
+typedef ClassRescoringHistoryT<8> LongClassRescoringHistory;
+
+// Finalizer of MurmurHash3, every input bit affects every output bit.
+inline uint64 MixRescoringHash(uint64 h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Hash of a packed word array and a seed, which can carry the other fields of
+// a cache key. Words are read as independent 64-bit lanes, each multiplied by
+// its own odd constant, so that the loop has no carried dependency except the
+// final xor and is vectorized for LongRescoringHistory.
+template <std::size_t N>
+inline uint64 HashRescoringWords(const LabelType (&words)[N], uint64 seed) {
+  static_assert(sizeof(LabelType) == sizeof(uint32), "LabelType is 32 bits");
+  static const uint64 kLaneMultipliers[] = {
+      0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+      0xd6e8feb86659fd93ULL, 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+      0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+  constexpr std::size_t kLanes = (N + 1) / 2;
+  static_assert(kLanes <= sizeof(kLaneMultipliers) / sizeof(uint64),
+                "History is too long");
+  uint64 h = seed;
+  for (std::size_t i = 0; i < kLanes; ++i) {
+    uint64 lane = static_cast<uint32>(words[2 * i]);
+    if (2 * i + 1 < N) {
+      lane |= static_cast<uint64>(static_cast<uint32>(words[2 * i + 1])) << 32;
+    }
+    h ^= lane * kLaneMultipliers[i];
+  }
+  return MixRescoringHash(h);
+}
+
 class RescoringHistoryHash {
  public:
   size_t operator()(const RescoringHistory& rh) const {
-    size_t key(0);
-    for (int i = 0; i < rh.order() && i < 11; ++i) {
-      key += static_cast<size_t>(rh.words[0]) * primes[i];
-    }
-    return key;
+    return HashRescoringWords(rh.words, 0);
   }
+};
 
- private:
-  int8 primes[11] = {3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+class LongRescoringHistoryHash {
+ public:
+  size_t operator()(const LongRescoringHistory& rh) const {
+    return HashRescoringWords(rh.words, 0);
+  }
 };
 
 class RescoringUtil {
@@ -111,6 +174,8 @@ class RescoringUtil {
 };
 
 // A POD for cache. It will be converted to kenlm/lm/state.hh:State in KenlmRescoreer.  // NOLINT
+// It holds the context of models up to kHistoryOrder, which is all the cache
+// keys can tell apart. kenlm states of higher orders are not cached.
 class State {
  public:
   unsigned int words[kHistoryOrder - 1];
@@ -118,78 +183,147 @@ class State {
   unsigned char length;
 };
 
+// Aho-Corasick automaton of the app context entries, e.g. contact or app
+// names, for look ahead biasing. Transitions are kept sparse, sorted by label
+// per state, so the automaton takes memory in proportion to the entries and
+// labels can take any value. It is immutable once built, so one automaton is
+// shared by all sessions with the same app context, see
+// LMRescorerWrapper::BuildAutomaton().
 class AhoCorasickTree {
  public:
+  // Without Build(), the automaton has the root only and matches nothing.
+  AhoCorasickTree() : offsets_(2, 0), height_(1, 0) {}
+
   void Insert(const vector<LabelType>& ids) {
     Insert(ids.cbegin(), ids.cend());
   }
 
   template <typename T>
   void Insert(const T& begin, const T& end) {
-    int u = 0;
+    CHECK(!built_) << "Insert after Build.";
+    uint16_t u = 0;
     for (auto id = begin; id != end; ++id) {
-      CHECK_LE(*id, kMaxSize) << *id;
-      if (!tr_[u][*id]) {
-        tr_[u][*id] = ++tot_;
+      auto it = build_edges_.find(EdgeKey(u, *id));
+      if (it == build_edges_.end()) {
+        CHECK_LT(height_.size(), kMaxNumStates);
+        uint16_t v = height_.size();
+        height_.push_back(std::distance(begin, id) + 1);
+        it = build_edges_.emplace(EdgeKey(u, *id), v).first;
       }
-      u = tr_[u][*id];
-      CHECK_LE(u, kNumState) << u;
-      height_[u] = std::distance(begin, id) + 1;
+      u = it->second;
     }
-    end_[u] = true;
+    end_states_.push_back(u);
   }
 
   void Build() {
-    std::queue<int> q;
-    for (int i = 0; i < kMaxSize; i++) {
-      if (tr_[0][i]) {
-        q.push(tr_[0][i]);
-      }
+    CHECK(!built_);
+    built_ = true;
+    const int num_states = height_.size();
+    // Lay the transitions out by state, then by label.
+    vector<std::tuple<uint16_t, LabelType, uint16_t>> edges;
+    edges.reserve(build_edges_.size());
+    for (const auto& edge : build_edges_) {
+      edges.emplace_back(edge.first >> 32,
+                         static_cast<LabelType>(edge.first & 0xffffffff),
+                         edge.second);
+    }
+    std::unordered_map<uint64, uint16_t>().swap(build_edges_);
+    std::sort(edges.begin(), edges.end());
+    offsets_.assign(num_states + 1, 0);
+    labels_.reserve(edges.size());
+    targets_.reserve(edges.size());
+    for (const auto& edge : edges) {
+      ++offsets_[std::get<0>(edge) + 1];
+      labels_.push_back(std::get<1>(edge));
+      targets_.push_back(std::get<2>(edge));
+    }
+    for (int u = 0; u < num_states; ++u) {
+      offsets_[u + 1] += offsets_[u];
+    }
+
+    vector<bool> is_end(num_states, false);
+    for (uint16_t u : end_states_) is_end[u] = true;
+    vector<uint16_t>().swap(end_states_);
+
+    // Breadth first, so that the failure states are done before their use.
+    // The children of the root and the end states fail to the root.
+    fail_.assign(num_states, 0);
+    std::queue<uint16_t> q;
+    for (uint32 e = offsets_[0]; e < offsets_[1]; ++e) {
+      q.push(targets_[e]);
     }
     while (!q.empty()) {
-      int u = q.front();
+      uint16_t u = q.front();
       q.pop();
-      for (int i = 0; i < kMaxSize; i++) {
-        if (tr_[u][i] > 0) {
-          if (!end_[tr_[u][i]]) {
-            auto state = fail_[u];
-            auto trans = tr_[state][i];
-            while (trans == 0 && state != 0) {
-              state = fail_[state];
-              trans = tr_[state][i];
-            }
-            fail_[tr_[u][i]] = trans;
-          } else {
-            fail_[tr_[u][i]] = 0;
+      for (uint32 e = offsets_[u]; e < offsets_[u + 1]; ++e) {
+        uint16_t v = targets_[e];
+        if (!is_end[v]) {
+          uint16_t state = fail_[u];
+          uint16_t trans = Next(state, labels_[e]);
+          while (trans == 0 && state != 0) {
+            state = fail_[state];
+            trans = Next(state, labels_[e]);
           }
-
-          q.push(tr_[u][i]);
+          fail_[v] = trans;
         }
+        q.push(v);
       }
     }
   }
 
   // return height diff.
-  int Query(uint16_t* state, uint16_t label) const {
+  int Query(uint16_t* state, LabelType label) const {
     auto current_state = *state;
-    auto s = tr_[current_state][label];
+    auto s = Next(current_state, label);
     while (s == 0 && current_state != 0) {
       current_state = fail_[current_state];
-      s = tr_[current_state][label];
+      s = Next(current_state, label);
     }
 
     *state = s;
     return height_[s];
   }
 
+  int num_states() const { return height_.size(); }
+
+  // Memory taken by the built automaton.
+  size_t MemoryUsage() const {
+    return sizeof(*this) + offsets_.capacity() * sizeof(uint32) +
+           labels_.capacity() * sizeof(LabelType) +
+           (targets_.capacity() + fail_.capacity() + height_.capacity()) *
+               sizeof(uint16_t);
+  }
+
  private:
-  constexpr static int kNumState = 2000;
-  constexpr static int kMaxSize = 150;
-  uint16_t tr_[kNumState][kMaxSize]{{0}};
-  uint16_t tot_{0};
-  uint16_t fail_[kMaxSize]{0};
-  bool end_[kNumState]{false};
-  uint8_t height_[kNumState]{0};
+  // States are uint16_t, as the look ahead state of the decoder tokens.
+  constexpr static size_t kMaxNumStates = 1 << 16;
+
+  static uint64 EdgeKey(uint16_t state, LabelType label) {
+    return static_cast<uint64>(state) << 32 | static_cast<uint32>(label);
+  }
+
+  // Transition of |state| on |label|, or 0 if none.
+  uint16_t Next(uint16_t state, LabelType label) const {
+    auto begin = labels_.begin() + offsets_[state];
+    auto end = labels_.begin() + offsets_[state + 1];
+    auto it = std::lower_bound(begin, end, label);
+    if (it == end || *it != label) return 0;
+    return targets_[it - labels_.begin()];
+  }
+
+  bool built_ = false;
+  // Transitions and end states while inserting, dropped by Build().
+  std::unordered_map<uint64, uint16_t> build_edges_;
+  vector<uint16_t> end_states_;
+
+  // Transitions of state u are [offsets_[u], offsets_[u + 1]) of |labels_|
+  // and |targets_|, sorted by label.
+  vector<uint32> offsets_;
+  vector<LabelType> labels_;
+  vector<uint16_t> targets_;
+  vector<uint16_t> fail_;
+  // Number of labels from the root.
+  vector<uint16_t> height_;
 };
 }  // namespace mobvoi
 #endif  // ENGINE_RESCORER_RESCORING_UTILS_H_
@@ -0,0 +1,101 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/rescoring_utils.h"
+
+#include <unordered_set>
+
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+TEST(RescoringHistoryHashTest, HashAllWords) {
+  RescoringHistoryHash hash;
+  std::unordered_set<size_t> hashes;
+  // Histories sharing the most recent word.
+  for (int i = 1; i <= 100; ++i) {
+    for (int j = 1; j <= 100; ++j) {
+      RescoringHistory history;
+      history.words[0] = 7;
+      history.words[1] = i;
+      history.words[3] = j;
+      hashes.insert(hash(history));
+    }
+  }
+  EXPECT_EQ(hashes.size(), 10000u);
+
+  RescoringHistory a;
+  a.words[1] = 1;
+  RescoringHistory b;
+  b.words[2] = 1;
+  EXPECT_NE(hash(a), hash(b));
+}
+
+TEST(RescoringHistoryHashTest, LongHistory) {
+  LongRescoringHistoryHash hash;
+  std::unordered_set<size_t> hashes;
+  for (int i = 0; i < LongRescoringHistory().order(); ++i) {
+    LongRescoringHistory history;
+    history.words[i] = 1;
+    hashes.insert(hash(history));
+  }
+  EXPECT_EQ(hashes.size(),
+            static_cast<size_t>(LongRescoringHistory().order()));
+}
+
+TEST(RescoringHistoryHashTest, Seed) {
+  RescoringHistory history(5);
+  EXPECT_NE(HashRescoringWords(history.words, 0),
+            HashRescoringWords(history.words, 1));
+  EXPECT_EQ(HashRescoringWords(history.words, 3),
+            HashRescoringWords(history.words, 3));
+}
+
+TEST(AhoCorasickTreeTest, Query) {
+  AhoCorasickTree tree;
+  tree.Insert(vector<LabelType>{1, 2, 3});
+  tree.Insert(vector<LabelType>{2, 5});
+  // Labels are not bounded by the number of states.
+  tree.Insert(vector<LabelType>{100000, 70000});
+  tree.Build();
+  EXPECT_EQ(8, tree.num_states());
+
+  uint16_t state = 0;
+  EXPECT_EQ(1, tree.Query(&state, 1));
+  EXPECT_EQ(2, tree.Query(&state, 2));
+  // Falls back from "1 2" to "2".
+  EXPECT_EQ(2, tree.Query(&state, 5));
+  EXPECT_EQ(0, tree.Query(&state, 4));
+  EXPECT_EQ(0, state);
+  EXPECT_EQ(1, tree.Query(&state, 100000));
+  EXPECT_EQ(2, tree.Query(&state, 70000));
+}
+
+TEST(AhoCorasickTreeTest, Empty) {
+  // Built or not, an automaton without entries matches nothing.
+  AhoCorasickTree tree;
+  uint16_t state = 0;
+  EXPECT_EQ(0, tree.Query(&state, 1));
+  EXPECT_EQ(0, state);
+  tree.Build();
+  EXPECT_EQ(1, tree.num_states());
+  EXPECT_EQ(0, tree.Query(&state, 1));
+  EXPECT_EQ(0, state);
+}
+
+TEST(AhoCorasickTreeTest, ManyEntries) {
+  AhoCorasickTree tree;
+  const int kNumEntries = 5000;
+  for (int i = 0; i < kNumEntries; ++i) {
+    tree.Insert(vector<LabelType>{i + 1, 2 * i + 1, 3 * i + 1});
+  }
+  tree.Build();
+  EXPECT_EQ(1 + 3 * kNumEntries, tree.num_states());
+  for (int i = 0; i < kNumEntries; i += 97) {
+    uint16_t state = 0;
+    EXPECT_EQ(1, tree.Query(&state, i + 1));
+    EXPECT_EQ(2, tree.Query(&state, 2 * i + 1));
+    EXPECT_EQ(3, tree.Query(&state, 3 * i + 1));
+  }
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,78 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/shared_rescoring_cache.h"
+
+#include "mobvoi/base/log.h"
+
+DEFINE_int32(shared_rescoring_cache_mb, 0,
+             "memory budget of the LM score cache shared by all sessions, "
+             "in MB. 0 disables it.");
+DEFINE_int32(shared_rescoring_cache_shards, 64,
+             "number of independently locked shards of the shared LM score "
+             "cache.");
+
+namespace mobvoi {
+
+SharedRescoringCache::SharedRescoringCache()
+    : SharedRescoringCache(
+          static_cast<size_t>(FLAGS_shared_rescoring_cache_mb) << 20,
+          FLAGS_shared_rescoring_cache_shards) {}
+
+SharedRescoringCache::SharedRescoringCache(size_t memory_budget,
+                                           int num_shards)
+    : shards_(num_shards) {
+  CHECK_GT(num_shards, 0);
+  // ClockCache rounds its capacity up to a power of two, so round the shard
+  // capacity down to one to stay in budget.
+  size_t shard_capacity = ShardCache::kWays;
+  while (shard_capacity * 2 * ShardCache::BytesPerEntry() * num_shards <=
+         memory_budget) {
+    shard_capacity *= 2;
+  }
+  for (auto& shard : shards_) {
+    shard.reset(new Shard());
+    shard->cache.reset(new ShardCache(shard_capacity));
+  }
+  LOG(INFO) << "Shared rescoring cache: " << num_shards << " shards of "
+            << shard_capacity << " entries, "
+            << (shard_capacity * ShardCache::BytesPerEntry() * num_shards >>
+                20) << " MB.";
+}
+
+SharedRescoringCache* SharedRescoringCache::Get() {
+  if (FLAGS_shared_rescoring_cache_mb <= 0) return nullptr;
+  return Singleton<SharedRescoringCache>::get();
+}
+
+bool SharedRescoringCache::Lookup(const LMHistoryCKey& key, Value* value) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  const Value* cached = shard.cache->Get(key);
+  if (cached == nullptr) {
+    ++shard.misses;
+    return false;
+  }
+  ++shard.hits;
+  *value = *cached;
+  return true;
+}
+
+void SharedRescoringCache::Insert(const LMHistoryCKey& key,
+                                  const Value& value) {
+  Shard& shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.cache->Put(key, value);
+}
+
+SharedRescoringCache::Stats SharedRescoringCache::GetStats() {
+  Stats stats;
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    stats.hits += shard->hits;
+    stats.misses += shard->misses;
+    stats.capacity += shard->cache->capacity();
+  }
+  return stats;
+}
+
+}  // namespace mobvoi
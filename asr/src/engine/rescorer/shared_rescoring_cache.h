@@ -0,0 +1,85 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef ENGINE_RESCORER_SHARED_RESCORING_CACHE_H_
+#define ENGINE_RESCORER_SHARED_RESCORING_CACHE_H_
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/rescoring_cache.h"
+#include "engine/rescorer/rescoring_key_hash.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/singleton.h"
+
+DECLARE_int32(shared_rescoring_cache_mb);
+DECLARE_int32(shared_rescoring_cache_shards);
+
+namespace mobvoi {
+
+// Process-wide second level cache of LM scores, shared by the
+// LMRescorerWrapper of all sessions, so that concurrent sessions score the
+// popular n-grams once. It is keyed by (word, history, rescorer key), where
+// the rescorer key identifies the enabled models together with their
+// generations, so that entries never go stale across sessions or model
+// updates and the cache is never cleared.
+//
+// It is split into shards, each a ClockCache behind its own mutex, and is
+// bounded by --shared_rescoring_cache_mb. It is disabled when the budget is 0.
+class SharedRescoringCache {
+ public:
+  typedef std::pair<float, int> Value;
+
+  struct Stats {
+    uint64 hits = 0;
+    uint64 misses = 0;
+    size_t capacity = 0;
+  };
+
+  // At most |memory_budget| bytes split into |num_shards| shards. Use Get()
+  // for the process-wide instance.
+  SharedRescoringCache(size_t memory_budget, int num_shards);
+
+  // Return the process-wide cache, or nullptr if it is disabled.
+  static SharedRescoringCache* Get();
+
+  // Copy the cached value of |key| to |value|. Return false if not cached.
+  bool Lookup(const LMHistoryCKey& key, Value* value);
+  void Insert(const LMHistoryCKey& key, const Value& value);
+
+  Stats GetStats();
+
+ private:
+  typedef ClockCache<LMHistoryCKey, Value, LMHistoryKeyHash> ShardCache;
+
+  // Counters are kept per shard under its lock, so that sessions hitting
+  // different shards never write to the same cache line.
+  struct Shard {
+    std::mutex mutex;
+    unique_ptr<ShardCache> cache;
+    uint64 hits = 0;
+    uint64 misses = 0;
+  };
+
+  // Sized by the flags.
+  SharedRescoringCache();
+  friend struct DefaultSingletonTraits<SharedRescoringCache>;
+
+  Shard& GetShard(const LMHistoryCKey& key) {
+    // The shard takes the high bits of the hash, the sets of a ClockCache
+    // mostly depend on the low bits.
+    return *shards_[(static_cast<uint64>(hash_(key)) >> 32) % shards_.size()];
+  }
+
+  // Allocated one by one rather than in an array, to keep them apart.
+  std::vector<unique_ptr<Shard>> shards_;
+  LMHistoryKeyHash hash_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedRescoringCache);
+};
+
+}  // namespace mobvoi
+
+#endif  // ENGINE_RESCORER_SHARED_RESCORING_CACHE_H_
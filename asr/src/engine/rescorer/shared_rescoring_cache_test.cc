@@ -0,0 +1,60 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "engine/rescorer/shared_rescoring_cache.h"
+
+#include <thread>
+
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+LMHistoryCKey MakeKey(int word, int history_word, int rescorer_key) {
+  return LMHistoryCKey(word, RescoringHistory(history_word), rescorer_key);
+}
+
+}  // namespace
+
+TEST(SharedRescoringCacheTest, LookupAndInsert) {
+  SharedRescoringCache cache(1 << 20, 4);
+  SharedRescoringCache::Value value;
+  EXPECT_FALSE(cache.Lookup(MakeKey(1, 2, 3), &value));
+  cache.Insert(MakeKey(1, 2, 3), std::make_pair(1.5f, 1));
+  ASSERT_TRUE(cache.Lookup(MakeKey(1, 2, 3), &value));
+  EXPECT_FLOAT_EQ(value.first, 1.5f);
+  EXPECT_EQ(value.second, 1);
+  // Another rescorer key, i.e. another set of models.
+  EXPECT_FALSE(cache.Lookup(MakeKey(1, 2, 4), &value));
+
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 2u);
+  EXPECT_LE(stats.capacity * 16, static_cast<size_t>(1 << 20));
+}
+
+TEST(SharedRescoringCacheTest, Concurrent) {
+  SharedRescoringCache cache(1 << 20, 8);
+  const int kThreads = 4;
+  const int kKeys = 1000;
+  vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&cache]() {
+      SharedRescoringCache::Value value;
+      for (int i = 0; i < kKeys; ++i) {
+        if (cache.Lookup(MakeKey(i, i + 1, 0), &value)) {
+          EXPECT_FLOAT_EQ(value.first, i);
+        } else {
+          cache.Insert(MakeKey(i, i + 1, 0), std::make_pair(i, 0));
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.hits + stats.misses,
+            static_cast<uint64>(kThreads * kKeys));
+  EXPECT_GT(stats.hits, 0u);
+}
+
+}  // namespace mobvoi
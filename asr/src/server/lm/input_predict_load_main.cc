@@ -0,0 +1,145 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Load generator of the next word predictions of InputPredictServer: runs
+// the segmentation and prediction of the request handler from concurrent
+// clients, and reports the QPS and the latency percentiles per number of
+// clients.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/relabel_table.h"
+#include "fst/symbol-table.h"
+#include "grammar/segmentation_utils.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "mobvoi/base/singleton.h"
+#include "mobvoi/base/string_util.h"
+#include "server/lm/next_word_predictor.h"
+#include "server/lm/successor_index.h"
+
+DEFINE_string(model_path, "", "kenlm binary of the server");
+DEFINE_int32(ngram_order, 4, "");
+DEFINE_string(segmenter_dict, "", "segmenter dictionary of the server");
+DEFINE_string(symbol_table, "", "word symbol table of the server");
+DEFINE_string(successor_index, "",
+              "successor index of --model_path, the vocabulary is scored "
+              "without it");
+DEFINE_int32(score_partitions, 4,
+             "number of threads scoring the vocabulary of a request");
+DEFINE_string(queries, "", "file of the request queries, one per line");
+DEFINE_string(clients, "1,2,4,8,16,32",
+              "comma separated numbers of concurrent clients");
+DEFINE_int32(requests_per_client, 200, "requests sent by every client");
+
+namespace mobvoi {
+namespace {
+
+const int kNBest = 10;
+const int kCacheSize = 10000;
+
+void Run(int num_clients, const vector<string>& queries,
+         DoubleArrayWordSegmenter* segmenter,
+         NextWordPredictor* predictor) {
+  vector<vector<double>> latencies(num_clients);
+  std::atomic<int> ready(0);
+  auto client = [&](int id) {
+    vector<double>* latency = &latencies[id];
+    latency->reserve(FLAGS_requests_per_client);
+    ready.fetch_add(1);
+    while (ready.load() < num_clients) std::this_thread::yield();
+    for (int i = 0; i < FLAGS_requests_per_client; ++i) {
+      const string& query =
+          queries[(id * FLAGS_requests_per_client + i) % queries.size()];
+      auto start = std::chrono::steady_clock::now();
+      vector<string> segs;
+      segmenter->Segment(query, &segs);
+      vector<string> words;
+      predictor->Predict(segs, kNBest, &words);
+      latency->push_back(std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count());
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  vector<std::thread> threads;
+  for (int i = 0; i < num_clients; ++i) threads.emplace_back(client, i);
+  for (auto& thread : threads) thread.join();
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  vector<double> all;
+  for (const auto& latency : latencies) {
+    all.insert(all.end(), latency.begin(), latency.end());
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&all](double p) {
+    return all[std::min(all.size() - 1,
+                        static_cast<size_t>(p * all.size()))];
+  };
+  std::cout << "clients=" << num_clients
+            << "\tqps=" << all.size() / seconds
+            << "\tp50_ms=" << percentile(0.5)
+            << "\tp99_ms=" << percentile(0.99)
+            << "\tmax_ms=" << all.back()
+            << std::endl;
+}
+
+}  // namespace
+}  // namespace mobvoi
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Load generator of the next word predictions of InputPredictServer\n"
+      "Usage:  input_predict_load_main [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  string content;
+  CHECK(mobvoi::File::ReadFileToString(FLAGS_queries, &content))
+      << "Failed to read " << FLAGS_queries;
+  vector<string> queries;
+  mobvoi::SplitStringToVector(content, "\n", true, &queries);
+  CHECK(!queries.empty()) << "No query in " << FLAGS_queries;
+
+  mobvoi::LMRescorerConfig config;
+  config.set_model_type("KenLMRescorer");
+  auto params = config.add_kenlm_config();
+  params->set_ngram_order(FLAGS_ngram_order);
+  params->set_model_path(FLAGS_model_path);
+
+  mobvoi::DoubleArrayWordSegmenter* segmenter =
+      Singleton<mobvoi::DoubleArrayWordSegmenter>::get();
+  segmenter->LoadDict(FLAGS_segmenter_dict);
+  unique_ptr<fst::SymbolTable> symbol_table(
+      fst::SymbolTable::ReadText(FLAGS_symbol_table));
+  unique_ptr<mobvoi::LMRescorer> core =
+      mobvoi::LMRescorer::Create(config.model_type());
+  core->Init(config, symbol_table.get());
+
+  mobvoi::SuccessorIndex* index = nullptr;
+  if (!FLAGS_successor_index.empty()) {
+    index = mobvoi::SuccessorIndex::Load(
+        FLAGS_successor_index,
+        mobvoi::RelabelTable::SymbolTableFingerprint(*symbol_table),
+        mobvoi::RelabelTable::KenLMFingerprint(FLAGS_model_path));
+    CHECK(index) << "Failed to load " << FLAGS_successor_index;
+  }
+  mobvoi::NextWordPredictor predictor(core.get(), symbol_table.get(), index,
+                                      mobvoi::kCacheSize,
+                                      FLAGS_score_partitions);
+
+  vector<string> clients;
+  mobvoi::SplitStringToVector(FLAGS_clients, ",", true, &clients);
+  for (const auto& num : clients) {
+    mobvoi::Run(std::stoi(num), queries, segmenter, &predictor);
+  }
+  return 0;
+}
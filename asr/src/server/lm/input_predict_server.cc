@@ -6,8 +6,10 @@
 #include "mobvoi/base/file.h"
 #include "mobvoi/base/string_util.h"
 #include "mobvoi/base/singleton.h"
-#include "engine/rescorer/lm_rescorer_wrapper.h"
+#include "engine/rescorer/relabel_table.h"
 #include "grammar/segmentation_utils.h"
+#include "server/lm/next_word_predictor.h"
+#include "server/lm/successor_index.h"
 #include "third_party/jsoncpp/json.h"
 
 DEFINE_string(model_path,
@@ -15,9 +17,42 @@ DEFINE_string(model_path,
 DEFINE_int32(ngram_order, 4, "");
 DEFINE_string(segmenter_dict, "/data/search/graph_clg_20180227/graph/lexicon", "");  // NOLINT
 DEFINE_string(symbol_table, "/data/search/graph_clg_20180227/graph/words.txt", "");  // NOLINT
+DEFINE_string(successor_index, "",
+              "successor index of --model_path built by "
+              "successor_index_builder_main, without it every word of the "
+              "vocabulary is scored per request.");
+DEFINE_int32(score_partitions, 4,
+             "number of threads scoring the vocabulary of a request when "
+             "there is no successor index.");
 
 namespace mobvoi {
 
+namespace {
+
+const int kNBest = 10;
+const int kCacheSize = 10000;
+
+// Shared by the request threads.
+unique_ptr<NextWordPredictor>& GetPredictor() {
+  static unique_ptr<NextWordPredictor>* predictor =
+      new unique_ptr<NextWordPredictor>();
+  return *predictor;
+}
+
+// The index of the model in the flags, nullptr if it is not configured or
+// stale.
+SuccessorIndex* LoadSuccessorIndex(const fst::SymbolTable& symbols) {
+  if (FLAGS_successor_index.empty()) return nullptr;
+  SuccessorIndex* index = SuccessorIndex::Load(
+      FLAGS_successor_index, RelabelTable::SymbolTableFingerprint(symbols),
+      RelabelTable::KenLMFingerprint(FLAGS_model_path));
+  LOG_IF(WARNING, index == nullptr)
+      << "Ignore successor index " << FLAGS_successor_index;
+  return index;
+}
+
+}  // namespace
+
 InputPredictServer::InputPredictServer() {
   mobvoi::LMRescorerConfig config;
   config.set_model_type("KenLMRescorer");
@@ -33,34 +68,14 @@ InputPredictServer::InputPredictServer() {
   symbol_table_.reset(fst::SymbolTable::ReadText(FLAGS_symbol_table));
   lm_rescorer_core_ = mobvoi::LMRescorer::Create(config.model_type());
   lm_rescorer_core_->Init(config, symbol_table_.get());
-  lm_rescorer_.reset(
-      new LMRescorerWrapper(lm_rescorer_core_.get(), true, 10000));
+  GetPredictor().reset(new NextWordPredictor(
+      lm_rescorer_core_.get(), symbol_table_.get(),
+      LoadSuccessorIndex(*symbol_table_), kCacheSize,
+      FLAGS_score_partitions));
 }
 
 InputPredictServer::~InputPredictServer() {}
 
-float InputPredictServer::GetScore(const vector<string>& segs,
-                                   uint32 word4) {
-  if (segs.empty()) {
-    mobvoi::RescoringHistory history;
-    return lm_rescorer_->GetLmScore(history, word4);
-  }
-
-  mobvoi::RescoringHistory history(symbol_table_->Find(segs[0]));
-  for (size_t i = 1; i < segs.size(); ++i) {
-    mobvoi::RescoringHistory history_tmp;
-    uint32 w = symbol_table_->Find(segs[i]);
-    mobvoi::RescoringUtil::UpdateHistory(history, w, &history_tmp);
-    history = history_tmp;
-  }
-  return lm_rescorer_->GetLmScore(history, word4);
-}
-
-struct Record {
-  string word;
-  float weight;
-};
-
 static string GenResponseForSuggestion(const string& query,
                                        const vector<string>& results) {
   string res;
@@ -97,37 +112,8 @@ bool InputPredictServer::HandleRequest(util::HttpRequest* request,
   LOG(INFO) << "word size : " << segs.size();
   LOG(INFO) << "segmented word list : " << JoinVectorToString(segs, " ");
 
-  auto cmp = [](const Record& left, const Record& right) {
-    return (left.weight) < (right.weight);
-  };
-  std::priority_queue<Record, std::vector<Record>, decltype(cmp)> q(cmp);
-  const int kNBest = 10;
-  // Save top N words.
-  fst::SymbolTableIterator iref(*symbol_table_);
-  for (iref.Reset(); !iref.Done(); iref.Next()) {
-    uint32 word4 = iref.Value();
-    if (word4 == 0) continue;  // skip <eps>
-    if (iref.Symbol() == "#0") continue;
-    float s = GetScore(segs, word4);
-    VLOG(1) << "word : " << iref.Symbol() << ", weight : " << s
-            << ", word id : " << word4;
-    Record r;
-    r.weight = s;
-    r.word = iref.Symbol();
-    q.push(r);
-    if (q.size() > kNBest) {
-      q.pop();
-    }
-  }
-  LOG(INFO) << "queue size : " << q.size();
   vector<string> ret;
-  while (!q.empty()) {
-    auto r = q.top();
-    VLOG(1) << "word : " << r.word << ", weight : " << r.weight;
-    q.pop();
-    ret.push_back(r.word);
-  }
-  reverse(ret.begin(), ret.end());
+  GetPredictor()->Predict(segs, kNBest, &ret);
   // Try to predict best next word using lm.
   response->AppendHeader("Content-Type", "text/plain; charset=utf-8");
   // Segment.
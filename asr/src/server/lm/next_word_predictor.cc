@@ -0,0 +1,238 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "server/lm/next_word_predictor.h"
+
+#include <algorithm>
+
+#include "engine/rescorer/rescoring_utils.h"
+#include "mobvoi/base/log.h"
+
+namespace mobvoi {
+
+namespace {
+
+// The costs of a kenlm model are -ln of its log10 probabilities.
+const float kLn10 = 2.302585f;
+
+bool BetterCandidate(float left_cost, int32 left_index, float right_cost,
+                     int32 right_index) {
+  return left_cost < right_cost ||
+         (left_cost == right_cost && left_index < right_index);
+}
+
+}  // namespace
+
+NextWordPredictor::NextWordPredictor(const LMRescorer* core,
+                                     const fst::SymbolTable* symbols,
+                                     const SuccessorIndex* index,
+                                     int cache_size, int num_partitions)
+    : core_(core),
+      symbols_(symbols),
+      index_(index),
+      cache_size_(cache_size),
+      num_partitions_(std::max(num_partitions, 1)),
+      stopped_(false) {
+  fst::SymbolTableIterator iref(*symbols_);
+  for (iref.Reset(); !iref.Done(); iref.Next()) {
+    if (iref.Value() == 0) continue;  // skip <eps>
+    const string& symbol = iref.Symbol();
+    if (symbol == "#0" || symbol == "<s>" || symbol == "</s>" ||
+        symbol == "<unk>") {
+      continue;
+    }
+    vocabulary_.emplace_back(iref.Value(), symbol);
+  }
+  // Ties are ranked by label, as the successor index does.
+  std::sort(vocabulary_.begin(), vocabulary_.end());
+  for (int i = 1; i < num_partitions_; ++i) {
+    workers_.emplace_back(&NextWordPredictor::WorkerLoop, this);
+  }
+}
+
+NextWordPredictor::~NextWordPredictor() {
+  {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    stopped_ = true;
+  }
+  task_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void NextWordPredictor::Predict(const vector<string>& segs, int num,
+                                vector<string>* words) {
+  words->clear();
+  RescoringHistory history;
+  if (!segs.empty()) {
+    history = RescoringHistory(symbols_->Find(segs[0]));
+    for (size_t i = 1; i < segs.size(); ++i) {
+      RescoringHistory history_tmp;
+      uint32 w = symbols_->Find(segs[i]);
+      RescoringUtil::UpdateHistory(history, w, &history_tmp);
+      history = history_tmp;
+    }
+  }
+  if (index_ != nullptr && PredictByIndex(segs, history, num, words)) {
+    return;
+  }
+  PredictByScan(history, num, words);
+}
+
+void NextWordPredictor::PredictByScan(const RescoringHistory& history,
+                                      int num, vector<string>* words) {
+  const size_t partition_size =
+      (vocabulary_.size() + num_partitions_ - 1) / num_partitions_;
+  vector<vector<Candidate>> tops(num_partitions_);
+  int pending = 0;
+  {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    for (int i = 1; i < num_partitions_; ++i) {
+      PartitionTask task;
+      task.history = &history;
+      task.begin = std::min(i * partition_size, vocabulary_.size());
+      task.end = std::min(task.begin + partition_size, vocabulary_.size());
+      task.num = num;
+      task.top = &tops[i];
+      task.pending = &pending;
+      tasks_.push_back(task);
+      ++pending;
+    }
+  }
+  task_cv_.notify_all();
+
+  // The first partition is scored by the calling thread, and so are the
+  // partitions no worker has taken by then, rather than waiting behind the
+  // partitions of other requests.
+  unique_ptr<LMRescorerWrapper> wrapper = AcquireWrapper();
+  ScorePartition(wrapper.get(), history, 0,
+                 std::min(partition_size, vocabulary_.size()), num, &tops[0]);
+  std::unique_lock<std::mutex> lock(task_mutex_);
+  while (pending > 0) {
+    auto it = std::find_if(tasks_.begin(), tasks_.end(),
+                           [&pending](const PartitionTask& task) {
+                             return task.pending == &pending;
+                           });
+    if (it == tasks_.end()) {
+      done_cv_.wait(lock);
+      continue;
+    }
+    PartitionTask task = *it;
+    tasks_.erase(it);
+    lock.unlock();
+    ScorePartition(wrapper.get(), history, task.begin, task.end, num,
+                   task.top);
+    lock.lock();
+    --pending;
+  }
+  lock.unlock();
+  ReleaseWrapper(std::move(wrapper));
+
+  vector<Candidate> candidates;
+  for (const auto& top : tops) {
+    candidates.insert(candidates.end(), top.begin(), top.end());
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const Candidate& left, const Candidate& right) {
+              return BetterCandidate(left.cost, left.index, right.cost,
+                                     right.index);
+            });
+  for (int i = 0; i < num && i < static_cast<int>(candidates.size()); ++i) {
+    const auto& word = vocabulary_[candidates[i].index];
+    VLOG(1) << "word : " << word.second << ", weight : " << candidates[i].cost
+            << ", word id : " << word.first;
+    words->push_back(word.second);
+  }
+}
+
+bool NextWordPredictor::PredictByIndex(const vector<string>& segs,
+                                       const RescoringHistory& history,
+                                       int num, vector<string>* words) {
+  vector<int32> context;
+  for (const auto& seg : segs) {
+    context.push_back(symbols_->Find(seg));
+    // The index has no context of unknown words.
+    if (context.back() <= 0) return false;
+  }
+  vector<SuccessorIndex::Suggestion> suggestions;
+  unique_ptr<LMRescorerWrapper> wrapper = AcquireWrapper();
+  const bool exact = index_->Suggest(
+      context, true, num,
+      [&](int32 label) {
+        return -wrapper->GetLmScore(history, label) / kLn10;
+      },
+      &suggestions);
+  ReleaseWrapper(std::move(wrapper));
+  if (!exact) {
+    VLOG(1) << "Successor index may miss the best words, score them all.";
+    return false;
+  }
+  for (const auto& suggestion : suggestions) {
+    VLOG(1) << "word : " << symbols_->Find(suggestion.label)
+            << ", log10 prob : " << suggestion.log10_prob;
+    words->push_back(symbols_->Find(suggestion.label));
+  }
+  return true;
+}
+
+void NextWordPredictor::ScorePartition(LMRescorerWrapper* wrapper,
+                                       const RescoringHistory& history,
+                                       size_t begin, size_t end, int num,
+                                       vector<Candidate>* top) {
+  // Heap of the best candidates, with the worst of them on the front.
+  auto better = [](const Candidate& left, const Candidate& right) {
+    return BetterCandidate(left.cost, left.index, right.cost, right.index);
+  };
+  for (size_t i = begin; i < end; ++i) {
+    Candidate candidate = {
+        wrapper->GetLmScore(history, vocabulary_[i].first),
+        static_cast<int32>(i)};
+    if (static_cast<int>(top->size()) < num) {
+      top->push_back(candidate);
+      std::push_heap(top->begin(), top->end(), better);
+    } else if (num > 0 && better(candidate, top->front())) {
+      std::pop_heap(top->begin(), top->end(), better);
+      top->back() = candidate;
+      std::push_heap(top->begin(), top->end(), better);
+    }
+  }
+}
+
+void NextWordPredictor::WorkerLoop() {
+  LMRescorerWrapper wrapper(core_->Copy(), true, cache_size_);
+  std::unique_lock<std::mutex> lock(task_mutex_);
+  while (true) {
+    task_cv_.wait(lock, [this]() { return stopped_ || !tasks_.empty(); });
+    if (stopped_)
+      return;
+    PartitionTask task = tasks_.front();
+    tasks_.pop_front();
+    lock.unlock();
+    ScorePartition(&wrapper, *task.history, task.begin, task.end, task.num,
+                   task.top);
+    lock.lock();
+    --*task.pending;
+    done_cv_.notify_all();
+  }
+}
+
+unique_ptr<LMRescorerWrapper> NextWordPredictor::AcquireWrapper() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_wrappers_.empty()) {
+      unique_ptr<LMRescorerWrapper> wrapper = std::move(free_wrappers_.back());
+      free_wrappers_.pop_back();
+      return wrapper;
+    }
+  }
+  return unique_ptr<LMRescorerWrapper>(
+      new LMRescorerWrapper(core_->Copy(), true, cache_size_));
+}
+
+void NextWordPredictor::ReleaseWrapper(
+    unique_ptr<LMRescorerWrapper> wrapper) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_wrappers_.push_back(std::move(wrapper));
+}
+
+}  // namespace mobvoi
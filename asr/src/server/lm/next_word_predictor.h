@@ -0,0 +1,105 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef SERVER_LM_NEXT_WORD_PREDICTOR_H_
+#define SERVER_LM_NEXT_WORD_PREDICTOR_H_
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine/rescorer/lm_rescorer.h"
+#include "engine/rescorer/lm_rescorer_wrapper.h"
+#include "fst/symbol-table.h"
+#include "mobvoi/base/compat.h"
+#include "server/lm/successor_index.h"
+
+namespace mobvoi {
+
+// Next word suggestions of InputPredictServer, safe to call from concurrent
+// request threads.
+//
+// With a successor index, a prediction scores the candidates of the index,
+// unless the index can not tell the best words. Otherwise every word of the
+// vocabulary is scored, split into |num_partitions| ranges. The request
+// thread scores one of them and the others are queued to |num_partitions| - 1
+// workers shared by all requests, so the number of scoring threads stays
+// bounded under load. A request thread takes back its queued ranges which no
+// worker has started, so it never waits behind other requests. Every worker
+// owns an LMRescorerWrapper, and request threads take one of a pool, since a
+// wrapper and its caches serve one thread at a time, while the wrappers
+// share the models of |core| through LMRescorer::Copy().
+class NextWordPredictor {
+ public:
+  // |core| and |symbols| must outlive the predictor. Take the ownership of
+  // |index|, which may be nullptr.
+  NextWordPredictor(const LMRescorer* core, const fst::SymbolTable* symbols,
+                    const SuccessorIndex* index, int cache_size,
+                    int num_partitions);
+  ~NextWordPredictor();
+
+  // Top |num| words following the words |segs|, best first.
+  void Predict(const vector<string>& segs, int num,
+               vector<string>* words);
+
+ private:
+  struct Candidate {
+    float cost;
+    int32 index;
+  };
+
+  // A range of the vocabulary to score for a request.
+  struct PartitionTask {
+    const RescoringHistory* history;
+    size_t begin;
+    size_t end;
+    int num;
+    vector<Candidate>* top;
+    // Ranges of the request not scored yet, also identifies the request.
+    int* pending;
+  };
+
+  // Return false if the index can not tell the top |num| words, which are
+  // then scored by PredictByScan().
+  bool PredictByIndex(const vector<string>& segs,
+                      const RescoringHistory& history, int num,
+                      vector<string>* words);
+  void PredictByScan(const RescoringHistory& history, int num,
+                     vector<string>* words);
+  // Top |num| of the words [begin, end) of |vocabulary_|, as a heap.
+  void ScorePartition(LMRescorerWrapper* wrapper,
+                      const RescoringHistory& history, size_t begin,
+                      size_t end, int num, vector<Candidate>* top);
+  void WorkerLoop();
+
+  unique_ptr<LMRescorerWrapper> AcquireWrapper();
+  void ReleaseWrapper(unique_ptr<LMRescorerWrapper> wrapper);
+
+  const LMRescorer* core_;
+  const fst::SymbolTable* symbols_;
+  unique_ptr<const SuccessorIndex> index_;
+  const int cache_size_;
+  const int num_partitions_;
+  // Words scored without the successor index.
+  vector<pair<int32, string>> vocabulary_;
+
+  std::mutex mutex_;
+  vector<unique_ptr<LMRescorerWrapper>> free_wrappers_;
+
+  std::mutex task_mutex_;
+  std::condition_variable task_cv_;
+  // Notified whenever a worker finishes a range.
+  std::condition_variable done_cv_;
+  std::deque<PartitionTask> tasks_;
+  bool stopped_;
+  vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(NextWordPredictor);
+};
+
+}  // namespace mobvoi
+
+#endif  // SERVER_LM_NEXT_WORD_PREDICTOR_H_
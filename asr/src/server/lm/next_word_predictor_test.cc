@@ -0,0 +1,140 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "server/lm/next_word_predictor.h"
+
+#include <cstdio>
+#include <thread>
+
+#include "engine/rescorer/lm_rescorer_config.pb.h"
+#include "engine/rescorer/relabel_table.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/gtest/gtest.h"
+
+namespace mobvoi {
+
+namespace {
+
+const char kArpaFile[] = "/tmp/next_word_predictor_test.arpa";
+const char kIndexFile[] = "/tmp/next_word_predictor_test.bin";
+const int kNumWords = 20;
+const int kCacheSize = 100;
+
+string Word(int i) { return "w" + std::to_string(i); }
+
+// A bigram model of kNumWords words, each followed by one other word more
+// likely than by the unigrams.
+string MakeArpa() {
+  string unigrams;
+  string bigrams;
+  for (int i = 0; i < kNumWords; ++i) {
+    unigrams += std::to_string(-1.0 - 0.05 * i) + "\t" + Word(i) + "\t" +
+                std::to_string(-0.1 * (i % 3)) + "\n";
+    bigrams += std::to_string(-0.2 - 0.01 * i) + "\t" + Word(i) + " " +
+               Word((7 * i + 3) % kNumWords) + "\n";
+  }
+  for (int i = 0; i < 5; ++i) {
+    bigrams += std::to_string(-0.3 - 0.1 * i) + "\t<s> " + Word(2 * i) + "\n";
+  }
+  return "\\data\\\n"
+         "ngram 1=" + std::to_string(kNumWords + 3) + "\n"
+         "ngram 2=" + std::to_string(kNumWords + 5) + "\n"
+         "\n\\1-grams:\n"
+         "-1.0\t<unk>\n"
+         "-99\t<s>\t-0.5\n"
+         "-0.7\t</s>\n" + unigrams +
+         "\n\\2-grams:\n" + bigrams +
+         "\n\\end\\\n";
+}
+
+class NextWordPredictorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(File::WriteStringToFile(MakeArpa(), kArpaFile));
+    symbols_.reset(new fst::SymbolTable());
+    symbols_->AddSymbol("<eps>", 0);
+    for (int i = 0; i < kNumWords; ++i) symbols_->AddSymbol(Word(i));
+    symbols_->AddSymbol("</s>");
+
+    LMRescorerConfig config;
+    config.set_model_type("KenLMRescorer");
+    auto params = config.add_kenlm_config();
+    params->set_ngram_order(2);
+    params->set_model_path(kArpaFile);
+    core_ = LMRescorer::Create(config.model_type());
+    core_->Init(config, symbols_.get());
+  }
+
+  void TearDown() override {
+    remove(kArpaFile);
+    remove(kIndexFile);
+  }
+
+  base::AtExitManager at_exit_;
+  unique_ptr<fst::SymbolTable> symbols_;
+  unique_ptr<LMRescorer> core_;
+};
+
+const vector<vector<string>> kContexts = {
+    {}, {"w0"}, {"w1"}, {"w7"}, {"w3", "w19"}, {"w4", "w4"}};
+const int kNums[] = {1, 3, 5, kNumWords + 5};
+
+}  // namespace
+
+TEST_F(NextWordPredictorTest, PartitionedSameAsSingleThreaded) {
+  NextWordPredictor single(core_.get(), symbols_.get(), nullptr, kCacheSize,
+                           1);
+  NextWordPredictor partitioned(core_.get(), symbols_.get(), nullptr,
+                                kCacheSize, 4);
+  for (const auto& context : kContexts) {
+    for (int num : kNums) {
+      vector<string> expected;
+      single.Predict(context, num, &expected);
+      EXPECT_EQ(std::min(num, kNumWords), static_cast<int>(expected.size()));
+      vector<string> words;
+      partitioned.Predict(context, num, &words);
+      EXPECT_EQ(expected, words) << JoinVectorToString(context, " ")
+                                 << " num " << num;
+    }
+  }
+
+  // Concurrent requests share the workers of the predictor.
+  vector<string> expected;
+  single.Predict(kContexts[1], 5, &expected);
+  vector<std::thread> threads;
+  vector<vector<string>> results(8);
+  for (size_t i = 0; i < results.size(); ++i) {
+    threads.emplace_back([&partitioned, &results, i]() {
+      for (int r = 0; r < 20; ++r) {
+        partitioned.Predict(kContexts[1], 5, &results[i]);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  for (const auto& result : results) EXPECT_EQ(expected, result);
+}
+
+TEST_F(NextWordPredictorTest, IndexSameAsScan) {
+  ASSERT_TRUE(SuccessorIndex::Build(kArpaFile, *symbols_, 3, 1, kIndexFile));
+  const SuccessorIndex* index = SuccessorIndex::Load(
+      kIndexFile, RelabelTable::SymbolTableFingerprint(*symbols_), 1);
+  ASSERT_TRUE(index != nullptr);
+  NextWordPredictor scan(core_.get(), symbols_.get(), nullptr, kCacheSize,
+                         2);
+  NextWordPredictor indexed(core_.get(), symbols_.get(), index, kCacheSize,
+                            2);
+  for (const auto& context : kContexts) {
+    for (int num : kNums) {
+      vector<string> expected;
+      scan.Predict(context, num, &expected);
+      vector<string> words;
+      indexed.Predict(context, num, &words);
+      EXPECT_EQ(expected, words) << JoinVectorToString(context, " ")
+                                 << " num " << num;
+    }
+  }
+}
+
+}  // namespace mobvoi
@@ -0,0 +1,313 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "server/lm/successor_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "engine/rescorer/relabel_table.h"
+#include "mobvoi/base/log.h"
+#include "third_party/kenlm/lm/read_arpa.hh"
+#include "third_party/kenlm/util/exception.hh"
+#include "third_party/kenlm/util/file.hh"
+#include "third_party/kenlm/util/file_piece.hh"
+#include "third_party/kenlm/util/murmur_hash.hh"
+
+namespace mobvoi {
+
+namespace {
+
+const char kSuccessorIndexMagic[8] = {'m', 'v', 's', 'u', 'c', 'c', 'i', 'x'};
+
+// Bump it whenever the layout below changes.
+const uint32 kSuccessorIndexVersion = 1;
+
+// Marks an empty bucket.
+const uint64 kEmptyKey = 0;
+
+// Margin of the rescored probabilities over the bound of the words which are
+// not candidates, since the model rounds them differently than the index.
+const float kBoundSlack = 1e-4f;
+
+// Index file layout, followed by |num_buckets| buckets and |num_entries|
+// suggestions. Bucket i holds the suggestions [begin, begin + count).
+struct SuccessorIndexHeader {
+  char magic[8];
+  uint32 version;
+  uint32 top_k;
+  uint32 max_order;
+  uint32 unused;
+  uint64 symbol_table_fingerprint;
+  uint64 kenlm_fingerprint;
+  uint64 num_buckets;
+  uint64 num_entries;
+};
+
+uint64 ContextKey(const int32* words, int size) {
+  uint64 key = util::MurmurHash64A(words, size * sizeof(int32),
+                                   kSuccessorIndexVersion);
+  return key == kEmptyKey ? 1 : key;
+}
+
+}  // namespace
+
+// Open addressing hash table entry of a context.
+struct SuccessorIndex::Bucket {
+  uint64 key;
+  float backoff;
+  uint32 begin;
+  uint32 count;
+  uint32 unused;
+};
+
+bool SuccessorIndex::Build(const string& arpa_path,
+                           const fst::SymbolTable& symbols, int top_k,
+                           uint64 kenlm_fingerprint,
+                           const string& output_path) {
+  struct Context {
+    float backoff = 0.0f;
+    // Min heap of the best continuations.
+    vector<Suggestion> top;
+  };
+  auto worse = [](const Suggestion& left, const Suggestion& right) {
+    return left.log10_prob > right.log10_prob;
+  };
+
+  unordered_map<uint64, Context> contexts;
+  uint32 max_order = 0;
+  try {
+    util::FilePiece in(arpa_path.c_str());
+    vector<uint64_t> counts;
+    lm::ReadARPACounts(in, counts);
+    max_order = counts.size();
+    vector<int32> words(max_order);
+    for (uint32 order = 1; order <= max_order; ++order) {
+      lm::ReadNGramHeader(in, order);
+      for (uint64 i = 0; i < counts[order - 1]; ++i) {
+        float log10_prob = in.ReadFloat();
+        // Whether the words before the last one are all in the symbol
+        // table, and whether the last one is, and can be suggested.
+        bool known_context = true;
+        bool known_word = true;
+        bool suggested = true;
+        for (uint32 j = 0; j < order; ++j) {
+          string word = in.ReadDelimited(lm::kARPASpaces).as_string();
+          bool known = true;
+          if (word == "<s>") {
+            words[j] = kBeginOfSentence;
+            suggested = false;
+          } else {
+            words[j] = symbols.Find(word);
+            known = words[j] > 0;
+            suggested = known && word != "</s>" && word != "<unk>" &&
+                        word != "#0";
+          }
+          if (j + 1 < order) {
+            known_context = known_context && known;
+          } else {
+            known_word = known;
+          }
+        }
+        float backoff = 0.0f;
+        lm::ReadBackoff(in, backoff);
+        if (!known_context || !known_word) continue;
+        if (order < max_order && backoff != 0.0f) {
+          contexts[ContextKey(words.data(), order)].backoff = backoff;
+        }
+        if (!suggested) continue;
+        auto& top = contexts[ContextKey(words.data(), order - 1)].top;
+        Suggestion suggestion = {words[order - 1], log10_prob};
+        if (static_cast<int>(top.size()) < top_k) {
+          top.push_back(suggestion);
+          std::push_heap(top.begin(), top.end(), worse);
+        } else if (suggestion.log10_prob > top.front().log10_prob) {
+          std::pop_heap(top.begin(), top.end(), worse);
+          top.back() = suggestion;
+          std::push_heap(top.begin(), top.end(), worse);
+        }
+      }
+    }
+    lm::ReadEnd(in);
+  } catch (const util::Exception& e) {
+    LOG(ERROR) << "Failed to read ARPA file " << arpa_path << ": "
+               << e.what();
+    return false;
+  }
+
+  // At most half full, so that probing ends soon.
+  uint64 num_buckets = 1;
+  while (num_buckets < 2 * contexts.size()) num_buckets <<= 1;
+  vector<Bucket> buckets(num_buckets);
+  memset(buckets.data(), 0, num_buckets * sizeof(Bucket));
+  vector<Suggestion> entries;
+  for (auto& context : contexts) {
+    auto& top = context.second.top;
+    std::sort_heap(top.begin(), top.end(), worse);
+    uint64 index = context.first & (num_buckets - 1);
+    while (buckets[index].key != kEmptyKey) {
+      index = (index + 1) & (num_buckets - 1);
+    }
+    Bucket& bucket = buckets[index];
+    bucket.key = context.first;
+    bucket.backoff = context.second.backoff;
+    bucket.begin = entries.size();
+    bucket.count = top.size();
+    entries.insert(entries.end(), top.begin(), top.end());
+  }
+
+  SuccessorIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kSuccessorIndexMagic, sizeof(header.magic));
+  header.version = kSuccessorIndexVersion;
+  header.top_k = top_k;
+  header.max_order = max_order;
+  header.symbol_table_fingerprint =
+      RelabelTable::SymbolTableFingerprint(symbols);
+  header.kenlm_fingerprint = kenlm_fingerprint;
+  header.num_buckets = num_buckets;
+  header.num_entries = entries.size();
+  try {
+    util::scoped_fd fd(util::CreateOrThrow(output_path.c_str()));
+    util::WriteOrThrow(fd.get(), &header, sizeof(header));
+    util::WriteOrThrow(fd.get(), buckets.data(),
+                       num_buckets * sizeof(Bucket));
+    util::WriteOrThrow(fd.get(), entries.data(),
+                       entries.size() * sizeof(Suggestion));
+  } catch (const util::Exception& e) {
+    LOG(ERROR) << "Failed to write successor index " << output_path << ": "
+               << e.what();
+    return false;
+  }
+  LOG(INFO) << "Built successor index of " << contexts.size()
+            << " contexts and " << entries.size() << " suggestions.";
+  return true;
+}
+
+SuccessorIndex* SuccessorIndex::Load(const string& path,
+                                     uint64 symbol_table_fingerprint,
+                                     uint64 kenlm_fingerprint) {
+  unique_ptr<SuccessorIndex> index(new SuccessorIndex());
+  try {
+    util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+    uint64 file_size = util::SizeOrThrow(fd.get());
+    if (file_size < sizeof(SuccessorIndexHeader)) {
+      LOG(WARNING) << "Successor index " << path << " is truncated.";
+      return nullptr;
+    }
+    util::MapRead(util::POPULATE_OR_LAZY, fd.get(), 0, file_size,
+                  index->mapped_);
+  } catch (const util::Exception& e) {
+    LOG(WARNING) << "Failed to map successor index " << path << ": "
+                 << e.what();
+    return nullptr;
+  }
+
+  const SuccessorIndexHeader* header =
+      reinterpret_cast<const SuccessorIndexHeader*>(index->mapped_.begin());
+  if (memcmp(header->magic, kSuccessorIndexMagic, sizeof(header->magic)) ||
+      header->version != kSuccessorIndexVersion) {
+    LOG(WARNING) << "Successor index " << path << " has unsupported format.";
+    return nullptr;
+  }
+  if (header->symbol_table_fingerprint != symbol_table_fingerprint ||
+      header->kenlm_fingerprint != kenlm_fingerprint) {
+    LOG(WARNING) << "Successor index " << path
+                 << " was built from another symbol table or kenlm model.";
+    return nullptr;
+  }
+  if (header->num_buckets == 0 ||
+      (header->num_buckets & (header->num_buckets - 1)) != 0 ||
+      index->mapped_.size() != sizeof(SuccessorIndexHeader) +
+                                   header->num_buckets * sizeof(Bucket) +
+                                   header->num_entries * sizeof(Suggestion)) {
+    LOG(WARNING) << "Successor index " << path << " has wrong size.";
+    return nullptr;
+  }
+
+  const char* data = static_cast<const char*>(index->mapped_.begin());
+  index->buckets_ = reinterpret_cast<const Bucket*>(
+      data + sizeof(SuccessorIndexHeader));
+  index->entries_ = reinterpret_cast<const Suggestion*>(
+      data + sizeof(SuccessorIndexHeader) +
+      header->num_buckets * sizeof(Bucket));
+  index->bucket_mask_ = header->num_buckets - 1;
+  index->top_k_ = header->top_k;
+  index->max_order_ = header->max_order;
+  return index.release();
+}
+
+const SuccessorIndex::Bucket* SuccessorIndex::Find(const int32* words,
+                                                   int size) const {
+  uint64 key = ContextKey(words, size);
+  for (uint64 index = key & bucket_mask_;;
+       index = (index + 1) & bucket_mask_) {
+    const Bucket& bucket = buckets_[index];
+    if (bucket.key == key) return &bucket;
+    if (bucket.key == kEmptyKey) return nullptr;
+  }
+}
+
+float SuccessorIndex::Candidates(const vector<int32>& context,
+                                 bool begin_of_sentence,
+                                 vector<Suggestion>* candidates) const {
+  candidates->clear();
+  vector<int32> words;
+  if (begin_of_sentence) words.push_back(kBeginOfSentence);
+  words.insert(words.end(), context.begin(), context.end());
+  const int longest = std::min<int>(words.size(), max_order_ - 1);
+  const int32* end = words.data() + words.size();
+
+  // A word is scored by the longest context it follows in the model, plus
+  // the backoffs of the longer contexts, as kenlm does. The words cut from
+  // the list of a context are at most as likely as the last word of the
+  // list, with the same backoffs.
+  std::unordered_set<int32> seen;
+  float backoff = 0.0f;
+  float bound = -std::numeric_limits<float>::infinity();
+  for (int size = longest; size >= 0; --size) {
+    const Bucket* bucket = Find(end - size, size);
+    if (bucket == nullptr) continue;
+    const Suggestion* begin = entries_ + bucket->begin;
+    for (const Suggestion* it = begin; it != begin + bucket->count; ++it) {
+      if (!seen.insert(it->label).second) continue;
+      candidates->push_back({it->label, it->log10_prob + backoff});
+    }
+    if (top_k_ > 0 && static_cast<int>(bucket->count) == top_k_) {
+      bound = std::max(bound, begin[bucket->count - 1].log10_prob + backoff);
+    }
+    backoff += bucket->backoff;
+  }
+  return bound;
+}
+
+bool SuccessorIndex::Suggest(const vector<int32>& context,
+                             bool begin_of_sentence, int num,
+                             const std::function<float(int32)>& log10_prob,
+                             vector<Suggestion>* suggestions) const {
+  const float bound = Candidates(context, begin_of_sentence, suggestions);
+  for (auto& suggestion : *suggestions) {
+    suggestion.log10_prob = log10_prob(suggestion.label);
+  }
+
+  auto better = [](const Suggestion& left, const Suggestion& right) {
+    return left.log10_prob > right.log10_prob ||
+           (left.log10_prob == right.log10_prob && left.label < right.label);
+  };
+  if (static_cast<int>(suggestions->size()) > num) {
+    std::partial_sort(suggestions->begin(), suggestions->begin() + num,
+                      suggestions->end(), better);
+    suggestions->resize(num);
+  } else {
+    std::sort(suggestions->begin(), suggestions->end(), better);
+  }
+  if (num <= 0 || bound == -std::numeric_limits<float>::infinity()) {
+    return true;
+  }
+  return static_cast<int>(suggestions->size()) == num &&
+         suggestions->back().log10_prob > bound + kBoundSlack;
+}
+
+}  // namespace mobvoi
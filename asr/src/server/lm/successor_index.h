@@ -0,0 +1,97 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#ifndef SERVER_LM_SUCCESSOR_INDEX_H_
+#define SERVER_LM_SUCCESSOR_INDEX_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fst/symbol-table.h"
+#include "mobvoi/base/compat.h"
+#include "third_party/kenlm/util/mmap.hh"
+
+namespace mobvoi {
+
+// Next word suggestions of an n-gram model, without querying the model for
+// every word of the vocabulary.
+//
+// For every context n-gram of the model, the index keeps its backoff and the
+// top K continuations of the context with their conditional probabilities,
+// in symbol table labels. Suggest() merges the lists of the suffixes of the
+// query context into candidates, rescores them with the model and ranks
+// them, so a suggestion costs O(K * order) model queries. Since the lists
+// are cut at K, a word missing from them may still outrank the candidates,
+// which Suggest() detects from the last probabilities of the cut lists.
+//
+// The index is built offline by successor_index_builder_main from the ARPA
+// file the kenlm binary was built from, since a probing binary only keeps
+// n-gram hashes. It is memory mapped at load time, and bound to the
+// fingerprints of the symbol table and of the kenlm binary, so that it is
+// rebuilt whenever the model is.
+class SuccessorIndex {
+ public:
+  // Label of <s> in contexts. Unknown words are kNoSymbol, -1.
+  static const int32 kBeginOfSentence = -2;
+
+  struct Suggestion {
+    int32 label;
+    // log10 probability of the word following the context.
+    float log10_prob;
+  };
+
+  // Build the index of the ARPA file |arpa_path| and write it to
+  // |output_path|. Words which are not in |symbols| are skipped.
+  static bool Build(const string& arpa_path, const fst::SymbolTable& symbols,
+                    int top_k, uint64 kenlm_fingerprint,
+                    const string& output_path);
+
+  // Map an index written by Build(). Return nullptr if the file is missing,
+  // corrupted, or built from another symbol table or kenlm binary.
+  static SuccessorIndex* Load(const string& path,
+                              uint64 symbol_table_fingerprint,
+                              uint64 kenlm_fingerprint);
+
+  // Candidates of the continuations of |context|, words in reading order:
+  // the lists of its suffixes merged, each word with the log10 probability
+  // of the longest suffix listing it plus the backoffs of the longer ones.
+  // The probability is exact unless a longer suffix cut the word from its
+  // list. Return an upper bound of the log10 probability of the words which
+  // are not candidates, -inf if every word is. With |begin_of_sentence|,
+  // |context| is the start of a sentence.
+  float Candidates(const vector<int32>& context, bool begin_of_sentence,
+                   vector<Suggestion>* candidates) const;
+
+  // Top |num| continuations of |context|, best first, ties by label. The
+  // candidates are ranked by |log10_prob|, the probability of a label given
+  // the context by the model the index was built from. Return false if a
+  // word which is not a candidate may rank among them, in which case
+  // |suggestions| are only approximate and the caller should score the
+  // vocabulary instead.
+  bool Suggest(const vector<int32>& context, bool begin_of_sentence, int num,
+               const std::function<float(int32)>& log10_prob,
+               vector<Suggestion>* suggestions) const;
+
+  int top_k() const { return top_k_; }
+  int max_order() const { return max_order_; }
+
+ private:
+  struct Bucket;
+
+  SuccessorIndex() {}
+
+  const Bucket* Find(const int32* words, int size) const;
+
+  util::scoped_memory mapped_;
+  const Bucket* buckets_ = nullptr;
+  const Suggestion* entries_ = nullptr;
+  uint64 bucket_mask_ = 0;
+  int top_k_ = 0;
+  int max_order_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SuccessorIndex);
+};
+
+}  // namespace mobvoi
+
+#endif  // SERVER_LM_SUCCESSOR_INDEX_H_
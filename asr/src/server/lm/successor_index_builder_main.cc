@@ -0,0 +1,36 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+// Build the next word successor index of InputPredictServer from the ARPA
+// file of its kenlm binary.
+
+#include "fst/symbol-table.h"
+#include "engine/rescorer/relabel_table.h"
+#include "mobvoi/base/at_exit.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/flags.h"
+#include "mobvoi/base/log.h"
+#include "server/lm/successor_index.h"
+
+DEFINE_string(arpa, "", "ARPA file the kenlm binary was built from");
+DEFINE_string(kenlm_model, "",
+              "kenlm binary loaded by the server, the index is bound to it");
+DEFINE_string(word_symbol_table, "", "word symbol table of the server");
+DEFINE_int32(top_k, 32, "continuations kept per context");
+DEFINE_string(output_file, "", "output successor index");
+
+int main(int argc, char** argv) {
+  base::AtExitManager at_exit;
+  const string usage =
+      "Build the successor index of next word suggestions\n"
+      "Usage:  successor_index_builder_main [options] \n";
+  mobvoi::ParseCommandLineFlags(&argc, &argv, true, usage);
+
+  unique_ptr<fst::SymbolTable> symbol_table(
+      fst::SymbolTable::ReadText(FLAGS_word_symbol_table));
+  CHECK(symbol_table) << "Failed to read " << FLAGS_word_symbol_table;
+  uint64 kenlm_fingerprint =
+      mobvoi::RelabelTable::KenLMFingerprint(FLAGS_kenlm_model);
+  CHECK_NE(kenlm_fingerprint, 0) << "Failed to read " << FLAGS_kenlm_model;
+  CHECK(mobvoi::SuccessorIndex::Build(FLAGS_arpa, *symbol_table, FLAGS_top_k,
+                                      kenlm_fingerprint, FLAGS_output_file));
+  return 0;
+}
@@ -0,0 +1,206 @@
+// Copyright 2021 Mobvoi Inc. All Rights Reserved.
+
+#include "server/lm/successor_index.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "engine/rescorer/relabel_table.h"
+#include "mobvoi/base/compat.h"
+#include "mobvoi/base/file.h"
+#include "mobvoi/base/string_util.h"
+#include "third_party/gtest/gtest.h"
+#include "third_party/kenlm/lm/model.hh"
+
+namespace mobvoi {
+
+namespace {
+
+const char kArpaFile[] = "/tmp/successor_index_test.arpa";
+const char kIndexFile[] = "/tmp/successor_index_test.bin";
+const uint64 kKenLMFingerprint = 1234;
+
+// A trigram model with backoffs in both orders of context.
+const char kArpa[] =
+    "\\data\\\n"
+    "ngram 1=9\n"
+    "ngram 2=8\n"
+    "ngram 3=3\n"
+    "\n\\1-grams:\n"
+    "-1.0\t<unk>\n"
+    "-99\t<s>\t-0.5\n"
+    "-0.7\t</s>\n"
+    "-0.8\ta\t-0.3\n"
+    "-0.9\tb\t-0.2\n"
+    "-1.0\tc\t-0.4\n"
+    "-1.1\td\t-0.1\n"
+    "-1.2\te\n"
+    "-1.3\tf\n"
+    "\n\\2-grams:\n"
+    "-0.3\t<s> a\t-0.2\n"
+    "-0.6\t<s> b\n"
+    "-0.4\ta b\t-0.1\n"
+    "-0.5\ta c\n"
+    "-0.9\ta f\n"
+    "-0.2\tb c\n"
+    "-0.7\tb d\n"
+    "-1.5\tc e\n"
+    "\n\\3-grams:\n"
+    "-0.1\t<s> a b\n"
+    "-0.3\t<s> a f\n"
+    "-0.2\ta b c\n"
+    "\n\\end\\\n";
+
+const char* kWords[] = {"a", "b", "c", "d", "e", "f"};
+
+fst::SymbolTable* CreateSymbols() {
+  fst::SymbolTable* symbols = new fst::SymbolTable();
+  symbols->AddSymbol("<eps>", 0);
+  for (const char* word : kWords) symbols->AddSymbol(word);
+  symbols->AddSymbol("</s>");
+  return symbols;
+}
+
+class SuccessorIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(File::WriteStringToFile(kArpa, kArpaFile));
+    symbols_.reset(CreateSymbols());
+    model_.reset(new lm::ngram::ProbingModel(kArpaFile));
+  }
+
+  void TearDown() override {
+    remove(kArpaFile);
+    remove(kIndexFile);
+  }
+
+  SuccessorIndex* BuildIndex(int top_k) {
+    if (!SuccessorIndex::Build(kArpaFile, *symbols_, top_k,
+                               kKenLMFingerprint, kIndexFile)) {
+      return nullptr;
+    }
+    return SuccessorIndex::Load(
+        kIndexFile, RelabelTable::SymbolTableFingerprint(*symbols_),
+        kKenLMFingerprint);
+  }
+
+  // log10 probability of |label| following <s> and |context| in the model.
+  float Score(const vector<int32>& context, int32 label) const {
+    const auto& vocab = model_->GetVocabulary();
+    lm::ngram::State state = model_->BeginSentenceState();
+    lm::ngram::State out;
+    for (int32 word : context) {
+      model_->FullScore(state, vocab.Index(symbols_->Find(word)), out);
+      state = out;
+    }
+    return model_->FullScore(state, vocab.Index(symbols_->Find(label)), out)
+        .prob;
+  }
+
+  // Top |num| words following <s> and |context|, by scoring every word.
+  vector<int32> Scan(const vector<int32>& context, int num) const {
+    vector<pair<float, int32>> scores;
+    for (const char* word : kWords) {
+      int32 label = symbols_->Find(word);
+      scores.emplace_back(-Score(context, label), label);
+    }
+    std::sort(scores.begin(), scores.end());
+    vector<int32> labels;
+    for (int i = 0; i < num && i < static_cast<int>(scores.size()); ++i) {
+      labels.push_back(scores[i].second);
+    }
+    return labels;
+  }
+
+  unique_ptr<fst::SymbolTable> symbols_;
+  unique_ptr<lm::ngram::ProbingModel> model_;
+};
+
+}  // namespace
+
+TEST_F(SuccessorIndexTest, BuildAndLoad) {
+  unique_ptr<SuccessorIndex> index(BuildIndex(4));
+  ASSERT_TRUE(index != nullptr);
+  EXPECT_EQ(4, index->top_k());
+  EXPECT_EQ(3, index->max_order());
+
+  // The candidates of "<s> a" are the listed ones with their probabilities
+  // in the ARPA file, backed off to the lists of "a" and of the unigrams.
+  vector<SuccessorIndex::Suggestion> candidates;
+  const int32 a = symbols_->Find("a");
+  const int32 b = symbols_->Find("b");
+  const int32 f = symbols_->Find("f");
+  index->Candidates({a}, true, &candidates);
+  ASSERT_LE(2u, candidates.size());
+  EXPECT_EQ(b, candidates[0].label);
+  EXPECT_FLOAT_EQ(-0.1f, candidates[0].log10_prob);
+  EXPECT_EQ(f, candidates[1].label);
+  EXPECT_FLOAT_EQ(-0.3f, candidates[1].log10_prob);
+  for (const auto& candidate : candidates) {
+    EXPECT_FLOAT_EQ(Score({a}, candidate.label), candidate.log10_prob)
+        << symbols_->Find(candidate.label);
+  }
+}
+
+TEST_F(SuccessorIndexTest, RejectStaleOrCorrupted) {
+  unique_ptr<SuccessorIndex> index(BuildIndex(4));
+  ASSERT_TRUE(index != nullptr);
+  const uint64 symbols = RelabelTable::SymbolTableFingerprint(*symbols_);
+  EXPECT_TRUE(SuccessorIndex::Load(kIndexFile, symbols + 1,
+                                   kKenLMFingerprint) == nullptr);
+  EXPECT_TRUE(SuccessorIndex::Load(kIndexFile, symbols,
+                                   kKenLMFingerprint + 1) == nullptr);
+  EXPECT_TRUE(SuccessorIndex::Load("not_existed", symbols,
+                                   kKenLMFingerprint) == nullptr);
+
+  string content;
+  ASSERT_TRUE(File::ReadFileToString(kIndexFile, &content));
+  string truncated = content.substr(0, content.size() - 1);
+  ASSERT_TRUE(File::WriteStringToFile(truncated, kIndexFile));
+  EXPECT_TRUE(SuccessorIndex::Load(kIndexFile, symbols,
+                                   kKenLMFingerprint) == nullptr);
+  string bad_magic = content;
+  bad_magic[0] ^= 0x01;
+  ASSERT_TRUE(File::WriteStringToFile(bad_magic, kIndexFile));
+  EXPECT_TRUE(SuccessorIndex::Load(kIndexFile, symbols,
+                                   kKenLMFingerprint) == nullptr);
+}
+
+// Suggest() must agree with scoring every word, or tell that it may not.
+TEST_F(SuccessorIndexTest, SuggestSameAsScan) {
+  const vector<vector<string>> contexts = {
+      {}, {"a"}, {"b"}, {"c"}, {"d"}, {"f"}, {"a", "b"}, {"b", "a"},
+      {"c", "a", "b"}};
+  auto log10_prob = [this](const vector<int32>& context) {
+    return [this, context](int32 label) { return Score(context, label); };
+  };
+  for (int top_k : {2, 3, 16}) {
+    unique_ptr<SuccessorIndex> index(BuildIndex(top_k));
+    ASSERT_TRUE(index != nullptr);
+    int exact = 0;
+    for (const auto& words : contexts) {
+      vector<int32> context;
+      for (const auto& word : words) context.push_back(symbols_->Find(word));
+      for (int num : {1, 2, 3, 6}) {
+        vector<SuccessorIndex::Suggestion> suggestions;
+        if (!index->Suggest(context, true, num, log10_prob(context),
+                            &suggestions)) {
+          // Lists longer than the vocabulary are never cut.
+          EXPECT_GT(6, top_k);
+          continue;
+        }
+        ++exact;
+        vector<int32> labels;
+        for (const auto& suggestion : suggestions) {
+          labels.push_back(suggestion.label);
+        }
+        EXPECT_EQ(Scan(context, num), labels)
+            << "top_k " << top_k << " num " << num << " context "
+            << JoinVectorToString(words, " ");
+      }
+    }
+    EXPECT_LT(0, exact) << "top_k " << top_k;
+  }
+}
+
+}  // namespace mobvoi
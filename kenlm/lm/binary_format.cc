@@ -9,6 +9,7 @@
 #include <limits>
 #include <string>
 #include <cstdlib>
+#include <ostream>
 
 #include <stdint.h>
 
@@ -137,6 +138,7 @@ const std::size_t kInvalidSize = static_cast<std::size_t>(-1);
 
 BinaryFormat::BinaryFormat(const Config &config)
   : write_method_(config.write_method), write_mmap_(config.write_mmap), load_method_(config.load_method),
+    lock_memory_(config.lock_memory), warm_up_(config.warm_up), messages_(config.messages),
     header_size_(kInvalidSize), vocab_size_(kInvalidSize), vocab_string_offset_(kInvalidOffset) {}
 
 void BinaryFormat::InitializeBinary(int fd, ModelType model_type, unsigned int search_version, Parameters &params) {
@@ -160,6 +162,10 @@ void *BinaryFormat::LoadBinary(std::size_t size) {
   UTIL_THROW_IF(file_size != util::kBadSize && file_size < total_map, FormatLoadException, "Binary file has size " << file_size << " but the headers say it should be at least " << total_map);
 
   util::MapRead(load_method_, file_.get(), 0, util::CheckOverflow(total_map), mapping_);
+  if (warm_up_)
+    util::TouchPages(mapping_.get(), mapping_.size());
+  if (lock_memory_ && !util::LockMemory(mapping_.get(), mapping_.size()) && messages_)
+    *messages_ << "Failed to lock " << mapping_.size() << " bytes of the model in memory." << std::endl;
 
   vocab_string_offset_ = total_map;
   return reinterpret_cast<uint8_t*>(mapping_.get()) + header_size_;
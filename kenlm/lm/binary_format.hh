@@ -78,6 +78,10 @@ class BinaryFormat {
     const Config::WriteMethod write_method_;
     const char *write_mmap_;
     util::LoadMethod load_method_;
+    bool lock_memory_;
+    bool warm_up_;
+    // Where a failure to lock the model is reported, see Config::messages.
+    std::ostream *messages_;
 
     // File behind memory, if any.
     util::scoped_fd file_;
@@ -101,6 +105,9 @@ class BinaryFormat {
 
 bool IsBinaryFormat(int fd);
 
+// Read the parameters from the header of a binary file.
+void ReadHeader(int fd, Parameters &params);
+
 } // namespace ngram
 } // namespace lm
 #endif // LM_BINARY_FORMAT_H
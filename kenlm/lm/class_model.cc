@@ -0,0 +1,75 @@
+#include "lm/class_model.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+namespace lm {
+namespace ngram {
+
+const uint32_t ClassMembers::kRoot;
+const uint32_t ClassMembers::kNoNode;
+const float ClassMembers::kDefaultUnknownLog10 = -100.0;
+const WordIndex ClassState::kNoClass;
+
+ClassMembers::ClassMembers(float unknown_log10) : unknown_log10_(unknown_log10), members_(0) {
+  Finish();
+}
+
+void ClassMembers::Add(const WordIndex *begin, const WordIndex *end, float weight) {
+  if (begin == end || weight <= 0.0) return;
+  pending_.push_back(std::make_pair(std::vector<WordIndex>(begin, end), weight));
+}
+
+std::vector<ClassMembers::Edge>::const_iterator ClassMembers::LowerBound(uint64_t key) const {
+  Edge edge;
+  edge.key = key;
+  return std::lower_bound(edges_.begin(), edges_.end(), edge);
+}
+
+void ClassMembers::Finish() {
+  // Build the trie of the added members, weights in linear space: the total
+  // weight of the members under each node, and of the ones ending at it.
+  std::vector<std::pair<std::vector<WordIndex>, float> > members;
+  members.swap(pending_);
+  std::map<uint64_t, uint32_t> children;
+  std::vector<double> total(1, 0.0), ending(1, 0.0);
+  std::vector<uint32_t> parents(1, kNoNode);
+  for (std::size_t i = 0; i < members.size(); ++i) {
+    const std::vector<WordIndex> &words = members[i].first;
+    const double weight = members[i].second;
+    uint32_t node = kRoot;
+    total[node] += weight;
+    for (std::size_t j = 0; j < words.size(); ++j) {
+      std::pair<std::map<uint64_t, uint32_t>::iterator, bool> inserted =
+        children.insert(std::make_pair(Key(node, words[j]), static_cast<uint32_t>(total.size())));
+      if (inserted.second) {
+        total.push_back(0.0);
+        ending.push_back(0.0);
+        parents.push_back(node);
+      }
+      node = inserted.first->second;
+      total[node] += weight;
+    }
+    ending[node] += weight;
+  }
+
+  nodes_.resize(total.size());
+  for (std::size_t node = 0; node < total.size(); ++node) {
+    Node &to = nodes_[node];
+    to.enter = node == kRoot ? 0.0 : std::log10(total[node] / total[parents[node]]);
+    to.end = ending[node] > 0.0 ? std::log10(ending[node] / total[node]) : unknown_log10_;
+  }
+  edges_.clear();
+  edges_.reserve(children.size());
+  for (std::map<uint64_t, uint32_t>::const_iterator i = children.begin(); i != children.end(); ++i) {
+    Edge edge;
+    edge.key = i->first;
+    edge.child = i->second;
+    edges_.push_back(edge);
+  }
+  members_ = members.size();
+}
+
+} // namespace ngram
+} // namespace lm
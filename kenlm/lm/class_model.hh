@@ -0,0 +1,245 @@
+/* Class-based querying on top of any model.  A top level model has class
+ * tokens in its vocabulary, e.g. $CONTACT, and each class has members, word
+ * sequences with their probabilities given the class, e.g. the contacts of a
+ * user.  Members are small and can be swapped per session, while the top
+ * level model is shared, so a session costs memory in proportion to its
+ * class content rather than to a full model.
+ *
+ * Usage:
+ * 1. Build a ClassMembers per class, calling Add per member, then Finish.
+ * 2. Construct ClassQuery over the top level model and bind the members of
+ *    each class token with SetMembers.
+ * 3. Score words with FullScore.  Call EnterClass before the words of a
+ *    member and ExitClass after them.  The ClassState records whether the
+ *    query is inside a class and where in its members, so it carries over
+ *    between calls like State does.
+ *
+ * Entering scores the class token in the top level model.  Inside, a word
+ * is scored by the members sharing the prefix read so far, and exiting by
+ * those ending there, so a whole member scores its probability given the
+ * class.  After exiting, words are scored in the context of the class token.
+ */
+
+#ifndef LM_CLASS_MODEL_H
+#define LM_CLASS_MODEL_H
+
+#include "lm/return.hh"
+#include "lm/state.hh"
+#include "lm/word_index.hh"
+
+#include <stdint.h>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+namespace lm {
+namespace ngram {
+
+// Members of a class.  Member words are ids chosen by the caller, which need
+// not be in the vocabulary of the top level model.
+class ClassMembers {
+  public:
+    static const uint32_t kRoot = 0;
+    // Node of a prefix no member starts with.
+    static const uint32_t kNoNode = static_cast<uint32_t>(-1);
+
+    // Same as Config::unknown_missing_logprob.
+    static const float kDefaultUnknownLog10;
+
+    // unknown_log10 scores a word which continues no member, like
+    // Config::unknown_missing_logprob does for a missing <unk>.
+    explicit ClassMembers(float unknown_log10 = kDefaultUnknownLog10);
+
+    // Add a member of the words [begin, end), weighed against the other
+    // members.  A member added again adds up its weights.
+    void Add(const WordIndex *begin, const WordIndex *end, float weight = 1.0);
+
+    // Build the members added so far, replacing any built before.  Call after
+    // the last Add and before Next.
+    void Finish();
+
+    // Move from node by word, setting log10_prob to the probability of the
+    // word given the prefix of node.  Returns kNoNode if no member continues.
+    uint32_t Next(uint32_t node, WordIndex word, float &log10_prob) const {
+      if (node == kNoNode) {
+        log10_prob = unknown_log10_;
+        return kNoNode;
+      }
+      const uint64_t key = Key(node, word);
+      std::vector<Edge>::const_iterator it = LowerBound(key);
+      if (it == edges_.end() || it->key != key) {
+        log10_prob = unknown_log10_;
+        return kNoNode;
+      }
+      log10_prob = nodes_[it->child].enter;
+      return it->child;
+    }
+
+    // log10 probability that the member ends at node.
+    float End(uint32_t node) const {
+      return node == kNoNode ? 0.0 : nodes_[node].end;
+    }
+
+    std::size_t Members() const { return members_; }
+
+  private:
+    struct Node {
+      // log10 probabilities of moving to the node from its parent and of
+      // ending at the node.
+      float enter;
+      float end;
+    };
+
+    struct Edge {
+      uint64_t key;
+      uint32_t child;
+      bool operator<(const Edge &other) const { return key < other.key; }
+    };
+
+    static uint64_t Key(uint32_t node, WordIndex word) {
+      return (static_cast<uint64_t>(node) << 32) | static_cast<uint32_t>(word);
+    }
+
+    std::vector<Edge>::const_iterator LowerBound(uint64_t key) const;
+
+    float unknown_log10_;
+    std::size_t members_;
+    std::vector<Node> nodes_;
+    // Sorted by key, the parent node and the word.
+    std::vector<Edge> edges_;
+
+    // Added members, until Finish.
+    std::vector<std::pair<std::vector<WordIndex>, float> > pending_;
+};
+
+struct ClassState {
+  // The context in the top level model.  Inside a class, the context after
+  // the class token, which words after the class see.
+  State top;
+  // The class token the state is inside, or kNoClass.
+  WordIndex class_token;
+  // Prefix of the members read so far, see ClassMembers::Next.
+  uint32_t node;
+
+  static const WordIndex kNoClass = static_cast<WordIndex>(-1);
+
+  bool InClass() const { return class_token != kNoClass; }
+
+  bool operator==(const ClassState &other) const {
+    return class_token == other.class_token && node == other.node && top == other.top;
+  }
+};
+
+template <class Model> class ClassQuery {
+  public:
+    explicit ClassQuery(const Model &model) : model_(model) {}
+
+    // Bind the members of class_token, a word of the model, for the following
+    // queries.  NULL unbinds it.  The members must outlive the binding.
+    void SetMembers(WordIndex class_token, const ClassMembers *members) {
+      for (std::size_t i = 0; i < classes_.size(); ++i) {
+        if (classes_[i].first == class_token) {
+          if (members) {
+            classes_[i].second = members;
+          } else {
+            classes_.erase(classes_.begin() + i);
+          }
+          return;
+        }
+      }
+      if (members) classes_.push_back(std::make_pair(class_token, members));
+    }
+
+    ClassState BeginSentenceState() const {
+      ClassState state;
+      state.top = model_.BeginSentenceState();
+      state.class_token = ClassState::kNoClass;
+      state.node = ClassMembers::kRoot;
+      return state;
+    }
+
+    ClassState NullContextState() const {
+      ClassState state;
+      state.top = model_.NullContextState();
+      state.class_token = ClassState::kNoClass;
+      state.node = ClassMembers::kRoot;
+      return state;
+    }
+
+    // Score word after in: in the top level model outside a class, among the
+    // members of the class inside one.
+    FullScoreReturn FullScore(const ClassState &in, WordIndex word, ClassState &out) const {
+      if (!in.InClass()) {
+        out.class_token = ClassState::kNoClass;
+        out.node = ClassMembers::kRoot;
+        return model_.FullScore(in.top, word, out.top);
+      }
+      FullScoreReturn ret;
+      memset(&ret, 0, sizeof(ret));
+      const ClassMembers *members = Members(in.class_token);
+      out.top = in.top;
+      out.class_token = in.class_token;
+      if (members) {
+        out.node = members->Next(in.node, word, ret.prob);
+      } else {
+        // A class without members knows no word.
+        out.node = ClassMembers::kNoNode;
+        ret.prob = ClassMembers::kDefaultUnknownLog10;
+      }
+      return ret;
+    }
+
+    // Score class_token after in, entering the class.  in must be outside a
+    // class.
+    FullScoreReturn EnterClass(const ClassState &in, WordIndex class_token, ClassState &out) const {
+      FullScoreReturn ret = model_.FullScore(in.top, class_token, out.top);
+      out.class_token = class_token;
+      out.node = ClassMembers::kRoot;
+      return ret;
+    }
+
+    // Score the end of the member read since EnterClass, leaving the class.
+    FullScoreReturn ExitClass(const ClassState &in, ClassState &out) const {
+      FullScoreReturn ret;
+      memset(&ret, 0, sizeof(ret));
+      if (in.InClass()) {
+        const ClassMembers *members = Members(in.class_token);
+        if (members) ret.prob = members->End(in.node);
+      }
+      out.top = in.top;
+      out.class_token = ClassState::kNoClass;
+      out.node = ClassMembers::kRoot;
+      return ret;
+    }
+
+    // Score a whole member of class_token, [begin, end), after in.
+    float ScoreMember(const ClassState &in, WordIndex class_token, const WordIndex *begin, const WordIndex *end, ClassState &out) const {
+      ClassState states[2];
+      float prob = EnterClass(in, class_token, states[0]).prob;
+      unsigned int current = 0;
+      for (const WordIndex *i = begin; i != end; ++i, current ^= 1) {
+        prob += FullScore(states[current], *i, states[current ^ 1]).prob;
+      }
+      prob += ExitClass(states[current], out).prob;
+      return prob;
+    }
+
+    const Model &TopModel() const { return model_; }
+
+  private:
+    const ClassMembers *Members(WordIndex class_token) const {
+      for (std::size_t i = 0; i < classes_.size(); ++i) {
+        if (classes_[i].first == class_token) return classes_[i].second;
+      }
+      return NULL;
+    }
+
+    const Model &model_;
+    // Few classes per session, so a vector beats a map.
+    std::vector<std::pair<WordIndex, const ClassMembers*> > classes_;
+};
+
+} // namespace ngram
+} // namespace lm
+
+#endif // LM_CLASS_MODEL_H
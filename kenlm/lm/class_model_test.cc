@@ -0,0 +1,130 @@
+#include "lm/class_model.hh"
+#include "lm/model.hh"
+
+#include <cmath>
+
+#define BOOST_TEST_MODULE ClassModelTest
+#include <boost/test/unit_test.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+namespace lm {
+namespace ngram {
+namespace {
+
+// Apparently some Boost versions use templates and are pretty strict about types matching.
+#define SLOPPY_CHECK_CLOSE(ref, value, tol) BOOST_CHECK_CLOSE(static_cast<double>(ref), static_cast<double>(value), static_cast<double>(tol));
+
+const char *TestLocation() {
+  return boost::unit_test::framework::master_test_suite().argv[1];
+}
+
+// Members of the contact class, in ids of the caller.
+const WordIndex kAlice = 1000, kSmith = 1001, kJones = 1002, kBob = 1003;
+
+void BuildContacts(ClassMembers &members) {
+  const WordIndex alice_smith[] = {kAlice, kSmith};
+  const WordIndex alice_jones[] = {kAlice, kJones};
+  const WordIndex bob[] = {kBob};
+  members.Add(alice_smith, alice_smith + 2);
+  members.Add(alice_jones, alice_jones + 2);
+  members.Add(bob, bob + 1, 2.0);
+  members.Finish();
+}
+
+BOOST_AUTO_TEST_CASE(Members) {
+  ClassMembers members;
+  BuildContacts(members);
+  BOOST_CHECK_EQUAL(3, members.Members());
+
+  float prob;
+  uint32_t alice = members.Next(ClassMembers::kRoot, kAlice, prob);
+  BOOST_CHECK(alice != ClassMembers::kNoNode);
+  SLOPPY_CHECK_CLOSE(std::log10(0.5), prob, 0.001);
+  uint32_t smith = members.Next(alice, kSmith, prob);
+  SLOPPY_CHECK_CLOSE(std::log10(0.5), prob, 0.001);
+  BOOST_CHECK_EQUAL(0.0, members.End(smith));
+  BOOST_CHECK_EQUAL(-100.0, members.End(alice));
+
+  BOOST_CHECK_EQUAL(ClassMembers::kNoNode, members.Next(ClassMembers::kRoot, kSmith, prob));
+  BOOST_CHECK_EQUAL(-100.0, prob);
+  BOOST_CHECK_EQUAL(ClassMembers::kNoNode, members.Next(ClassMembers::kNoNode, kAlice, prob));
+}
+
+BOOST_AUTO_TEST_CASE(Query) {
+  Config config;
+  config.messages = NULL;
+  ProbingModel model(TestLocation(), config);
+  const WordIndex contact = model.GetVocabulary().Index("biarritz");
+  const WordIndex call = model.GetVocabulary().Index("call");
+  const WordIndex also = model.GetVocabulary().Index("also");
+
+  ClassMembers contacts;
+  BuildContacts(contacts);
+  ClassQuery<ProbingModel> query(model);
+  query.SetMembers(contact, &contacts);
+
+  // call <contact: alice smith> also
+  ClassState state = query.BeginSentenceState(), out;
+  State expected_state, expected_out;
+  query.FullScore(state, call, out);
+  state = out;
+  model.FullScore(model.BeginSentenceState(), call, expected_state);
+
+  float prob = query.EnterClass(state, contact, out).prob;
+  SLOPPY_CHECK_CLOSE(model.FullScore(expected_state, contact, expected_out).prob, prob, 0.001);
+  BOOST_CHECK(out.InClass());
+  state = out;
+  expected_state = expected_out;
+
+  SLOPPY_CHECK_CLOSE(std::log10(0.5), query.FullScore(state, kAlice, out).prob, 0.001);
+  state = out;
+  SLOPPY_CHECK_CLOSE(std::log10(0.5), query.FullScore(state, kSmith, out).prob, 0.001);
+  state = out;
+  BOOST_CHECK_EQUAL(0.0, query.ExitClass(state, out).prob);
+  BOOST_CHECK(!out.InClass());
+  state = out;
+
+  // Words after the class see the class token.
+  SLOPPY_CHECK_CLOSE(model.FullScore(expected_state, also, expected_out).prob,
+                     query.FullScore(state, also, out).prob, 0.001);
+  BOOST_CHECK(out.top == expected_out);
+
+  // The same through ScoreMember.
+  ClassState start = query.BeginSentenceState();
+  query.FullScore(start, call, state);
+  const WordIndex bob[] = {kBob};
+  const float enter = query.EnterClass(state, contact, out).prob;
+  SLOPPY_CHECK_CLOSE(enter + std::log10(0.5), query.ScoreMember(state, contact, bob, bob + 1, out), 0.001);
+  BOOST_CHECK(!out.InClass());
+}
+
+BOOST_AUTO_TEST_CASE(SwapMembers) {
+  Config config;
+  config.messages = NULL;
+  ProbingModel model(TestLocation(), config);
+  const WordIndex contact = model.GetVocabulary().Index("biarritz");
+
+  // Two sessions share the model with their own contacts.
+  ClassMembers first, second;
+  BuildContacts(first);
+  const WordIndex alice[] = {kAlice};
+  second.Add(alice, alice + 1);
+  second.Finish();
+  ClassQuery<ProbingModel> first_query(model), second_query(model);
+  first_query.SetMembers(contact, &first);
+  second_query.SetMembers(contact, &second);
+
+  ClassState begin = first_query.BeginSentenceState(), out;
+  const float enter = first_query.EnterClass(begin, contact, out).prob;
+  SLOPPY_CHECK_CLOSE(enter + std::log10(0.5) + -100.0,
+                     first_query.ScoreMember(begin, contact, alice, alice + 1, out), 0.001);
+  SLOPPY_CHECK_CLOSE(enter, second_query.ScoreMember(begin, contact, alice, alice + 1, out), 0.001);
+
+  // Unbound classes know no member.
+  second_query.SetMembers(contact, NULL);
+  SLOPPY_CHECK_CLOSE(enter - 100.0, second_query.ScoreMember(begin, contact, alice, alice + 1, out), 0.001);
+}
+
+} // namespace
+} // namespace ngram
+} // namespace lm
@@ -24,7 +24,9 @@ Config::Config() :
   prob_bits(8),
   backoff_bits(8),
   pointer_bhiksha_bits(22),
-  load_method(util::POPULATE_OR_READ) {}
+  load_method(util::POPULATE_OR_READ),
+  lock_memory(false),
+  warm_up(false) {}
 
 } // namespace ngram
 } // namespace lm
@@ -114,6 +114,14 @@ struct Config {
   // See util/mmap.hh for details of MapMethod.
   util::LoadMethod load_method;
 
+  // Lock the loaded model in memory, see util::LockMemory.  Failing to lock
+  // is only a warning.
+  bool lock_memory;
+
+  // Fault in every page of the loaded model, so that a lazily mapped model
+  // does not pay page faults on its first queries.
+  bool warm_up;
+
 
   // Set defaults.
   Config();
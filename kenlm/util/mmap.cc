@@ -355,6 +355,25 @@ void MapRead(LoadMethod method, int fd, uint64_t offset, std::size_t size, scope
   }
 }
 
+bool LockMemory(const void *start, std::size_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+  return VirtualLock(const_cast<void*>(start), size) != 0;
+#else
+  return mlock(start, size) == 0;
+#endif
+}
+
+void TouchPages(const void *start, std::size_t size) {
+  const volatile char *begin = static_cast<const volatile char*>(start);
+  const std::size_t page = SizePage();
+  char sum = 0;
+  for (std::size_t i = 0; i < size; i += page) {
+    sum ^= begin[i];
+  }
+  if (size) sum ^= begin[size - 1];
+  (void)sum;
+}
+
 void *MapZeroedWrite(int fd, std::size_t size) {
   ResizeOrThrow(fd, 0);
   ResizeOrThrow(fd, size);
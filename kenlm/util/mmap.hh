@@ -154,6 +154,13 @@ enum LoadMethod {
 
 void MapRead(LoadMethod method, int fd, uint64_t offset, std::size_t size, scoped_memory &out);
 
+// Lock memory so that it is never paged out.  Returns false (and leaves the
+// memory as is) if the system refuses, e.g. because of RLIMIT_MEMLOCK.
+bool LockMemory(const void *start, std::size_t size);
+
+// Fault in memory by reading a byte of every page.
+void TouchPages(const void *start, std::size_t size);
+
 // Open file name with mmap of size bytes, all of which are initially zero.
 void *MapZeroedWrite(int fd, std::size_t size);
 void *MapZeroedWrite(const char *name, std::size_t size, scoped_fd &file);
@@ -194,6 +194,19 @@ uint64_t RSSMax() {
 #endif
 }
 
+uint64_t RSSCurrent() {
+#if defined(__linux__)
+  // statm is in pages: total size, then resident.
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size, resident;
+  if (!(statm >> size >> resident))
+    return 0;
+  return resident * static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+#else
+  return 0;
+#endif
+}
+
 void PrintUsage(std::ostream &out) {
 #if !defined(_WIN32) && !defined(_WIN64)
   // Linux doesn't set memory usage in getrusage :-(
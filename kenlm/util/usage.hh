@@ -18,6 +18,9 @@ double ThreadTime();
 // Resident usage in bytes.
 uint64_t RSSMax();
 
+// Current resident usage in bytes.  Zero on unsupported platforms.
+uint64_t RSSCurrent();
+
 void PrintUsage(std::ostream &to);
 
 // Determine how much physical memory there is.  Return 0 on failure.